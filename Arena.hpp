@@ -0,0 +1,260 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#include "Tree.hpp"
+
+namespace Tree
+{
+/// Bump-аллокатор: память выдаётся подряд из больших блоков
+/// и освобождается только целиком, вместе с самой ареной.
+class Arena
+{
+public:
+	static constexpr std::size_t defaultBlockSize = 1 << 20;
+
+	explicit Arena(const std::size_t blockSize = defaultBlockSize) :
+		blockSize_(blockSize)
+	{
+	}
+
+	Arena(const Arena&) = delete;
+	Arena& operator = (const Arena&) = delete;
+
+	void* allocate(const std::size_t size, const std::size_t alignment)
+	{
+		auto address = reinterpret_cast<std::uintptr_t>(cursor_);
+		auto aligned = (address + alignment - 1) & ~(alignment - 1);
+		if(!cursor_ || aligned + size > reinterpret_cast<std::uintptr_t>(end_))
+		{
+			grow(size + alignment);
+			address = reinterpret_cast<std::uintptr_t>(cursor_);
+			aligned = (address + alignment - 1) & ~(alignment - 1);
+		}
+		cursor_ = reinterpret_cast<char*>(aligned + size);
+		return reinterpret_cast<void*>(aligned);
+	}
+
+	template <class T, class... Args>
+	T* create(Args&&... args)
+	{
+		static_assert(std::is_trivially_destructible<T>::value,
+			"arena never runs destructors");
+		return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+	}
+
+	template <class T>
+	T* createArray(const std::size_t count)
+	{
+		static_assert(std::is_trivially_destructible<T>::value,
+			"arena never runs destructors");
+		if(count == 0)
+		{
+			return nullptr;
+		}
+		return new (allocate(sizeof(T) * count, alignof(T))) T[count]();
+	}
+
+	const char* copy(const char *data, const std::size_t size)
+	{
+		auto copied = static_cast<char*>(allocate(size + 1, 1));
+		if(size > 0)
+		{
+			std::memcpy(copied, data, size);
+		}
+		copied[size] = '\0';
+		return copied;
+	}
+
+	std::size_t bytesReserved() const
+	{
+		return reserved_;
+	}
+
+private:
+	void grow(const std::size_t minimalSize)
+	{
+		const auto size = minimalSize > blockSize_ ? minimalSize : blockSize_;
+		blocks_.emplace_back(new char[size]);
+		cursor_ = blocks_.back().get();
+		end_ = cursor_ + size;
+		reserved_ += size;
+	}
+
+	std::size_t blockSize_;
+	std::size_t reserved_ = 0;
+	char *cursor_ = nullptr;
+	char *end_ = nullptr;
+	std::vector<std::unique_ptr<char[]>> blocks_;
+};
+
+/// Узел дерева, целиком живущий в арене: данные и массив детей
+/// лежат рядом с ним, поэтому деструкторы не нужны вовсе.
+class ArenaNode : public Abstract
+{
+	friend class ArenaBuilder;
+
+public:
+	ArenaNode(const Type type, const char *data, const int dataSize, const int childrenCount) :
+		type_(type),
+		dataSize_(dataSize),
+		childrenCount_(childrenCount),
+		data_(data)
+	{
+	}
+
+	virtual bool isEmpty()
+	{
+		return false;
+	}
+
+	virtual int childrenCount() const
+	{
+		return childrenCount_;
+	}
+
+	virtual void traverse(std::function<void(Abstract const *)> initial,
+				  std::function<void(Abstract const *)> final) const
+	{
+		traverseIteratively(initial, final);
+	}
+
+	virtual Abstract const* child(const int index) const
+	{
+		return children_[index];
+	}
+
+	virtual Type type() const
+	{
+		return type_;
+	}
+
+	virtual std::pair<const char*, int> bytes() const
+	{
+		return {data_, dataSize_};
+	}
+
+protected:
+	virtual void addChild(TreePtr child)
+	{
+	}
+
+	virtual std::string dataToText() const
+	{
+		return textForData(type_, bytes());
+	}
+
+	virtual bool isDataEqual(Abstract const *tree) const
+	{
+		return isSameData(this, tree);
+	}
+
+private:
+	Type type_;
+	int dataSize_;
+	int childrenCount_;
+	const char *data_;
+	ArenaNode const **children_ = nullptr;
+};
+
+/// Собирает дерево в арене по сегментам в прямом порядке обхода,
+/// в том же виде, в каком они лежат в потоке IO.
+/// Всё дерево освобождается одним освобождением арены.
+class ArenaBuilder
+{
+public:
+	explicit ArenaBuilder(const std::size_t blockSize = Arena::defaultBlockSize) :
+		arena_(std::make_shared<Arena>(blockSize)),
+		blockSize_(blockSize)
+	{
+	}
+
+	bool add(const Type type, const char *data, const int dataSize, const int childrenCount)
+	{
+		if(type == Type::INVALID || childrenCount < 0 || dataSize < 0
+			|| (root_ && stack_.empty()))
+		{
+			return false;
+		}
+
+		auto node = arena_->create<ArenaNode>(type,
+			arena_->copy(data, dataSize), dataSize, childrenCount);
+		node->children_ = arena_->createArray<ArenaNode const *>(childrenCount);
+
+		if(!root_)
+		{
+			root_ = node;
+		}
+		else
+		{
+			auto &parent = stack_.back();
+			parent.node_->children_[parent.filled_++] = node;
+			if(parent.filled_ == parent.node_->childrenCount_)
+			{
+				stack_.pop_back();
+			}
+		}
+
+		if(childrenCount > 0)
+		{
+			stack_.push_back({node, 0});
+		}
+		return true;
+	}
+
+	bool isComplete() const
+	{
+		return root_ && stack_.empty();
+	}
+
+	/// Память арены дерева, которое строится сейчас.
+	std::size_t bytesReserved() const
+	{
+		return arena_->bytesReserved();
+	}
+
+	/// Следующее дерево строится в новой арене с тем же размером блока.
+	TreeConstPtr finish()
+	{
+		if(!isComplete())
+		{
+			return makeConstPtr<Empty>();
+		}
+		TreeConstPtr tree(arena_, root_);
+		arena_ = std::make_shared<Arena>(blockSize_);
+		root_ = nullptr;
+		return tree;
+	}
+
+	static TreeConstPtr copy(TreeConstPtr tree, const std::size_t blockSize = Arena::defaultBlockSize)
+	{
+		ArenaBuilder builder(blockSize);
+		if(tree)
+		{
+			tree->visit([&builder](Abstract const * node){
+				const auto [data, dataSize] = node->bytes();
+				builder.add(node->type(), data, dataSize, node->childrenCount());
+			}, [](Abstract const * ){});
+		}
+		return builder.finish();
+	}
+
+private:
+	struct Pending
+	{
+		ArenaNode *node_;
+		int filled_;
+	};
+
+	std::shared_ptr<Arena> arena_;
+	std::size_t blockSize_;
+	ArenaNode *root_ = nullptr;
+	std::vector<Pending> stack_;
+};
+}
@@ -0,0 +1,360 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace Tree
+{
+/// Конвейер файлового ввода-вывода: отдельный поток читает или пишет
+/// файл блоками через кольцо буферов, пока основной поток разбирает
+/// или формирует сегменты, так что ожидание диска и работа CPU
+/// перекрываются.
+namespace Async
+{
+constexpr std::size_t defaultChunkSize = 1 << 20;
+constexpr std::size_t defaultChunkCount = 4;
+
+/// Кольцо из count буферов между двумя потоками: производитель
+/// заполняет свободные буферы, потребитель забирает их по порядку.
+/// Буфер принадлежит одной стороне от acquire до publish/release,
+/// поэтому данные не копируются и не защищаются mutex.
+class Ring
+{
+public:
+	Ring(const std::size_t count, const std::size_t chunkSize) :
+		buffers_(count, std::vector<char>(chunkSize)),
+		sizes_(count)
+	{
+	}
+
+	std::size_t chunkSize() const
+	{
+		return buffers_.front().size();
+	}
+
+	/// Следующий свободный буфер или nullptr, если потребитель ушёл.
+	char* acquireFree()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		changed_.wait(lock, [this](){ return cancelled_ || produced_ - consumed_ < buffers_.size(); });
+		if(cancelled_)
+		{
+			return nullptr;
+		}
+		return buffers_[produced_ % buffers_.size()].data();
+	}
+
+	void publish(const std::size_t size)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			sizes_[produced_ % buffers_.size()] = size;
+			++produced_;
+		}
+		changed_.notify_all();
+	}
+
+	/// Следующий заполненный буфер; false, когда данных больше не будет.
+	bool acquireFull(const char *&data, std::size_t &size)
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		changed_.wait(lock, [this](){ return cancelled_ || finished_ || produced_ > consumed_; });
+		if(cancelled_ || produced_ == consumed_)
+		{
+			return false;
+		}
+		data = buffers_[consumed_ % buffers_.size()].data();
+		size = sizes_[consumed_ % buffers_.size()];
+		return true;
+	}
+
+	void release()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			++consumed_;
+		}
+		changed_.notify_all();
+	}
+
+	/// Ждёт, пока потребитель заберёт всё опубликованное.
+	void drain()
+	{
+		std::unique_lock<std::mutex> lock(mutex_);
+		changed_.wait(lock, [this](){ return cancelled_ || produced_ == consumed_; });
+	}
+
+	/// Производитель больше ничего не опубликует.
+	void finish()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			finished_ = true;
+		}
+		changed_.notify_all();
+	}
+
+	/// Потребитель больше ничего не заберёт.
+	void cancel()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			cancelled_ = true;
+		}
+		changed_.notify_all();
+	}
+
+private:
+	std::mutex mutex_;
+	std::condition_variable changed_;
+	std::vector<std::vector<char>> buffers_;
+	std::vector<std::size_t> sizes_;
+	std::uint64_t produced_ = 0;
+	std::uint64_t consumed_ = 0;
+	bool finished_ = false;
+	bool cancelled_ = false;
+};
+
+/// streambuf, который отдаёт блоки файла, заранее прочитанные
+/// отдельным потоком. Подходит для IStream и Compact::StreamSource.
+class ReadBuffer : public std::streambuf
+{
+public:
+	explicit ReadBuffer(const std::string &fileName,
+						const std::size_t chunkSize = defaultChunkSize,
+						const std::size_t chunkCount = defaultChunkCount) :
+		fd_(::open(fileName.c_str(), O_RDONLY)),
+		ring_(chunkCount, chunkSize)
+	{
+		if(fd_ < 0)
+		{
+			return;
+		}
+		::posix_fadvise(fd_, 0, 0, POSIX_FADV_SEQUENTIAL);
+		thread_ = std::thread([this](){ produce(); });
+	}
+
+	ReadBuffer(const ReadBuffer&) = delete;
+	ReadBuffer& operator = (const ReadBuffer&) = delete;
+
+	virtual ~ReadBuffer()
+	{
+		ring_.cancel();
+		if(thread_.joinable())
+		{
+			thread_.join();
+		}
+		if(fd_ >= 0)
+		{
+			::close(fd_);
+		}
+	}
+
+	bool isOpen() const
+	{
+		return fd_ >= 0;
+	}
+
+	/// Ошибка чтения; данные до неё уже отданы, после неё - конец файла.
+	bool failed() const
+	{
+		return failed_;
+	}
+
+protected:
+	virtual int_type underflow()
+	{
+		if(gptr() < egptr())
+		{
+			return traits_type::to_int_type(*gptr());
+		}
+		if(isHolding_)
+		{
+			isHolding_ = false;
+			ring_.release();
+		}
+		const char *data = nullptr;
+		std::size_t size = 0;
+		if(fd_ < 0 || !ring_.acquireFull(data, size))
+		{
+			return traits_type::eof();
+		}
+		isHolding_ = true;
+		auto begin = const_cast<char*>(data);
+		setg(begin, begin, begin + size);
+		return traits_type::to_int_type(*gptr());
+	}
+
+private:
+	void produce()
+	{
+		while(auto buffer = ring_.acquireFree())
+		{
+			std::size_t size = 0;
+			bool isEnd = false;
+			while(size < ring_.chunkSize())
+			{
+				const auto count = ::read(fd_, buffer + size, ring_.chunkSize() - size);
+				if(count < 0 && errno == EINTR)
+				{
+					continue;
+				}
+				if(count <= 0)
+				{
+					failed_ = count < 0;
+					isEnd = true;
+					break;
+				}
+				size += static_cast<std::size_t>(count);
+			}
+			if(size > 0)
+			{
+				ring_.publish(size);
+			}
+			if(isEnd)
+			{
+				break;
+			}
+		}
+		ring_.finish();
+	}
+
+	int fd_;
+	Ring ring_;
+	std::thread thread_;
+	std::atomic<bool> failed_{false};
+	bool isHolding_ = false;
+};
+
+/// Приёмник для BasicOStream и CompactOStream: сегменты копятся
+/// в буферах кольца, а write(2) выполняет отдельный поток.
+class FileSink
+{
+public:
+	explicit FileSink(const std::string &fileName,
+					  const std::size_t chunkSize = defaultChunkSize,
+					  const std::size_t chunkCount = defaultChunkCount) :
+		fd_(::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)),
+		ring_(chunkCount, chunkSize),
+		failed_(fd_ < 0)
+	{
+		if(fd_ >= 0)
+		{
+			thread_ = std::thread([this](){ consume(); });
+		}
+	}
+
+	FileSink(const FileSink&) = delete;
+	FileSink& operator = (const FileSink&) = delete;
+
+	~FileSink()
+	{
+		flush();
+		ring_.finish();
+		if(thread_.joinable())
+		{
+			thread_.join();
+		}
+		if(fd_ >= 0)
+		{
+			::close(fd_);
+		}
+	}
+
+	FileSink& write(const char *data, const std::streamsize size)
+	{
+		if(fd_ < 0 || size <= 0)
+		{
+			return *this;
+		}
+		auto left = static_cast<std::size_t>(size);
+		while(left > 0)
+		{
+			if(!current_)
+			{
+				current_ = ring_.acquireFree();
+				used_ = 0;
+			}
+			const auto count = std::min(left, ring_.chunkSize() - used_);
+			std::memcpy(current_ + used_, data, count);
+			used_ += count;
+			data += count;
+			left -= count;
+			if(used_ == ring_.chunkSize())
+			{
+				publish();
+			}
+		}
+		return *this;
+	}
+
+	/// Отдаёт накопленное потоку записи и ждёт, пока всё будет записано.
+	bool flush()
+	{
+		if(fd_ < 0)
+		{
+			return false;
+		}
+		if(current_ && used_ > 0)
+		{
+			publish();
+		}
+		ring_.drain();
+		return !failed_;
+	}
+
+	explicit operator bool() const
+	{
+		return !failed_;
+	}
+
+private:
+	void publish()
+	{
+		ring_.publish(used_);
+		current_ = nullptr;
+		used_ = 0;
+	}
+
+	void consume()
+	{
+		const char *data = nullptr;
+		std::size_t size = 0;
+		while(ring_.acquireFull(data, size))
+		{
+			while(size > 0 && !failed_)
+			{
+				const auto written = ::write(fd_, data, size);
+				if(written < 0)
+				{
+					failed_ = errno != EINTR;
+					continue;
+				}
+				data += written;
+				size -= static_cast<std::size_t>(written);
+			}
+			ring_.release();
+		}
+	}
+
+	int fd_;
+	Ring ring_;
+	std::thread thread_;
+	std::atomic<bool> failed_;
+	char *current_ = nullptr;
+	std::size_t used_ = 0;
+};
+}
+}
@@ -0,0 +1,554 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ios>
+#include <string>
+#include <vector>
+
+#include "Pool.hpp"
+
+namespace Tree
+{
+/// Контейнер из независимо сжатых блоков вокруг потока сегментов v1 или v2.
+///
+/// Файл начинается с заголовка: magic "\x89TRZ" и байт версии.
+/// Дальше идут сжатые блоки, за ними индекс - для каждого блока
+/// id кодека, исходный и сжатый размеры (по 4 байта), - и в конце
+/// число блоков и смещение индекса (по 8 байт). По индексу любой блок
+/// распаковывается отдельно, в том числе параллельно с другими.
+namespace Block
+{
+constexpr char magic[4] = {'\x89', 'T', 'R', 'Z'};
+constexpr unsigned char version = 1;
+constexpr std::size_t headerSize = sizeof magic + sizeof version;
+constexpr std::size_t entrySize = 1 + 2 * sizeof(std::uint32_t);
+constexpr std::size_t trailerSize = 2 * sizeof(std::uint64_t);
+constexpr std::size_t defaultBlockSize = 1 << 18;
+constexpr std::size_t maxBlockSize = 1 << 26;
+
+/// Кодек блока. Свой кодек (zstd, lz4) регистрируется
+/// через registerCodec под свободным id.
+class Codec
+{
+public:
+	virtual ~Codec() = default;
+
+	virtual unsigned char id() const = 0;
+
+	/// Дописывает сжатые data в конец out.
+	virtual void compress(const char *data, const std::size_t size, std::string &out) const = 0;
+
+	/// Распаковывает ровно rawSize байт в out, false при испорченных данных.
+	virtual bool decompress(const char *data,
+							const std::size_t size,
+							char *out,
+							const std::size_t rawSize) const = 0;
+
+	/// Наибольший исходный размер блока, который сжимается в packedSize байт.
+	/// По нему Reader отвергает индекс, обещающий больше, до выделения памяти.
+	virtual std::size_t maxRawSize(const std::size_t packedSize) const
+	{
+		return packedSize > 0 ? maxBlockSize : 0;
+	}
+};
+
+/// Блок без сжатия: им пишутся блоки, которые не удалось сжать.
+class StoreCodec : public Codec
+{
+public:
+	static constexpr unsigned char codecId = 0;
+
+	virtual unsigned char id() const
+	{
+		return codecId;
+	}
+
+	virtual void compress(const char *data, const std::size_t size, std::string &out) const
+	{
+		out.append(data, size);
+	}
+
+	virtual bool decompress(const char *data,
+							const std::size_t size,
+							char *out,
+							const std::size_t rawSize) const
+	{
+		if(size != rawSize)
+		{
+			return false;
+		}
+		std::memcpy(out, data, size);
+		return true;
+	}
+
+	virtual std::size_t maxRawSize(const std::size_t packedSize) const
+	{
+		return packedSize;
+	}
+};
+
+/// Встроенный LZ77 в духе LZ4: последовательности из токена
+/// (длина литералов и длина совпадения по 4 бита, 15 означает,
+/// что длина продолжается байтами до первого не 255), литералов
+/// и двухбайтового смещения совпадения. Последняя последовательность
+/// состоит только из литералов.
+class LzCodec : public Codec
+{
+public:
+	static constexpr unsigned char codecId = 1;
+
+	virtual unsigned char id() const
+	{
+		return codecId;
+	}
+
+	virtual void compress(const char *data, const std::size_t size, std::string &out) const
+	{
+		std::vector<std::uint32_t> table(std::size_t(1) << hashBits, 0);
+		std::size_t anchor = 0;
+		std::size_t i = 0;
+		while(size >= minMatch && i <= size - minMatch)
+		{
+			const auto word = load(data + i);
+			auto &slot = table[(word * 2654435761u) >> (32 - hashBits)];
+			const std::size_t candidate = slot;
+			slot = static_cast<std::uint32_t>(i + 1);
+			if(candidate == 0 || i + 1 - candidate > maxOffset || load(data + candidate - 1) != word)
+			{
+				// На несжимаемых данных шаг растёт с длиной литералов.
+				i += 1 + ((i - anchor) >> 6);
+				continue;
+			}
+			const auto match = candidate - 1;
+			auto length = minMatch;
+			while(i + length < size && data[match + length] == data[i + length])
+			{
+				++length;
+			}
+			emit(out, data + anchor, i - anchor, i - match, length);
+			i += length;
+			anchor = i;
+		}
+		emit(out, data + anchor, size - anchor, 0, 0);
+	}
+
+	virtual bool decompress(const char *data,
+							const std::size_t size,
+							char *out,
+							const std::size_t rawSize) const
+	{
+		const auto *in = reinterpret_cast<const unsigned char*>(data);
+		const auto *end = in + size;
+		std::size_t written = 0;
+		while(in < end)
+		{
+			const auto token = *in++;
+			std::size_t literals = token >> 4;
+			if(literals == 15 && !readLength(in, end, literals))
+			{
+				return false;
+			}
+			if(literals > static_cast<std::size_t>(end - in) || literals > rawSize - written)
+			{
+				return false;
+			}
+			std::memcpy(out + written, in, literals);
+			in += literals;
+			written += literals;
+			if(in == end)
+			{
+				return written == rawSize;
+			}
+
+			if(end - in < 2)
+			{
+				return false;
+			}
+			const std::size_t offset = in[0] | (in[1] << 8);
+			in += 2;
+			std::size_t length = token & 15;
+			if(length == 15 && !readLength(in, end, length))
+			{
+				return false;
+			}
+			length += minMatch;
+			if(offset == 0 || offset > written || length > rawSize - written)
+			{
+				return false;
+			}
+			char *target = out + written;
+			const char *source = target - offset;
+			if(offset >= length)
+			{
+				std::memcpy(target, source, length);
+			}
+			else
+			{
+				for(std::size_t j = 0; j < length; ++j)
+				{
+					target[j] = source[j];
+				}
+			}
+			written += length;
+		}
+		return false;
+	}
+
+	/// Байт продолжения длины даёт не больше 255 байт совпадения,
+	/// а токен со смещением - не больше 19.
+	virtual std::size_t maxRawSize(const std::size_t packedSize) const
+	{
+		return packedSize * 255;
+	}
+
+private:
+	static constexpr int hashBits = 14;
+	static constexpr std::size_t minMatch = 4;
+	static constexpr std::size_t maxOffset = 0xffff;
+
+	static std::uint32_t load(const char *data)
+	{
+		std::uint32_t word = 0;
+		std::memcpy(&word, data, sizeof word);
+		return word;
+	}
+
+	static void writeLength(std::string &out, std::size_t length)
+	{
+		while(length >= 255)
+		{
+			out.push_back(static_cast<char>(255));
+			length -= 255;
+		}
+		out.push_back(static_cast<char>(length));
+	}
+
+	static bool readLength(const unsigned char *&in, const unsigned char *end, std::size_t &length)
+	{
+		unsigned char byte = 0;
+		do
+		{
+			if(in >= end)
+			{
+				return false;
+			}
+			byte = *in++;
+			length += byte;
+		}
+		while(byte == 255);
+		return true;
+	}
+
+	/// Последовательность: literals, затем совпадение длины length
+	/// на offset назад; length == 0 - последняя последовательность.
+	static void emit(std::string &out,
+					 const char *literals,
+					 const std::size_t literalsSize,
+					 const std::size_t offset,
+					 const std::size_t length)
+	{
+		const auto matchCode = length > 0 ? length - minMatch : 0;
+		out.push_back(static_cast<char>((std::min<std::size_t>(literalsSize, 15) << 4)
+			| std::min<std::size_t>(matchCode, 15)));
+		if(literalsSize >= 15)
+		{
+			writeLength(out, literalsSize - 15);
+		}
+		out.append(literals, literalsSize);
+		if(length == 0)
+		{
+			return;
+		}
+		out.push_back(static_cast<char>(offset & 0xff));
+		out.push_back(static_cast<char>(offset >> 8));
+		if(matchCode >= 15)
+		{
+			writeLength(out, matchCode - 15);
+		}
+	}
+};
+
+inline Codec const*& codecSlot(const unsigned char id)
+{
+	static const StoreCodec store;
+	static const LzCodec lz;
+	static Codec const *codecs[256] = {&store, &lz};
+	return codecs[id];
+}
+
+/// Регистрирует кодек под его id; делается до чтения и записи.
+inline void registerCodec(Codec const &codec)
+{
+	codecSlot(codec.id()) = &codec;
+}
+
+inline Codec const* codecFor(const unsigned char id)
+{
+	return codecSlot(id);
+}
+
+inline Codec const& lz()
+{
+	return *codecFor(LzCodec::codecId);
+}
+
+inline bool isBlock(const char *data, const std::size_t size)
+{
+	return size >= headerSize
+		&& std::memcmp(data, magic, sizeof magic) == 0
+		&& static_cast<unsigned char>(data[sizeof magic]) == version;
+}
+
+/// Приёмник, который режет поток на блоки и сжимает их перед записью
+/// в sink. Подходит везде, где нужен приёмник с write(data, size),
+/// например BasicOStream<BlockSink<FileSink>>. Индекс пишет finish.
+template <class Sink>
+class BlockSink
+{
+public:
+	explicit BlockSink(Sink *sink,
+					   Codec const &codec = lz(),
+					   const std::size_t blockSize = defaultBlockSize) :
+		sink_(sink),
+		codec_(codec),
+		blockSize_(std::min(std::max<std::size_t>(blockSize, 1), maxBlockSize))
+	{
+		char header[headerSize];
+		std::memcpy(header, magic, sizeof magic);
+		header[sizeof magic] = static_cast<char>(version);
+		sink_->write(header, sizeof header);
+		written_ = sizeof header;
+		buffer_.reserve(blockSize_);
+	}
+
+	BlockSink(const BlockSink&) = delete;
+	BlockSink& operator = (const BlockSink&) = delete;
+
+	~BlockSink()
+	{
+		finish();
+	}
+
+	BlockSink& write(const char *data, const std::streamsize size)
+	{
+		auto left = size > 0 ? static_cast<std::size_t>(size) : 0;
+		while(left > 0)
+		{
+			const auto part = std::min(left, blockSize_ - buffer_.size());
+			buffer_.append(data, part);
+			data += part;
+			left -= part;
+			if(buffer_.size() == blockSize_)
+			{
+				writeBlock();
+			}
+		}
+		return *this;
+	}
+
+	/// Дописывает последний блок и индекс. Повторный вызов ничего не делает.
+	void finish()
+	{
+		if(isFinished_)
+		{
+			return;
+		}
+		isFinished_ = true;
+		if(!buffer_.empty() || index_.empty())
+		{
+			writeBlock();
+		}
+		const std::uint64_t count = index_.size() / entrySize;
+		const std::uint64_t indexOffset = written_;
+		sink_->write(index_.data(), index_.size());
+		sink_->write(reinterpret_cast<const char*>(&count), sizeof count);
+		sink_->write(reinterpret_cast<const char*>(&indexOffset), sizeof indexOffset);
+	}
+
+private:
+	void writeBlock()
+	{
+		packed_.clear();
+		codec_.compress(buffer_.data(), buffer_.size(), packed_);
+		auto codecId = codec_.id();
+		const char *block = packed_.data();
+		std::uint32_t packedSize = static_cast<std::uint32_t>(packed_.size());
+		if(packed_.size() >= buffer_.size())
+		{
+			codecId = StoreCodec::codecId;
+			block = buffer_.data();
+			packedSize = static_cast<std::uint32_t>(buffer_.size());
+		}
+		const auto rawSize = static_cast<std::uint32_t>(buffer_.size());
+		index_.push_back(static_cast<char>(codecId));
+		index_.append(reinterpret_cast<const char*>(&rawSize), sizeof rawSize);
+		index_.append(reinterpret_cast<const char*>(&packedSize), sizeof packedSize);
+		sink_->write(block, packedSize);
+		written_ += packedSize;
+		buffer_.clear();
+	}
+
+	Sink *sink_;
+	Codec const &codec_;
+	std::size_t blockSize_;
+	std::string buffer_;
+	std::string packed_;
+	std::string index_;
+	std::uint64_t written_ = 0;
+	bool isFinished_ = false;
+};
+
+/// Чтение контейнера из куска памяти: весь поток целиком
+/// (блоки распаковываются на пуле, если он задан) или отдельные блоки.
+class Reader
+{
+public:
+	Reader(const char *data, const std::size_t size) :
+		data_(data)
+	{
+		if(!isBlock(data, size) || size < headerSize + trailerSize)
+		{
+			return;
+		}
+		std::uint64_t count = 0;
+		std::uint64_t indexOffset = 0;
+		std::memcpy(&count, data + size - trailerSize, sizeof count);
+		std::memcpy(&indexOffset, data + size - sizeof indexOffset, sizeof indexOffset);
+		const auto indexSize = size - trailerSize;
+		if(indexOffset < headerSize || indexOffset > indexSize
+			|| count != (indexSize - indexOffset) / entrySize
+			|| (indexSize - indexOffset) % entrySize != 0)
+		{
+			return;
+		}
+
+		blocks_.reserve(count);
+		std::uint64_t packedOffset = headerSize;
+		std::uint64_t rawOffset = 0;
+		for(std::uint64_t i = 0; i < count; ++i)
+		{
+			const char *entry = data + indexOffset + i * entrySize;
+			Entry block;
+			block.codec_ = static_cast<unsigned char>(entry[0]);
+			std::memcpy(&block.rawSize_, entry + 1, sizeof block.rawSize_);
+			std::memcpy(&block.packedSize_, entry + 1 + sizeof block.rawSize_, sizeof block.packedSize_);
+			block.packedOffset_ = packedOffset;
+			block.rawOffset_ = rawOffset;
+			const auto codec = codecFor(block.codec_);
+			if(!codec || block.rawSize_ > maxBlockSize || block.rawSize_ > codec->maxRawSize(block.packedSize_))
+			{
+				blocks_.clear();
+				return;
+			}
+			packedOffset += block.packedSize_;
+			rawOffset += block.rawSize_;
+			blocks_.push_back(block);
+		}
+		if(packedOffset != indexOffset)
+		{
+			blocks_.clear();
+			return;
+		}
+		rawSize_ = rawOffset;
+		isValid_ = true;
+	}
+
+	bool isValid() const
+	{
+		return isValid_;
+	}
+
+	std::size_t blockCount() const
+	{
+		return blocks_.size();
+	}
+
+	std::size_t rawSize() const
+	{
+		return rawSize_;
+	}
+
+	std::size_t rawOffset(const std::size_t block) const
+	{
+		return blocks_[block].rawOffset_;
+	}
+
+	std::size_t rawSize(const std::size_t block) const
+	{
+		return blocks_[block].rawSize_;
+	}
+
+	/// Блок, в котором лежит байт rawOffset распакованного потока.
+	std::size_t blockAt(const std::size_t rawOffset) const
+	{
+		const auto found = std::upper_bound(blocks_.begin(), blocks_.end(), rawOffset,
+			[](const std::size_t offset, const Entry &block){ return offset < block.rawOffset_; });
+		return found == blocks_.begin() ? 0 : found - blocks_.begin() - 1;
+	}
+
+	/// Распаковывает блок в out, где должно быть rawSize(block) байт.
+	bool readBlock(const std::size_t block, char *out) const
+	{
+		const auto &entry = blocks_[block];
+		return codecFor(entry.codec_)->decompress(data_ + entry.packedOffset_, entry.packedSize_,
+			out, entry.rawSize_);
+	}
+
+	bool read(std::string &out, ThreadPool *pool = nullptr) const
+	{
+		if(!isValid_)
+		{
+			return false;
+		}
+		if(!pool || blocks_.size() < 2)
+		{
+			// Память растёт по блокам, поэтому испорченный блок
+			// останавливает чтение до выделения места под следующие.
+			out.clear();
+			for(std::size_t i = 0; i < blocks_.size(); ++i)
+			{
+				out.resize(rawOffset(i) + rawSize(i));
+				if(!readBlock(i, &out[rawOffset(i)]))
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+
+		out.resize(rawSize_);
+		std::atomic<bool> isRead{true};
+		for(std::size_t i = 0; i < blocks_.size(); ++i)
+		{
+			pool->submit([this, i, &out, &isRead](){
+				if(!readBlock(i, &out[rawOffset(i)]))
+				{
+					isRead = false;
+				}
+			});
+		}
+		pool->wait();
+		return isRead;
+	}
+
+private:
+	struct Entry
+	{
+		unsigned char codec_ = 0;
+		std::uint32_t rawSize_ = 0;
+		std::uint32_t packedSize_ = 0;
+		std::uint64_t packedOffset_ = 0;
+		std::uint64_t rawOffset_ = 0;
+	};
+
+	const char *data_;
+	std::vector<Entry> blocks_;
+	std::uint64_t rawSize_ = 0;
+	bool isValid_ = false;
+};
+}
+}
@@ -0,0 +1,325 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "Tree.hpp"
+
+namespace Tree
+{
+class Columnar;
+
+/// Лёгкая ручка на узел колоночного дерева: все данные узла
+/// лежат в параллельных массивах Columnar по его индексу в прямом обходе.
+class ColumnarNode : public Abstract
+{
+public:
+	ColumnarNode(Columnar const *columns, const std::size_t index) :
+		columns_(columns),
+		index_(index)
+	{
+	}
+
+	virtual bool isEmpty()
+	{
+		return false;
+	}
+
+	virtual int childrenCount() const;
+
+	virtual void traverse(std::function<void(Abstract const *)> initial,
+				  std::function<void(Abstract const *)> final) const;
+
+	virtual Type type() const;
+	virtual std::pair<const char*, int> bytes() const;
+
+	std::size_t index() const
+	{
+		return index_;
+	}
+
+	std::size_t subtreeSize() const;
+
+	Columnar const& columns() const
+	{
+		return *columns_;
+	}
+	virtual ColumnarNode const* child(const int i) const;
+	virtual Abstract const* childAfter(const int i, Abstract const *previous) const;
+
+protected:
+	virtual void addChild(TreePtr child)
+	{
+	}
+
+	virtual std::string dataToText() const
+	{
+		return textForData(type(), bytes());
+	}
+
+	virtual bool isDataEqual(Abstract const *tree) const
+	{
+		return isSameData(this, tree);
+	}
+
+private:
+	Columnar const *columns_;
+	std::size_t index_;
+};
+
+/// Неизменяемое дерево в виде структуры массивов: узлы лежат
+/// в прямом порядке обхода, значения Int/Real/String упакованы в общую кучу.
+/// Обход - линейный проход по массивам без хождения по указателям.
+class Columnar
+{
+	friend class ColumnarNode;
+	friend class ColumnarBuilder;
+
+public:
+	Columnar(const Columnar&) = delete;
+	Columnar& operator = (const Columnar&) = delete;
+
+	std::size_t size() const
+	{
+		return types_.size();
+	}
+
+	Type type(const std::size_t index) const
+	{
+		return types_[index];
+	}
+
+	int childrenCount(const std::size_t index) const
+	{
+		return childrenCounts_[index];
+	}
+
+	std::size_t subtreeSize(const std::size_t index) const
+	{
+		return subtreeSizes_[index];
+	}
+
+	std::pair<const char*, int> bytes(const std::size_t index) const
+	{
+		return {values_ + valueOffsets_[index], valueSizes_[index]};
+	}
+
+	ColumnarNode const* node(const std::size_t index) const
+	{
+		return &nodes_[index];
+	}
+
+	void traverse(const std::size_t root,
+				  std::function<void(Abstract const *)> &initial,
+				  std::function<void(Abstract const *)> &final) const
+	{
+		std::vector<std::size_t> open;
+		const auto end = root + subtreeSizes_[root];
+		for(auto i = root; i < end; ++i)
+		{
+			initial(&nodes_[i]);
+			if(childrenCounts_[i] > 0)
+			{
+				open.push_back(i);
+				continue;
+			}
+			final(&nodes_[i]);
+			while(!open.empty() && open.back() + subtreeSizes_[open.back()] == i + 1)
+			{
+				final(&nodes_[open.back()]);
+				open.pop_back();
+			}
+		}
+	}
+
+private:
+	Columnar() = default;
+
+	std::vector<Type> types_;
+	std::vector<int> childrenCounts_;
+	std::vector<std::size_t> subtreeSizes_;
+	std::vector<std::size_t> valueOffsets_;
+	std::vector<int> valueSizes_;
+	std::vector<char> heap_;
+	const char *values_ = nullptr;
+	std::shared_ptr<void const> storage_;
+	std::vector<ColumnarNode> nodes_;
+};
+
+inline int ColumnarNode::childrenCount() const
+{
+	return columns_->childrenCount(index_);
+}
+
+inline void ColumnarNode::traverse(std::function<void(Abstract const *)> initial,
+								   std::function<void(Abstract const *)> final) const
+{
+	columns_->traverse(index_, initial, final);
+}
+
+inline Type ColumnarNode::type() const
+{
+	return columns_->type(index_);
+}
+
+inline std::pair<const char*, int> ColumnarNode::bytes() const
+{
+	return columns_->bytes(index_);
+}
+
+inline std::size_t ColumnarNode::subtreeSize() const
+{
+	return columns_->subtreeSize(index_);
+}
+
+inline ColumnarNode const* ColumnarNode::child(const int i) const
+{
+	if(i < 0 || i >= childrenCount())
+	{
+		return nullptr;
+	}
+	auto index = index_ + 1;
+	for(int skipped = 0; skipped < i; ++skipped)
+	{
+		index += columns_->subtreeSize(index);
+	}
+	return columns_->node(index);
+}
+
+inline Abstract const* ColumnarNode::childAfter(const int i, Abstract const *previous) const
+{
+	if(!previous || i == 0)
+	{
+		return child(i);
+	}
+	auto sibling = static_cast<ColumnarNode const*>(previous);
+	return columns_->node(sibling->index_ + sibling->subtreeSize());
+}
+
+/// Собирает Columnar по сегментам в прямом порядке обхода.
+class ColumnarBuilder
+{
+public:
+	ColumnarBuilder() :
+		columns_(new Columnar())
+	{
+	}
+
+	void reserve(const std::size_t nodes, const std::size_t heapBytes = 0)
+	{
+		columns_->types_.reserve(nodes);
+		columns_->childrenCounts_.reserve(nodes);
+		columns_->subtreeSizes_.reserve(nodes);
+		columns_->valueOffsets_.reserve(nodes);
+		columns_->valueSizes_.reserve(nodes);
+		columns_->heap_.reserve(heapBytes);
+	}
+
+	bool add(const Type type, const char *data, const int dataSize, const int childrenCount)
+	{
+		auto &heap = columns_->heap_;
+		if(!append(type, heap.size(), dataSize, childrenCount))
+		{
+			return false;
+		}
+		heap.insert(heap.end(), data, data + dataSize);
+		return true;
+	}
+
+	bool isComplete() const
+	{
+		return !columns_->types_.empty() && open_.empty();
+	}
+
+	TreeConstPtr finish()
+	{
+		if(!isComplete())
+		{
+			return makeConstPtr<Empty>();
+		}
+		auto tree = release(std::move(columns_));
+		columns_.reset(new Columnar());
+		return tree;
+	}
+
+	static TreeConstPtr copy(TreeConstPtr tree)
+	{
+		ColumnarBuilder builder;
+		if(tree)
+		{
+			tree->visit([&builder](Abstract const * node){
+				const auto [data, dataSize] = node->bytes();
+				builder.add(node->type(), data, dataSize, node->childrenCount());
+			}, [](Abstract const * ){});
+		}
+		return builder.finish();
+	}
+
+protected:
+	/// Добавляет узел, значение которого уже лежит по смещению valueOffset.
+	bool append(const Type type, const std::size_t valueOffset, const int dataSize, const int childrenCount)
+	{
+		const auto index = columns_->types_.size();
+		if(type == Type::INVALID || childrenCount < 0 || dataSize < 0
+			|| (index > 0 && open_.empty()))
+		{
+			return false;
+		}
+
+		columns_->types_.push_back(type);
+		columns_->childrenCounts_.push_back(childrenCount);
+		columns_->subtreeSizes_.push_back(1);
+		columns_->valueOffsets_.push_back(valueOffset);
+		columns_->valueSizes_.push_back(dataSize);
+
+		if(!open_.empty())
+		{
+			--open_.back().remaining_;
+		}
+		if(childrenCount > 0)
+		{
+			open_.push_back({index, childrenCount});
+		}
+		close(index + 1);
+		return true;
+	}
+
+	/// Отдаёт готовые колонки наружу: значения берутся из values,
+	/// если они лежат во внешнем хранилище storage, иначе - из собственной кучи.
+	static TreeConstPtr release(std::unique_ptr<Columnar> columns,
+								const char *values = nullptr,
+								std::shared_ptr<void const> storage = nullptr)
+	{
+		std::shared_ptr<Columnar> shared(std::move(columns));
+		shared->values_ = values ? values : shared->heap_.data();
+		shared->storage_ = std::move(storage);
+		shared->nodes_.reserve(shared->size());
+		for(std::size_t i = 0; i < shared->size(); ++i)
+		{
+			shared->nodes_.emplace_back(shared.get(), i);
+		}
+		return TreeConstPtr(shared, shared->node(0));
+	}
+
+	void close(const std::size_t end)
+	{
+		while(!open_.empty() && open_.back().remaining_ == 0)
+		{
+			const auto index = open_.back().index_;
+			columns_->subtreeSizes_[index] = end - index;
+			open_.pop_back();
+		}
+	}
+
+	struct Open
+	{
+		std::size_t index_;
+		int remaining_;
+	};
+
+	std::unique_ptr<Columnar> columns_;
+	std::vector<Open> open_;
+};
+}
@@ -0,0 +1,1080 @@
+#pragma once
+
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <istream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "Dag.hpp"
+#include "Tree.hpp"
+
+namespace Tree
+{
+enum class Format
+{
+	V1 = 1,
+	V2 = 2,
+	/// v2 со словарём повторяющихся строк.
+	V2_DICTIONARY = 3,
+	/// v2 со словарём и ссылками на уже записанные общие поддеревья.
+	V2_DAG = 4
+};
+
+/// Компактный формат v2.
+///
+/// Файл начинается с заголовка: magic "\x89TRE" и байт версии.
+/// Каждый узел - байт тега, в младших трёх битах которого вид узла,
+/// а в старших пяти число детей (31 означает, что число детей
+/// следует за тегом в LEB128). Int и Real хранятся без размера,
+/// у String перед байтами идёт длина в LEB128.
+///
+/// Сразу за заголовком могут идти секции с видом SECTION и номером
+/// секции в старших битах тега. Секция STRINGS - словарь: число строк
+/// и сами строки (длина в LEB128 и байты); узел STRING_REF вместо байт
+/// строки хранит её номер в словаре в LEB128. Пустая секция SUBTREES
+/// разрешает узлы SUBTREE_REF: без детей, с номером в LEB128 ранее
+/// записанного целиком узла, поддерево которого стоит на их месте.
+///
+/// Узел ARRAY заменяет идущие подряд листья Int или Real одного родителя:
+/// в старших битах тега вид массива, дальше число листьев в LEB128
+/// и их значения. INT_ARRAY и REAL_ARRAY хранят значения как есть,
+/// INT_DELTA_ARRAY - разности соседних значений в zigzag и LEB128.
+/// В файлах со ссылками на поддеревья массивов нет.
+namespace Compact
+{
+constexpr char magic[4] = {'\x89', 'T', 'R', 'E'};
+constexpr unsigned char version = 2;
+constexpr std::size_t headerSize = sizeof magic + sizeof version;
+
+constexpr unsigned char kindBits = 3;
+constexpr unsigned char kindMask = (1 << kindBits) - 1;
+constexpr unsigned char inlineChildrenLimit = 0xff >> kindBits;
+
+enum Kind : unsigned char
+{
+	SECTION = 0,
+	INT = 1,
+	REAL = 2,
+	STRING = 3,
+	STRING_REF = 4,
+	SUBTREE_REF = 5,
+	ARRAY = 6
+};
+
+enum Array : unsigned char
+{
+	INT_ARRAY = 0,
+	INT_DELTA_ARRAY = 1,
+	REAL_ARRAY = 2
+};
+
+/// Более короткие ряды листьев пишутся обычными узлами.
+constexpr std::size_t minArraySize = 4;
+
+/// Значения массива читаются кусками не больше этого, чтобы ложное
+/// число значений не выделяло память без данных в потоке.
+constexpr std::uint64_t arrayChunkSize = 1 << 16;
+
+enum Section : unsigned char
+{
+	STRINGS = 0,
+	SUBTREES = 1
+};
+
+/// Возможности CompactOStream, которые включаются флагами.
+enum Option : unsigned
+{
+	STRING_DICTIONARY = 1,
+	SUBTREE_REFERENCES = 2,
+	NUMERIC_ARRAYS = 4,
+	/// Int массивы разностями, если так короче. Такие значения
+	/// нельзя читать прямо из файла, как это делает Mapped.
+	DELTA_ARRAYS = 8
+};
+
+inline unsigned optionsFor(const Format format)
+{
+	switch(format)
+	{
+		case Format::V2: return NUMERIC_ARRAYS;
+		case Format::V2_DICTIONARY: return STRING_DICTIONARY | NUMERIC_ARRAYS;
+		case Format::V2_DAG: return STRING_DICTIONARY | SUBTREE_REFERENCES;
+		default: return 0;
+	}
+}
+
+/// Предел числа узлов, в которые разворачиваются ссылки на поддеревья:
+/// иначе маленький файл с вложенными ссылками разворачивается экспоненциально.
+constexpr std::uint64_t defaultExpandLimit = std::uint64_t(1) << 32;
+
+/// Записывает value в LEB128, возвращает число байт.
+inline int encodeVarint(std::uint64_t value, char *out)
+{
+	int size = 0;
+	while(value >= 0x80)
+	{
+		out[size++] = static_cast<char>((value & 0x7f) | 0x80);
+		value >>= 7;
+	}
+	out[size++] = static_cast<char>(value);
+	return size;
+}
+
+/// out[i] = zigzag(values[i] - values[i - 1]), где values[-1] = 0.
+inline void encodeDeltas(const std::int32_t *values, std::uint32_t *out, const std::size_t count)
+{
+	if(count == 0)
+	{
+		return;
+	}
+	const auto zigzag = [](const std::uint32_t delta){
+		return (delta << 1) ^ static_cast<std::uint32_t>(static_cast<std::int32_t>(delta) >> 31);
+	};
+	out[0] = zigzag(static_cast<std::uint32_t>(values[0]));
+	std::size_t i = 1;
+#if defined(__AVX2__)
+	for(; i + 8 <= count; i += 8)
+	{
+		const auto current = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i));
+		const auto previous = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + i - 1));
+		const auto delta = _mm256_sub_epi32(current, previous);
+		const auto encoded = _mm256_xor_si256(_mm256_slli_epi32(delta, 1), _mm256_srai_epi32(delta, 31));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), encoded);
+	}
+#elif defined(__SSE2__)
+	for(; i + 4 <= count; i += 4)
+	{
+		const auto current = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i));
+		const auto previous = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values + i - 1));
+		const auto delta = _mm_sub_epi32(current, previous);
+		const auto encoded = _mm_xor_si128(_mm_slli_epi32(delta, 1), _mm_srai_epi32(delta, 31));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), encoded);
+	}
+#endif
+	for(; i < count; ++i)
+	{
+		out[i] = zigzag(static_cast<std::uint32_t>(values[i]) - static_cast<std::uint32_t>(values[i - 1]));
+	}
+}
+
+/// Обратное к encodeDeltas: снятие zigzag и префиксная сумма.
+inline void decodeDeltas(const std::uint32_t *encoded, std::int32_t *out, const std::size_t count)
+{
+	const auto unzigzag = [](const std::uint32_t value){
+		return (value >> 1) ^ (0u - (value & 1));
+	};
+	std::size_t i = 0;
+	std::uint32_t last = 0;
+#if defined(__AVX2__)
+	const auto one = _mm256_set1_epi32(1);
+	const auto zero = _mm256_setzero_si256();
+	auto carry = zero;
+	for(; i + 8 <= count; i += 8)
+	{
+		const auto value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(encoded + i));
+		auto sum = _mm256_xor_si256(_mm256_srli_epi32(value, 1), _mm256_sub_epi32(zero, _mm256_and_si256(value, one)));
+		// Префиксные суммы в каждой 128-битной половине, затем перенос из нижней в верхнюю.
+		sum = _mm256_add_epi32(sum, _mm256_slli_si256(sum, 4));
+		sum = _mm256_add_epi32(sum, _mm256_slli_si256(sum, 8));
+		const auto low = _mm256_permutevar8x32_epi32(sum, _mm256_setr_epi32(0, 0, 0, 0, 3, 3, 3, 3));
+		sum = _mm256_add_epi32(sum, _mm256_blend_epi32(zero, low, 0xf0));
+		sum = _mm256_add_epi32(sum, carry);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), sum);
+		carry = _mm256_permutevar8x32_epi32(sum, _mm256_set1_epi32(7));
+	}
+	if(i > 0)
+	{
+		last = static_cast<std::uint32_t>(out[i - 1]);
+	}
+#elif defined(__SSE2__)
+	const auto one = _mm_set1_epi32(1);
+	const auto zero = _mm_setzero_si128();
+	auto carry = zero;
+	for(; i + 4 <= count; i += 4)
+	{
+		const auto value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(encoded + i));
+		auto sum = _mm_xor_si128(_mm_srli_epi32(value, 1), _mm_sub_epi32(zero, _mm_and_si128(value, one)));
+		sum = _mm_add_epi32(sum, _mm_slli_si128(sum, 4));
+		sum = _mm_add_epi32(sum, _mm_slli_si128(sum, 8));
+		sum = _mm_add_epi32(sum, carry);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), sum);
+		carry = _mm_shuffle_epi32(sum, _MM_SHUFFLE(3, 3, 3, 3));
+	}
+	if(i > 0)
+	{
+		last = static_cast<std::uint32_t>(out[i - 1]);
+	}
+#endif
+	for(; i < count; ++i)
+	{
+		last += unzigzag(encoded[i]);
+		out[i] = static_cast<std::int32_t>(last);
+	}
+}
+
+inline bool isCompact(const char *data, const std::size_t size)
+{
+	return size >= headerSize
+		&& std::memcmp(data, magic, sizeof magic) == 0
+		&& static_cast<unsigned char>(data[sizeof magic]) == version;
+}
+
+/// Источник байт для CompactIStream поверх непрерывного куска памяти.
+/// Строки отдаются указателями прямо внутрь куска.
+class SpanSource
+{
+public:
+	/// Данные, отданные take, живут дольше источника.
+	static constexpr bool keepsData = true;
+
+	SpanSource(const char *data, const std::size_t size) :
+		data_(data),
+		size_(size)
+	{
+	}
+
+	bool readByte(unsigned char &byte)
+	{
+		if(offset_ >= size_)
+		{
+			return false;
+		}
+		byte = static_cast<unsigned char>(data_[offset_++]);
+		return true;
+	}
+
+	const char* take(const std::size_t size)
+	{
+		if(size > size_ - offset_)
+		{
+			return nullptr;
+		}
+		const char *taken = data_ + offset_;
+		offset_ += size;
+		return taken;
+	}
+
+	std::size_t left() const
+	{
+		return size_ - offset_;
+	}
+
+private:
+	const char *data_;
+	std::size_t size_;
+	std::size_t offset_ = 0;
+};
+
+/// Источник байт поверх std::istream; данные узла читаются
+/// в один переиспользуемый буфер.
+class StreamSource
+{
+public:
+	static constexpr bool keepsData = false;
+
+	explicit StreamSource(std::istream *stream) :
+		stream_(stream)
+	{
+	}
+
+	bool readByte(unsigned char &byte)
+	{
+		const auto c = stream_->get();
+		if(c == std::istream::traits_type::eof())
+		{
+			return false;
+		}
+		byte = static_cast<unsigned char>(c);
+		return true;
+	}
+
+	/// Размер берётся из файла, поэтому буфер растёт кусками
+	/// по мере чтения: ложный размер не выделяет память без данных.
+	const char* take(const std::size_t size)
+	{
+		buffer_.clear();
+		while(buffer_.size() < size)
+		{
+			const auto offset = buffer_.size();
+			const auto part = std::min(size - offset, chunkSize);
+			buffer_.resize(offset + part);
+			if(!stream_->read(buffer_.data() + offset, part))
+			{
+				return nullptr;
+			}
+		}
+		buffer_.push_back('\0');
+		return buffer_.data();
+	}
+
+	std::size_t left() const
+	{
+		return SIZE_MAX;
+	}
+
+private:
+	static constexpr std::size_t chunkSize = 1 << 20;
+
+	std::istream *stream_;
+	std::vector<char> buffer_;
+};
+}
+
+/// Запись дерева в формате v2 в любой приёмник с методом write(data, size).
+/// С Compact::STRING_DICTIONARY строки, которые встречаются больше
+/// одного раза, пишутся один раз в словарь, а в узлах остаются их номера.
+/// С Compact::SUBTREE_REFERENCES поддерево, которое уже записано тем же
+/// объектом (общие поддеревья DagBuilder), заменяется ссылкой.
+template <class Sink>
+class CompactOStream
+{
+public:
+	explicit CompactOStream(Sink *sink, const unsigned options = 0) :
+		sink_(sink),
+		options_(options)
+	{
+	}
+
+	CompactOStream& write(TreeConstPtr tree)
+	{
+		char header[Compact::headerSize];
+		std::memcpy(header, Compact::magic, sizeof Compact::magic);
+		header[sizeof Compact::magic] = static_cast<char>(Compact::version);
+		sink_->write(header, sizeof header);
+
+		dictionary_.clear();
+		if(options_ & Compact::STRING_DICTIONARY)
+		{
+			writeDictionary(tree.get());
+		}
+		if(options_ & Compact::SUBTREE_REFERENCES)
+		{
+			writeShared(tree.get());
+		}
+		else if(options_ & Compact::NUMERIC_ARRAYS)
+		{
+			writePacked(tree.get());
+		}
+		else
+		{
+			tree->visit([this](Abstract const * node){
+				writeNode(node);
+			}, [](Abstract const * ){});
+		}
+		dictionary_.clear();
+		return *this;
+	}
+
+private:
+	/// Прямой обход, в котором повторно встреченное поддерево
+	/// не обходится, а пишется ссылкой на номер его корня.
+	void writeShared(Abstract const *root)
+	{
+		const char section = static_cast<char>(Compact::SECTION | (Compact::SUBTREES << Compact::kindBits));
+		sink_->write(&section, 1);
+
+		std::unordered_map<Abstract const *, std::uint64_t> written;
+		std::uint64_t index = 0;
+		const auto enter = [this, &written, &index](Abstract const * node){
+			if(!node->isLeaf())
+			{
+				const auto found = written.find(node);
+				if(found != written.end())
+				{
+					char buffer[1 + 10];
+					buffer[0] = static_cast<char>(Compact::SUBTREE_REF);
+					sink_->write(buffer, 1 + Compact::encodeVarint(found->second, buffer + 1));
+					return false;
+				}
+				written.emplace(node, index);
+			}
+			++index;
+			writeNode(node);
+			return !node->isLeaf();
+		};
+
+		struct Frame
+		{
+			Abstract const *node_;
+			Abstract const *last_;
+			int next_;
+		};
+		std::vector<Frame> stack;
+		if(root->type() != Type::INVALID && enter(root))
+		{
+			stack.push_back({root, nullptr, 0});
+		}
+		while(!stack.empty())
+		{
+			auto &frame = stack.back();
+			if(frame.next_ >= frame.node_->childrenCount())
+			{
+				stack.pop_back();
+				continue;
+			}
+			auto child = frame.node_->childAfter(frame.next_++, frame.last_);
+			frame.last_ = child;
+			if(enter(child))
+			{
+				stack.push_back({child, nullptr, 0});
+			}
+		}
+	}
+
+	/// Прямой обход, в котором ряды листьев Int или Real
+	/// одного родителя пишутся узлами ARRAY.
+	void writePacked(Abstract const *root)
+	{
+		if(root->type() == Type::INVALID)
+		{
+			return;
+		}
+
+		struct Frame
+		{
+			Abstract const *node_;
+			Abstract const *last_;
+			int next_;
+			int count_;
+		};
+		std::vector<Frame> stack;
+		writeNode(root);
+		stack.push_back({root, nullptr, 0, root->childrenCount()});
+		while(!stack.empty())
+		{
+			auto &frame = stack.back();
+			if(frame.next_ >= frame.count_)
+			{
+				stack.pop_back();
+				continue;
+			}
+			auto child = frame.node_->childAfter(frame.next_++, frame.last_);
+			frame.last_ = child;
+			const auto type = child->type();
+			if((type != Type::INT && type != Type::REAL) || !child->isLeaf())
+			{
+				writeNode(child);
+				if(!child->isLeaf())
+				{
+					stack.push_back({child, nullptr, 0, child->childrenCount()});
+				}
+				continue;
+			}
+
+			run_.clear();
+			run_.push_back(child);
+			while(frame.next_ < frame.count_)
+			{
+				auto next = frame.node_->childAfter(frame.next_, frame.last_);
+				if(next->type() != type || !next->isLeaf())
+				{
+					break;
+				}
+				run_.push_back(next);
+				frame.last_ = next;
+				++frame.next_;
+			}
+			if(run_.size() < Compact::minArraySize)
+			{
+				for(const auto leaf : run_)
+				{
+					writeNode(leaf);
+				}
+				continue;
+			}
+			writeArray(type);
+		}
+	}
+
+	void writeArray(const Type type)
+	{
+		const auto count = run_.size();
+		const auto valueSize = type == Type::INT ? sizeof(std::int32_t) : sizeof(double);
+		values_.resize(count * valueSize);
+		for(std::size_t i = 0; i < count; ++i)
+		{
+			std::memcpy(values_.data() + i * valueSize, run_[i]->bytes().first, valueSize);
+		}
+
+		auto array = type == Type::INT ? Compact::INT_ARRAY : Compact::REAL_ARRAY;
+		const char *data = values_.data();
+		std::size_t dataSize = values_.size();
+		if(type == Type::INT && (options_ & Compact::DELTA_ARRAYS))
+		{
+			encoded_.resize(count);
+			Compact::encodeDeltas(reinterpret_cast<const std::int32_t*>(values_.data()), encoded_.data(), count);
+			packed_.resize(count * 5);
+			std::size_t size = 0;
+			for(const auto value : encoded_)
+			{
+				size += Compact::encodeVarint(value, packed_.data() + size);
+			}
+			if(size < dataSize)
+			{
+				array = Compact::INT_DELTA_ARRAY;
+				data = packed_.data();
+				dataSize = size;
+			}
+		}
+
+		char buffer[1 + 10];
+		buffer[0] = static_cast<char>(Compact::ARRAY | (array << Compact::kindBits));
+		sink_->write(buffer, 1 + Compact::encodeVarint(count, buffer + 1));
+		sink_->write(data, dataSize);
+	}
+
+	void writeDictionary(Abstract const *root)
+	{
+		std::unordered_map<std::string_view, std::size_t> counts;
+		std::vector<std::string_view> order;
+		root->visit([&counts, &order](Abstract const * node){
+			if(node->type() != Type::STRING)
+			{
+				return;
+			}
+			const auto [data, dataSize] = node->bytes();
+			const std::string_view value(data, dataSize);
+			if(counts[value]++ == 0)
+			{
+				order.push_back(value);
+			}
+		}, [](Abstract const * ){});
+
+		// Строке из одного байта ссылка ничего не экономит.
+		std::vector<std::string_view> entries;
+		for(const auto &value : order)
+		{
+			if(counts[value] > 1 && value.size() > 1)
+			{
+				dictionary_.emplace(value, entries.size());
+				entries.push_back(value);
+			}
+		}
+		if(entries.empty())
+		{
+			return;
+		}
+
+		char buffer[1 + 10];
+		buffer[0] = static_cast<char>(Compact::SECTION | (Compact::STRINGS << Compact::kindBits));
+		sink_->write(buffer, 1 + Compact::encodeVarint(entries.size(), buffer + 1));
+		for(const auto &value : entries)
+		{
+			sink_->write(buffer, Compact::encodeVarint(value.size(), buffer));
+			sink_->write(value.data(), value.size());
+		}
+	}
+
+	void writeNode(Abstract const *node)
+	{
+		// Тег, два LEB128 и данные Int/Real помещаются в один буфер.
+		char buffer[1 + 10 + 10 + sizeof(double)];
+		int size = 1;
+
+		const auto childrenCount = node->childrenCount();
+		const auto [data, dataSize] = node->bytes();
+		auto kind = static_cast<unsigned char>(node->type());
+		auto reference = dictionary_.end();
+		if(node->type() == Type::STRING && !dictionary_.empty())
+		{
+			reference = dictionary_.find(std::string_view(data, dataSize));
+			if(reference != dictionary_.end())
+			{
+				kind = Compact::STRING_REF;
+			}
+		}
+		if(childrenCount < Compact::inlineChildrenLimit)
+		{
+			buffer[0] = static_cast<char>(kind | (childrenCount << Compact::kindBits));
+		}
+		else
+		{
+			buffer[0] = static_cast<char>(kind | (Compact::inlineChildrenLimit << Compact::kindBits));
+			size += Compact::encodeVarint(childrenCount, buffer + size);
+		}
+
+		if(reference != dictionary_.end())
+		{
+			size += Compact::encodeVarint(reference->second, buffer + size);
+			sink_->write(buffer, size);
+			return;
+		}
+		if(node->type() == Type::STRING)
+		{
+			size += Compact::encodeVarint(dataSize, buffer + size);
+			sink_->write(buffer, size);
+			sink_->write(data, dataSize);
+			return;
+		}
+		std::memcpy(buffer + size, data, dataSize);
+		sink_->write(buffer, size + dataSize);
+	}
+
+	Sink *sink_;
+	unsigned options_;
+	std::unordered_map<std::string_view, std::size_t> dictionary_;
+	std::vector<Abstract const *> run_;
+	std::vector<char> values_;
+	std::vector<std::uint32_t> encoded_;
+	std::vector<char> packed_;
+};
+
+/// Чтение дерева в формате v2 из источника Compact::SpanSource
+/// или Compact::StreamSource в любой builder. Ссылки на поддеревья
+/// DagBuilder получает ссылками, а остальные builder - развёрнутыми,
+/// не больше expandLimit узлов.
+template <class Source>
+class CompactIStream
+{
+public:
+	explicit CompactIStream(Source *source, const std::uint64_t expandLimit = Compact::defaultExpandLimit) :
+		source_(source),
+		expandLimit_(expandLimit)
+	{
+	}
+
+	template <class Builder>
+	bool read(Builder &builder)
+	{
+		const char *header = source_->take(Compact::headerSize);
+		if(!header || !Compact::isCompact(header, Compact::headerSize))
+		{
+			return false;
+		}
+
+		dictionary_.clear();
+		copies_.clear();
+		records_.clear();
+		subtrees_.clear();
+		open_.clear();
+		expanded_ = 0;
+		isShared_ = false;
+
+		unsigned char tag = 0;
+		if(!source_->readByte(tag))
+		{
+			return false;
+		}
+		while((tag & Compact::kindMask) == Compact::SECTION)
+		{
+			const auto section = tag >> Compact::kindBits;
+			if(section == Compact::STRINGS && dictionary_.empty() && !isShared_)
+			{
+				if(!readDictionary())
+				{
+					return false;
+				}
+			}
+			else if(section == Compact::SUBTREES && !isShared_)
+			{
+				isShared_ = true;
+			}
+			else
+			{
+				return false;
+			}
+			if(!source_->readByte(tag))
+			{
+				return false;
+			}
+		}
+
+		long long pending = 1;
+		while(true)
+		{
+			if((tag & Compact::kindMask) == Compact::ARRAY)
+			{
+				std::uint64_t count = 0;
+				if(isShared_ || !readVarint(count) || count == 0 || count > static_cast<unsigned long long>(pending)
+					|| !readArray(builder, tag >> Compact::kindBits, count))
+				{
+					return false;
+				}
+				pending -= static_cast<long long>(count);
+				if(pending == 0)
+				{
+					return true;
+				}
+				if(!source_->readByte(tag))
+				{
+					return false;
+				}
+				continue;
+			}
+
+			std::uint64_t childrenCount = tag >> Compact::kindBits;
+			if(childrenCount == Compact::inlineChildrenLimit && !readVarint(childrenCount))
+			{
+				return false;
+			}
+			if(childrenCount > INT_MAX)
+			{
+				return false;
+			}
+
+			Type type = Type::INVALID;
+			std::uint64_t dataSize = 0;
+			const char *data = nullptr;
+			switch(tag & Compact::kindMask)
+			{
+				case Compact::INT:
+				{
+					type = Type::INT;
+					dataSize = sizeof(int);
+					break;
+				}
+				case Compact::REAL:
+				{
+					type = Type::REAL;
+					dataSize = sizeof(double);
+					break;
+				}
+				case Compact::STRING:
+				{
+					type = Type::STRING;
+					if(!readVarint(dataSize) || dataSize > INT_MAX)
+					{
+						return false;
+					}
+					break;
+				}
+				case Compact::STRING_REF:
+				{
+					type = Type::STRING;
+					std::uint64_t index = 0;
+					if(!readVarint(index) || index >= dictionary_.size())
+					{
+						return false;
+					}
+					data = dictionary_[index].first;
+					dataSize = dictionary_[index].second;
+					break;
+				}
+				case Compact::SUBTREE_REF:
+				{
+					std::uint64_t index = 0;
+					if(!isShared_ || childrenCount != 0 || !readVarint(index)
+						|| !recordReference(index) || !reference(builder, index))
+					{
+						return false;
+					}
+					break;
+				}
+				default:
+				{
+					return false;
+				}
+			}
+
+			if(type != Type::INVALID)
+			{
+				if(!data)
+				{
+					data = source_->take(dataSize);
+				}
+				if(!data)
+				{
+					return false;
+				}
+				if(isShared_)
+				{
+					recordNode(type, data, static_cast<int>(dataSize), static_cast<int>(childrenCount));
+				}
+				if(!builder.add(type, data, static_cast<int>(dataSize), static_cast<int>(childrenCount)))
+				{
+					return false;
+				}
+			}
+
+			pending += static_cast<long long>(childrenCount) - 1;
+			// Самый короткий лист - байт в INT_DELTA_ARRAY.
+			if(static_cast<unsigned long long>(pending) > source_->left())
+			{
+				return false;
+			}
+			if(pending == 0)
+			{
+				return true;
+			}
+			if(!source_->readByte(tag))
+			{
+				return false;
+			}
+		}
+	}
+
+	TreePtr read()
+	{
+		NaiveBuilder builder;
+		read(builder);
+		return builder.finish();
+	}
+
+	/// Читает дерево, сохраняя общие поддеревья общими.
+	TreeConstPtr readShared()
+	{
+		DagBuilder builder;
+		read(builder);
+		return builder.finish();
+	}
+
+private:
+	/// Узел или ссылка в файле с общими поддеревьями. Запоминаются все,
+	/// чтобы ссылку можно было развернуть для любого builder.
+	struct Record
+	{
+		Type type_;
+		const char *data_;
+		int dataSize_;
+		int childrenCount_;
+		bool isReference_;
+		std::uint64_t target_;
+		/// Конец поддерева в records_, 0 пока оно не закончено.
+		std::size_t end_;
+		/// Число узлов поддерева после разворачивания ссылок.
+		std::uint64_t expanded_;
+	};
+
+	void recordNode(const Type type, const char *data, const int dataSize, const int childrenCount)
+	{
+		if(!Source::keepsData)
+		{
+			copies_.emplace_back(data, dataSize);
+			data = copies_.back().data();
+		}
+		subtrees_.push_back(records_.size());
+		records_.push_back({type, data, dataSize, childrenCount, false, 0, 0, 1});
+		++expanded_;
+		if(childrenCount > 0)
+		{
+			open_.push_back({records_.size() - 1, childrenCount});
+			return;
+		}
+		close(records_.size() - 1);
+	}
+
+	/// Ссылаться можно только на уже законченное поддерево.
+	bool recordReference(const std::uint64_t index)
+	{
+		if(index >= subtrees_.size() || records_[subtrees_[index]].end_ == 0)
+		{
+			return false;
+		}
+		const auto expanded = records_[subtrees_[index]].expanded_;
+		records_.push_back({Type::INVALID, nullptr, 0, 0, true, index, 0, expanded});
+		close(records_.size() - 1);
+		return true;
+	}
+
+	void close(std::size_t record)
+	{
+		records_[record].end_ = record + 1;
+		while(!open_.empty())
+		{
+			auto &parent = open_.back();
+			records_[parent.first].expanded_ = addSaturated(records_[parent.first].expanded_, records_[record].expanded_);
+			if(--parent.second > 0)
+			{
+				return;
+			}
+			record = parent.first;
+			records_[record].end_ = records_.size();
+			open_.pop_back();
+		}
+	}
+
+	static std::uint64_t addSaturated(const std::uint64_t left, const std::uint64_t right)
+	{
+		return left + right < left ? UINT64_MAX : left + right;
+	}
+
+	/// Разворачивает поддерево index в builder узел за узлом.
+	template <class Builder>
+	bool reference(Builder &builder, const std::uint64_t index)
+	{
+		const auto root = subtrees_[index];
+		expanded_ = addSaturated(expanded_, records_[root].expanded_);
+		if(expanded_ > expandLimit_)
+		{
+			return false;
+		}
+		std::vector<std::pair<std::size_t, std::size_t>> stack{{root, records_[root].end_}};
+		while(!stack.empty())
+		{
+			const auto [next, end] = stack.back();
+			if(next == end)
+			{
+				stack.pop_back();
+				continue;
+			}
+			++stack.back().first;
+			const auto &record = records_[next];
+			if(record.isReference_)
+			{
+				const auto target = subtrees_[record.target_];
+				stack.push_back({target, records_[target].end_});
+				continue;
+			}
+			if(!builder.add(record.type_, record.data_, record.dataSize_, record.childrenCount_))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool reference(DagBuilder &builder, const std::uint64_t index)
+	{
+		return builder.reference(index);
+	}
+
+	/// Builder, который хранит не данные, а их положение в источнике.
+	template <class Builder, class = void>
+	struct ReferencesSource : std::false_type
+	{
+	};
+
+	template <class Builder>
+	struct ReferencesSource<Builder, std::void_t<decltype(Builder::referencesSource)>> :
+		std::integral_constant<bool, Builder::referencesSource>
+	{
+	};
+
+	/// Отдаёт builder count листьев узла ARRAY. Значения как есть
+	/// передаются прямо из источника, разности сначала декодируются.
+	/// У потока размер неизвестен, поэтому память растёт только
+	/// под уже прочитанные значения.
+	template <class Builder>
+	bool readArray(Builder &builder, const unsigned array, const std::uint64_t count)
+	{
+		if(array == Compact::INT_ARRAY || array == Compact::REAL_ARRAY)
+		{
+			const auto type = array == Compact::INT_ARRAY ? Type::INT : Type::REAL;
+			const int valueSize = array == Compact::INT_ARRAY ? sizeof(std::int32_t) : sizeof(double);
+			if(count > source_->left() / valueSize)
+			{
+				return false;
+			}
+			for(std::uint64_t done = 0; done < count; )
+			{
+				const auto part = std::min(count - done, Compact::arrayChunkSize);
+				const char *data = source_->take(part * valueSize);
+				if(!data)
+				{
+					return false;
+				}
+				for(std::uint64_t i = 0; i < part; ++i)
+				{
+					if(!builder.add(type, data + i * valueSize, valueSize, 0))
+					{
+						return false;
+					}
+				}
+				done += part;
+			}
+			return true;
+		}
+		if(array != Compact::INT_DELTA_ARRAY || ReferencesSource<Builder>::value || count > source_->left())
+		{
+			return false;
+		}
+		encoded_.clear();
+		encoded_.reserve(std::min(count, Compact::arrayChunkSize));
+		for(std::uint64_t i = 0; i < count; ++i)
+		{
+			std::uint64_t word = 0;
+			if(!readVarint(word) || word > UINT32_MAX)
+			{
+				return false;
+			}
+			encoded_.push_back(static_cast<std::uint32_t>(word));
+		}
+		decoded_.resize(count);
+		Compact::decodeDeltas(encoded_.data(), decoded_.data(), count);
+		for(const auto &value : decoded_)
+		{
+			if(!builder.add(Type::INT, reinterpret_cast<const char*>(&value), sizeof value, 0))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	/// Строки словаря указывают прямо в источник, если тот хранит
+	/// данные, иначе копируются.
+	bool readDictionary()
+	{
+		std::uint64_t count = 0;
+		if(!readVarint(count) || count > source_->left())
+		{
+			return false;
+		}
+		for(std::uint64_t i = 0; i < count; ++i)
+		{
+			std::uint64_t size = 0;
+			if(!readVarint(size) || size > INT_MAX)
+			{
+				return false;
+			}
+			const char *data = source_->take(size);
+			if(!data)
+			{
+				return false;
+			}
+			if(!Source::keepsData)
+			{
+				copies_.emplace_back(data, size);
+				data = copies_.back().data();
+			}
+			dictionary_.push_back({data, static_cast<int>(size)});
+		}
+		return true;
+	}
+
+	bool readVarint(std::uint64_t &value)
+	{
+		value = 0;
+		for(int shift = 0; shift < 64; shift += 7)
+		{
+			unsigned char byte = 0;
+			if(!source_->readByte(byte))
+			{
+				return false;
+			}
+			value |= static_cast<std::uint64_t>(byte & 0x7f) << shift;
+			if(!(byte & 0x80))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	Source *source_;
+	std::uint64_t expandLimit_;
+	std::vector<std::pair<const char*, int>> dictionary_;
+	std::deque<std::string> copies_;
+	std::vector<Record> records_;
+	std::vector<std::size_t> subtrees_;
+	std::vector<std::pair<std::size_t, int>> open_;
+	std::uint64_t expanded_ = 0;
+	bool isShared_ = false;
+	std::vector<std::uint32_t> encoded_;
+	std::vector<std::int32_t> decoded_;
+};
+}
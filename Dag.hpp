@@ -0,0 +1,209 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "Tree.hpp"
+
+namespace Tree
+{
+/// Builder, который складывает одинаковые поддеревья в один объект
+/// (hash-consing): законченный узел ищется по structuralHash среди
+/// уже построенных, и при совпадении данных и указателей на детей
+/// вместо него берётся найденный. Поэтому дети всегда уже единственны,
+/// и проверка совпадения не спускается ниже одного уровня.
+///
+/// Получается DAG из обычных узлов Naive. Поддеревья в нём общие,
+/// поэтому узлы замораживаются (freeze) и хранят свои хеши.
+class DagBuilder
+{
+public:
+	DagBuilder() = default;
+
+	/// Строки интернируются в pool.
+	explicit DagBuilder(StringPool *pool) :
+		pool_(pool)
+	{
+	}
+
+	bool add(const Type type, const char *data, const int dataSize, const int childrenCount)
+	{
+		if(childrenCount < 0 || (root_ && stack_.empty()))
+		{
+			return false;
+		}
+		auto node = NaiveBuilder::makeNode(type, data, dataSize, pool_);
+		if(!node)
+		{
+			return false;
+		}
+		const auto index = added_.size();
+		added_.emplace_back();
+		if(childrenCount == 0)
+		{
+			link(std::move(node), index);
+			return true;
+		}
+		static_cast<Naive*>(node.get())->children_.reserve(std::min(childrenCount, NaiveBuilder::maxReservedChildren));
+		stack_.push_back({std::move(node), index, childrenCount});
+		return true;
+	}
+
+	/// Добавляет следующим узлом уже собранное целиком поддерево.
+	bool attach(TreeConstPtr subtree)
+	{
+		if(!subtree || subtree->type() == Type::INVALID || (root_ && stack_.empty()))
+		{
+			return false;
+		}
+		subtree->freeze();
+		if(append(std::move(subtree)))
+		{
+			close();
+		}
+		return true;
+	}
+
+	/// Добавляет следующим узлом поддерево, которое начал index-й вызов add.
+	/// Так CompactIStream читает ссылки на поддеревья, не разворачивая их.
+	bool reference(const std::uint64_t index)
+	{
+		if(index >= added_.size() || !added_[index])
+		{
+			return false;
+		}
+		return attach(added_[index]);
+	}
+
+	bool isComplete() const
+	{
+		return root_ && stack_.empty();
+	}
+
+	TreeConstPtr finish()
+	{
+		added_.clear();
+		unique_.clear();
+		if(!isComplete())
+		{
+			root_.reset();
+			stack_.clear();
+			return makeConstPtr<Empty>();
+		}
+		return std::move(root_);
+	}
+
+	/// Число разных поддеревьев, построенных с последнего finish.
+	std::size_t uniqueCount() const
+	{
+		return unique_.size();
+	}
+
+	static TreeConstPtr copy(TreeConstPtr tree)
+	{
+		DagBuilder builder;
+		tree->visit([&builder](Abstract const * node){
+			const auto [data, dataSize] = node->bytes();
+			builder.add(node->type(), data, dataSize, node->childrenCount());
+		}, [](Abstract const * ){});
+		return builder.finish();
+	}
+
+private:
+	struct Frame
+	{
+		TreePtr node_;
+		std::size_t index_;
+		int remaining_;
+	};
+
+	/// Законченный узел заменяется общим и цепляется к родителю;
+	/// если на этом закончился и родитель, то дальше вверх.
+	void link(TreePtr node, const std::size_t index)
+	{
+		auto shared = canonical(std::move(node));
+		added_[index] = shared;
+		if(append(std::move(shared)))
+		{
+			close();
+		}
+	}
+
+	void close()
+	{
+		while(true)
+		{
+			auto frame = std::move(stack_.back());
+			stack_.pop_back();
+			auto shared = canonical(std::move(frame.node_));
+			added_[frame.index_] = shared;
+			if(!append(std::move(shared)))
+			{
+				return;
+			}
+		}
+	}
+
+	/// Добавляет ребёнка к открытому узлу; true, если тот заполнен.
+	bool append(TreeConstPtr child)
+	{
+		if(stack_.empty())
+		{
+			root_ = std::move(child);
+			return false;
+		}
+		auto &parent = stack_.back();
+		static_cast<Naive*>(parent.node_.get())->children_.push_back(std::move(child));
+		return --parent.remaining_ == 0;
+	}
+
+	/// Дети узла уже заморожены, поэтому его можно заморозить без обхода.
+	TreeConstPtr canonical(TreePtr node)
+	{
+		static_cast<Naive*>(node.get())->frozen_.store(true, std::memory_order_release);
+		const auto hash = node->structuralHash();
+		const auto range = unique_.equal_range(hash);
+		for(auto found = range.first; found != range.second; ++found)
+		{
+			if(isSame(found->second.get(), node.get()))
+			{
+				return found->second;
+			}
+		}
+		unique_.emplace(hash, node);
+		return node;
+	}
+
+	static bool isSame(Abstract const *left, Abstract const *right)
+	{
+		const auto count = left->childrenCount();
+		if(left->type() != right->type() || count != right->childrenCount())
+		{
+			return false;
+		}
+		const auto [leftData, leftSize] = left->bytes();
+		const auto [rightData, rightSize] = right->bytes();
+		if(leftSize != rightSize || (leftSize > 0 && std::memcmp(leftData, rightData, leftSize) != 0))
+		{
+			return false;
+		}
+		for(int i = 0; i < count; ++i)
+		{
+			if(left->child(i) != right->child(i))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	TreeConstPtr root_;
+	std::vector<Frame> stack_;
+	std::vector<TreeConstPtr> added_;
+	std::unordered_multimap<std::uint64_t, TreeConstPtr> unique_;
+	StringPool *pool_ = nullptr;
+};
+}
@@ -0,0 +1,282 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "File.hpp"
+#include "IO.hpp"
+#include "Mapped.hpp"
+#include "Span.hpp"
+#include "Tree.hpp"
+
+namespace Tree
+{
+/// Сохранение изменений дерева отдельными файлами поверх базового.
+///
+/// Узлы Naive помнят, сколько их детей уже записано (savedCount_),
+/// а менять дерево можно только добавлением детей через operator +,
+/// поэтому изменение - это новые дети у уже сохранённого узла.
+/// Файл изменений: заголовок (magic "TDLT", версия, число узлов
+/// до и после изменений, число операций) и операции APPEND_CHILD:
+/// путь до родителя (длина и номера детей от корня, по 4 байта)
+/// и новое поддерево сегментами v1.
+///
+/// Запись изменений обходит дерево в памяти, но пишет и читает
+/// только новые поддеревья.
+class Delta
+{
+public:
+	static constexpr char magic[4] = {'T', 'D', 'L', 'T'};
+	static constexpr std::uint32_t version = 1;
+	static constexpr std::size_t headerSize = sizeof magic + sizeof version + 3 * sizeof(std::uint64_t);
+
+	enum Operation : std::uint8_t
+	{
+		APPEND_CHILD = 1
+	};
+
+	/// Сохраняет дерево целиком, и дальше изменения считаются от него.
+	static bool saveBase(const std::string &fileName, TreeConstPtr tree)
+	{
+		if(!File::saveToFile(fileName, tree))
+		{
+			return false;
+		}
+		markSaved(tree.get());
+		return true;
+	}
+
+	/// Пишет детей, добавленных после последнего сохранения.
+	/// Корень должен быть уже сохранён через saveBase, save или load.
+	static bool save(const std::string &fileName, TreeConstPtr tree)
+	{
+		auto root = tree->asNaive();
+		if(!root)
+		{
+			return false;
+		}
+
+		struct Frame
+		{
+			Naive const *node_;
+			int next_;
+			int saved_;
+		};
+
+		BufferSink operations;
+		BasicOStream<BufferSink> output(&operations);
+		std::uint64_t operationCount = 0;
+		std::uint64_t baseCount = 0;
+		std::uint64_t appendedCount = 0;
+		std::vector<std::uint32_t> path;
+		std::vector<Frame> stack;
+		std::vector<Naive const*> changed;
+		bool isTracked = true;
+
+		const auto enter = [&](Naive const *node){
+			++baseCount;
+			const auto saved = node->savedCount_;
+			if(saved < 0)
+			{
+				// Узел попал в дерево мимо saveBase и load: от чего считать изменения, неизвестно.
+				isTracked = false;
+				return;
+			}
+			const auto count = static_cast<int>(node->children_.size());
+			for(int i = saved; i < count; ++i)
+			{
+				const std::uint8_t operation = APPEND_CHILD;
+				const std::uint32_t depth = path.size();
+				operations.write(reinterpret_cast<const char*>(&operation), sizeof operation);
+				operations.write(reinterpret_cast<const char*>(&depth), sizeof depth);
+				operations.write(reinterpret_cast<const char*>(path.data()), depth * sizeof(std::uint32_t));
+				const auto child = node->children_[i].get();
+				output.write(child);
+				appendedCount += countNodes(child);
+				++operationCount;
+			}
+			if(saved < count)
+			{
+				changed.push_back(node);
+			}
+			stack.push_back({node, 0, saved});
+		};
+
+		enter(root);
+		while(isTracked && !stack.empty())
+		{
+			auto &frame = stack.back();
+			if(frame.next_ == frame.saved_)
+			{
+				stack.pop_back();
+				if(!path.empty())
+				{
+					path.pop_back();
+				}
+				continue;
+			}
+			const auto index = frame.next_++;
+			const auto node = frame.node_->children_[index].get();
+			// Не Naive узлы не меняются, поэтому их поддеревья только считаются.
+			if(auto child = node->asNaive())
+			{
+				path.push_back(index);
+				enter(child);
+			}
+			else
+			{
+				baseCount += countNodes(node);
+			}
+		}
+		if(!isTracked)
+		{
+			return false;
+		}
+
+		FileSink sink(fileName);
+		if(!sink)
+		{
+			return false;
+		}
+		const auto resultCount = baseCount + appendedCount;
+		sink.write(magic, sizeof magic);
+		sink.write(reinterpret_cast<const char*>(&version), sizeof version);
+		sink.write(reinterpret_cast<const char*>(&baseCount), sizeof baseCount);
+		sink.write(reinterpret_cast<const char*>(&resultCount), sizeof resultCount);
+		sink.write(reinterpret_cast<const char*>(&operationCount), sizeof operationCount);
+		sink.write(operations.buffer().data(), operations.buffer().size());
+		if(!sink.flush())
+		{
+			return false;
+		}
+		// Только после успешной записи: иначе следующий save повторит изменения.
+		for(const auto node : changed)
+		{
+			for(auto i = node->savedCount_; i < static_cast<int>(node->children_.size()); ++i)
+			{
+				markSaved(node->children_[i].get());
+			}
+			node->savedCount_ = node->children_.size();
+		}
+		return true;
+	}
+
+	/// Применяет изменения из data к tree. Изменения должны быть
+	/// записаны от дерева ровно с nodeCount узлами; после применения
+	/// там оказывается число узлов результата. При ошибке дерево
+	/// может остаться изменённым частично.
+	static bool apply(TreePtr tree, const char *data, const std::size_t size, std::uint64_t &nodeCount)
+	{
+		if(!tree || tree->isEmpty() || size < headerSize || std::memcmp(data, magic, sizeof magic) != 0)
+		{
+			return false;
+		}
+		std::uint32_t fileVersion = 0;
+		std::uint64_t baseCount = 0;
+		std::uint64_t resultCount = 0;
+		std::uint64_t operationCount = 0;
+		std::size_t offset = sizeof magic;
+		readValue(data, offset, fileVersion);
+		readValue(data, offset, baseCount);
+		readValue(data, offset, resultCount);
+		readValue(data, offset, operationCount);
+		if(fileVersion != version || baseCount != nodeCount)
+		{
+			return false;
+		}
+
+		for(std::uint64_t i = 0; i < operationCount; ++i)
+		{
+			std::uint8_t operation = 0;
+			std::uint32_t depth = 0;
+			if(size - offset < sizeof operation + sizeof depth)
+			{
+				return false;
+			}
+			readValue(data, offset, operation);
+			readValue(data, offset, depth);
+			if(operation != APPEND_CHILD || (size - offset) / sizeof(std::uint32_t) < depth)
+			{
+				return false;
+			}
+			Abstract const *parent = tree.get();
+			for(std::uint32_t level = 0; level < depth; ++level)
+			{
+				std::uint32_t index = 0;
+				readValue(data, offset, index);
+				if(index >= static_cast<std::uint32_t>(parent->childrenCount()))
+				{
+					return false;
+				}
+				parent = parent->child(index);
+			}
+			auto naive = parent->asNaive();
+			if(!naive || naive->isFrozen())
+			{
+				return false;
+			}
+
+			SpanReader reader(data + offset, size - offset);
+			NaiveBuilder builder;
+			if(!reader.read(builder))
+			{
+				return false;
+			}
+			offset += reader.offset();
+			auto subtree = builder.finish();
+			nodeCount += countNodes(subtree.get());
+			// Узлы дерева созданы NaiveBuilder изменяемыми, константен только указатель.
+			const_cast<Abstract*>(parent)->addChild(std::move(subtree));
+		}
+		return offset == size && nodeCount == resultCount;
+	}
+
+	/// Читает базовый файл и применяет к нему по порядку цепочку изменений.
+	static TreePtr load(const std::string &baseFileName, const std::vector<std::string> &deltaFileNames)
+	{
+		auto tree = File::loadFromFile(baseFileName);
+		if(tree->isEmpty())
+		{
+			return tree;
+		}
+		auto nodeCount = countNodes(tree.get());
+		for(const auto &deltaFileName : deltaFileNames)
+		{
+			const auto file = MappedFile::open(deltaFileName);
+			if(!file || !apply(tree, file->data(), file->size(), nodeCount))
+			{
+				return makePtr<Empty>();
+			}
+		}
+		markSaved(tree.get());
+		return tree;
+	}
+
+private:
+	template <typename T>
+	static void readValue(const char *data, std::size_t &offset, T &value)
+	{
+		std::memcpy(&value, data + offset, sizeof value);
+		offset += sizeof value;
+	}
+
+	static std::uint64_t countNodes(Abstract const *tree)
+	{
+		std::uint64_t count = 0;
+		tree->visit([&count](Abstract const * ){ ++count; }, [](Abstract const * ){});
+		return count;
+	}
+
+	static void markSaved(Abstract const *tree)
+	{
+		tree->visit([](Abstract const * node){
+			if(auto naive = node->asNaive())
+			{
+				naive->savedCount_ = static_cast<int>(naive->children_.size());
+			}
+		}, [](Abstract const * ){});
+	}
+};
+}
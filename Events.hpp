@@ -0,0 +1,249 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <istream>
+#include <string_view>
+#include <vector>
+
+#include "IO.hpp"
+#include "Tree.hpp"
+
+namespace Tree
+{
+/// Событие потокового чтения: вход в узел со всеми его данными
+/// или выход из узла после всех его детей.
+struct Event
+{
+	enum Kind
+	{
+		ENTER,
+		EXIT
+	};
+
+	Kind kind_ = ENTER;
+	Type type_ = Type::INVALID;
+	const char *data_ = nullptr;
+	int dataSize_ = 0;
+	int childrenCount_ = 0;
+	std::size_t depth_ = 0;
+
+	int toInt() const
+	{
+		int value = 0;
+		std::memcpy(&value, data_, sizeof value);
+		return value;
+	}
+
+	double toReal() const
+	{
+		double value = 0;
+		std::memcpy(&value, data_, sizeof value);
+		return value;
+	}
+
+	std::string_view toString() const
+	{
+		return std::string_view(data_, dataSize_);
+	}
+};
+
+/// Потоковое чтение дерева в формате v1 без построения узлов.
+/// Кроме буфера данных текущего узла хранится только стек
+/// открытых узлов, поэтому память зависит от глубины, а не от размера.
+/// Данные события действительны до следующего вызова next.
+class EventReader
+{
+public:
+	explicit EventReader(std::istream *stream) :
+		stream_(stream)
+	{
+	}
+
+	/// Pull: следующее событие или false в конце дерева и при ошибке.
+	bool next(Event &event)
+	{
+		if(!open_.empty() && open_.back().remaining_ == 0)
+		{
+			event = Event{};
+			event.kind_ = Event::EXIT;
+			event.type_ = open_.back().type_;
+			event.childrenCount_ = open_.back().childrenCount_;
+			event.depth_ = open_.size() - 1;
+			open_.pop_back();
+			return true;
+		}
+		if(isStarted_ && open_.empty())
+		{
+			return false;
+		}
+
+		char header[IO<std::istream>::segmentHeaderSize];
+		if(!stream_->read(header, sizeof header))
+		{
+			return fail();
+		}
+		event = Event{};
+		event.kind_ = Event::ENTER;
+		event.type_ = IO<std::istream>::typeForSignature(header[0]);
+		std::memcpy(&event.childrenCount_, header + 1, sizeof event.childrenCount_);
+		std::memcpy(&event.dataSize_, header + 1 + sizeof(int), sizeof event.dataSize_);
+		if(event.type_ == Type::INVALID || event.childrenCount_ < 0 || event.dataSize_ < 0
+			|| (event.type_ == Type::INT && event.dataSize_ != sizeof(int))
+			|| (event.type_ == Type::REAL && event.dataSize_ != sizeof(double)))
+		{
+			return fail();
+		}
+
+		if(!readData(static_cast<std::size_t>(event.dataSize_)))
+		{
+			return fail();
+		}
+		event.data_ = buffer_.data();
+		event.depth_ = open_.size();
+
+		if(!open_.empty())
+		{
+			--open_.back().remaining_;
+		}
+		open_.push_back({event.type_, event.childrenCount_, event.childrenCount_});
+		isStarted_ = true;
+		return true;
+	}
+
+	/// Push: вызывает handler.enterNode(event) и handler.exitNode(event)
+	/// для всего дерева. Возвращает false при ошибке чтения.
+	template <class Handler>
+	bool read(Handler &handler)
+	{
+		Event event;
+		while(next(event))
+		{
+			if(event.kind_ == Event::ENTER)
+			{
+				handler.enterNode(event);
+			}
+			else
+			{
+				handler.exitNode(event);
+			}
+		}
+		return isComplete();
+	}
+
+	/// Дерево прочитано целиком и без ошибок.
+	bool isComplete() const
+	{
+		return isStarted_ && open_.empty() && !isFailed_;
+	}
+
+	std::size_t depth() const
+	{
+		return open_.size();
+	}
+
+private:
+	struct Open
+	{
+		Type type_;
+		int childrenCount_;
+		int remaining_;
+	};
+
+	/// Размер данных берётся из файла, поэтому буфер растёт кусками
+	/// по мере чтения: ложный размер не выделяет память без данных.
+	bool readData(const std::size_t size)
+	{
+		buffer_.clear();
+		while(buffer_.size() < size)
+		{
+			const auto offset = buffer_.size();
+			const auto part = std::min(size - offset, chunkSize);
+			buffer_.resize(offset + part);
+			if(!stream_->read(buffer_.data() + offset, part))
+			{
+				return false;
+			}
+		}
+		buffer_.push_back('\0');
+		return true;
+	}
+
+	bool fail()
+	{
+		isFailed_ = true;
+		isStarted_ = true;
+		open_.clear();
+		return false;
+	}
+
+	static constexpr std::size_t chunkSize = 1 << 20;
+
+	std::istream *stream_;
+	std::vector<Open> open_;
+	std::vector<char> buffer_;
+	bool isStarted_ = false;
+	bool isFailed_ = false;
+};
+
+/// Потоковая запись дерева в формате v1 из событий, без узлов Naive.
+/// Число детей пишется в заголовке узла, поэтому его нужно знать
+/// заранее; exitNode проверяет, что обещанные дети действительно были.
+template <class Sink>
+class EventWriter
+{
+public:
+	explicit EventWriter(Sink *sink) :
+		stream_(sink)
+	{
+	}
+
+	bool enterNode(const Type type, const char *data, const int dataSize, const int childrenCount)
+	{
+		if(type == Type::INVALID || childrenCount < 0 || dataSize < 0
+			|| (isStarted_ && open_.empty())
+			|| (!open_.empty() && open_.back() == 0))
+		{
+			return false;
+		}
+		if(!open_.empty())
+		{
+			--open_.back();
+		}
+		open_.push_back(childrenCount);
+		isStarted_ = true;
+		stream_.writeSegment(type, data, dataSize, childrenCount);
+		return true;
+	}
+
+	bool enterNode(const Event &event)
+	{
+		return enterNode(event.type_, event.data_, event.dataSize_, event.childrenCount_);
+	}
+
+	bool exitNode()
+	{
+		if(open_.empty() || open_.back() != 0)
+		{
+			return false;
+		}
+		open_.pop_back();
+		return true;
+	}
+
+	bool exitNode(const Event &)
+	{
+		return exitNode();
+	}
+
+	bool isComplete() const
+	{
+		return isStarted_ && open_.empty();
+	}
+
+private:
+	BasicOStream<Sink> stream_;
+	std::vector<int> open_;
+	bool isStarted_ = false;
+};
+}
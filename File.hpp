@@ -0,0 +1,203 @@
+#pragma once
+
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include "Async.hpp"
+#include "Block.hpp"
+#include "Compact.hpp"
+#include "IO.hpp"
+#include "Mapped.hpp"
+#include "Pool.hpp"
+#include "Span.hpp"
+#include "Stats.hpp"
+#include "Text.hpp"
+#include "Tree.hpp"
+
+namespace Tree
+{
+class File
+{
+public:
+	static bool saveToFile(const std::string &fileName,
+						   TreeConstPtr tree,
+						   const Format format = Format::V1)
+	{
+		Stats::Timer timer(Stats::Phase::SAVE);
+		FileSink sink(fileName);
+		if(!sink)
+		{
+			return false;
+		}
+		write(&sink, tree, format);
+		return sink.flush();
+	}
+
+	/// Сохраняет дерево в контейнере из сжатых codec блоков.
+	static bool saveToFile(const std::string &fileName,
+						   TreeConstPtr tree,
+						   const Format format,
+						   Block::Codec const &codec,
+						   const std::size_t blockSize = Block::defaultBlockSize)
+	{
+		Stats::Timer timer(Stats::Phase::SAVE);
+		FileSink sink(fileName);
+		if(!sink)
+		{
+			return false;
+		}
+		{
+			Block::BlockSink<FileSink> blocks(&sink, codec, blockSize);
+			write(&blocks, tree, format);
+		}
+		return sink.flush();
+	}
+
+	/// Сжатые блоки распаковываются на pool, если он задан.
+	static TreePtr loadFromFile(const std::string &fileName, ThreadPool *pool = nullptr)
+	{
+		Stats::Timer timer(Stats::Phase::LOAD);
+		std::ifstream stream(fileName.c_str());
+		if(!stream)
+		{
+			return Tree::makePtr<Empty>();
+		}
+		char magic[sizeof Block::magic] = {};
+		stream.read(magic, sizeof magic);
+		if(stream && std::memcmp(magic, Block::magic, sizeof magic) == 0)
+		{
+			return loadBlocks(fileName, pool);
+		}
+		stream.clear();
+		stream.seekg(0);
+		if(stream.peek() == static_cast<unsigned char>(Compact::magic[0]))
+		{
+			Compact::StreamSource source(&stream);
+			return CompactIStream<Compact::StreamSource>(&source).read();
+		}
+		return IStream(&stream).read();
+	}
+
+	/// Как saveToFile, но write(2) выполняет отдельный поток,
+	/// пока этот поток формирует следующие сегменты.
+	static bool saveToFileAsync(const std::string &fileName,
+								TreeConstPtr tree,
+								const Format format = Format::V1)
+	{
+		Stats::Timer timer(Stats::Phase::SAVE);
+		Async::FileSink sink(fileName);
+		if(!sink)
+		{
+			return false;
+		}
+		write(&sink, tree, format);
+		return sink.flush();
+	}
+
+	/// Как loadFromFile, но файл заранее читается блоками в отдельном
+	/// потоке, пока этот поток разбирает уже прочитанные.
+	static TreePtr loadFromFileAsync(const std::string &fileName)
+	{
+		Stats::Timer timer(Stats::Phase::LOAD);
+		Async::ReadBuffer buffer(fileName);
+		if(!buffer.isOpen())
+		{
+			return Tree::makePtr<Empty>();
+		}
+		std::istream stream(&buffer);
+		char magic[sizeof Block::magic] = {};
+		stream.read(magic, sizeof magic);
+		if(stream && std::memcmp(magic, Block::magic, sizeof magic) == 0)
+		{
+			// Блоки распаковываются из отображённого файла целиком.
+			return loadBlocks(fileName, nullptr);
+		}
+		// Заголовок лежит в первом буфере кольца, поэтому его можно вернуть.
+		const auto headerSize = stream.gcount();
+		stream.clear();
+		for(auto i = headerSize; i > 0; --i)
+		{
+			stream.unget();
+		}
+		TreePtr tree;
+		if(stream.peek() == static_cast<unsigned char>(Compact::magic[0]))
+		{
+			Compact::StreamSource source(&stream);
+			tree = CompactIStream<Compact::StreamSource>(&source).read();
+		}
+		else
+		{
+			tree = IStream(&stream).read();
+		}
+		return buffer.failed() ? Tree::makePtr<Empty>() : tree;
+	}
+
+	/// Сохраняет дерево текстом toQuotedText с переводом строки в конце.
+	static bool saveToTextFile(const std::string &fileName, TreeConstPtr tree)
+	{
+		Stats::Timer timer(Stats::Phase::SAVE);
+		FileSink sink(fileName);
+		if(!sink)
+		{
+			return false;
+		}
+		tree->writeText(sink, true);
+		sink.write("\n", 1);
+		return sink.flush();
+	}
+
+	/// Читает файл, записанный saveToTextFile; при ошибке разбора - Empty.
+	static TreePtr loadFromTextFile(const std::string &fileName)
+	{
+		Stats::Timer timer(Stats::Phase::LOAD);
+		const auto file = MappedFile::open(fileName);
+		if(!file)
+		{
+			return Tree::makePtr<Empty>();
+		}
+		TextReader reader(file->data(), file->size());
+		NaiveBuilder builder;
+		if(!reader.read(builder))
+		{
+			return Tree::makePtr<Empty>();
+		}
+		return builder.finish();
+	}
+
+private:
+	template <class Sink>
+	static void write(Sink *sink, TreeConstPtr tree, const Format format)
+	{
+		if(format != Format::V1)
+		{
+			CompactOStream<Sink>(sink, Compact::optionsFor(format)).write(tree);
+		}
+		else
+		{
+			BasicOStream<Sink>(sink).write(tree);
+		}
+	}
+
+	static TreePtr loadBlocks(const std::string &fileName, ThreadPool *pool)
+	{
+		const auto file = MappedFile::open(fileName);
+		if(!file)
+		{
+			return Tree::makePtr<Empty>();
+		}
+		std::string bytes;
+		if(!Block::Reader(file->data(), file->size()).read(bytes, pool))
+		{
+			return Tree::makePtr<Empty>();
+		}
+		if(Compact::isCompact(bytes.data(), bytes.size()))
+		{
+			Compact::SpanSource source(bytes.data(), bytes.size());
+			return CompactIStream<Compact::SpanSource>(&source).read();
+		}
+		return SpanReader(bytes).read();
+	}
+};
+}
@@ -3,7 +3,17 @@
 #include <fstream>
 #include <sstream>
 #include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <limits>
+#include <vector>
 
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "Compact.hpp"
+#include "Stats.hpp"
 #include "Tree.hpp"
 
 namespace Tree
@@ -37,6 +47,8 @@ protected:
 
 	bool processSegment(Segment &s)
 	{
+		Stats::add(Stats::Counter::SEGMENTS);
+		Stats::add(Stats::Counter::VIRTUAL_CALLS, 3);
 		processType(s.type_);
 		processInt(s.childrenCount_);
 		processInt(s.dataSize_);
@@ -44,6 +56,7 @@ protected:
 		{
 			return false;
 		}
+		Stats::add(Stats::Counter::VIRTUAL_CALLS);
 		processData(s.type_, s.dataSize_, s.constData_, s.dynamicData_);
 		return true;
 	}
@@ -51,15 +64,24 @@ protected:
 	template <typename T>
 	void writeData(const T *data, const int size)
 	{
+		Stats::add(Stats::Counter::WRITES);
+		Stats::add(Stats::Counter::BYTES_WRITTEN, size);
 		stream_->write(reinterpret_cast<const char*>(data), size);
 	}
 
 	template <typename T>
 	void readData(T *data, const int size)
 	{
+		Stats::add(Stats::Counter::READS);
+		Stats::add(Stats::Counter::BYTES_READ, size);
 		stream_->read(reinterpret_cast<char*>(data), size);
 	}
 
+	bool isGood() const
+	{
+		return static_cast<bool>(*stream_);
+	}
+
 	template <typename T>
 	T convertTo(const char *data)
 	{		
@@ -75,6 +97,7 @@ protected:
 							 const char *constData, 
 							 char *&dynamicData) = 0;
 
+public:
 	static const char signatureForType(const Type t)
 	{
 		switch(t)
@@ -99,49 +122,74 @@ protected:
 		return Type::INVALID;
 	} 
 
+	/// Размер заголовка сегмента: сигнатура, число детей и размер данных.
+	static constexpr std::size_t segmentHeaderSize = sizeof(char) + 2 * sizeof(int);
+
 private:
 	Stream *stream_;
 };
 
-class OStream : public IO<std::ostream>
+template <class Sink>
+class BasicOStream : public IO<Sink>
 {
+	using Base = IO<Sink>;
+	using Segment = typename Base::Segment;
+
 public:
-	OStream(std::ostream *stream) :
-		IO(stream) 
+	BasicOStream(Sink *stream) :
+		Base(stream) 
 	{
 	}
 
-	OStream& write(TreeConstPtr tree)
+	BasicOStream& write(TreeConstPtr tree)
 	{
-		auto initial = [this](Abstract const * tree)
-		{
-			if(!tree)
-			{
-				return;
-			}
-			const auto [data, dataSize] = tree->bytes();
-			Segment s{.type_ = tree->type(),
-                      .childrenCount_ = tree->childrenCount(),
-					  .dataSize_ = dataSize,
-					  .constData_ = data,
-					  .dynamicData_ = nullptr};
-			processSegment(s);
-		};
-		tree->traverse(initial, [](Abstract const * ){});
+		return write(tree.get());
+	}
+
+	BasicOStream& write(Abstract const *tree)
+	{
+		tree->visit([this](Abstract const * tree){
+			writeNode(tree);
+		}, [](Abstract const * ){});
 
 		return *this;	
 	}
 
+	/// Пишет только сегмент самого узла, без его детей.
+	BasicOStream& writeNode(Abstract const *tree)
+	{
+		if(!tree)
+		{
+			return *this;
+		}
+		const auto [data, dataSize] = tree->bytes();
+		return writeSegment(tree->type(), data, dataSize, tree->childrenCount());
+	}
+
+	BasicOStream& writeSegment(const Type type,
+							   const char *data,
+							   const int dataSize,
+							   const int childrenCount)
+	{
+		Segment s{.type_ = type,
+                  .childrenCount_ = childrenCount,
+				  .dataSize_ = dataSize,
+				  .constData_ = data,
+				  .dynamicData_ = nullptr};
+		this->processSegment(s);
+		return *this;
+	}
+
 protected:	
 	virtual void processType(Type &t)
 	{
-		const auto signature = IO::signatureForType(t);
-		writeData<char>(&signature, sizeof signature);
+		const auto signature = Base::signatureForType(t);
+		this->template writeData<char>(&signature, sizeof signature);
 	}
 
 	virtual void processInt(int &n)
 	{
-		writeData<int>(&n, sizeof n);
+		this->template writeData<int>(&n, sizeof n);
 	}
 
 	virtual void processData(const Type type,
@@ -149,56 +197,193 @@ protected:
 							 const char *constData,
 							 char *&dynamicData)
 	{
-		writeData<char>(constData, dataSize);
+		this->template writeData<char>(constData, dataSize);
 	}
 };
 
-class IStream : public IO<std::istream>
+using OStream = BasicOStream<std::ostream>;
+
+/// Приёмник для BasicOStream, который копит сегменты в большом буфере
+/// и сбрасывает его в файловый дескриптор целыми блоками через write(2).
+class FileSink
 {
 public:
-	IStream(std::istream *stream) :
-		IO(stream)
+	static constexpr std::size_t defaultBlockSize = 1 << 20;
+
+	explicit FileSink(const std::string &fileName, const std::size_t blockSize = defaultBlockSize) :
+		fd_(::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)),
+		ownsFd_(true),
+		failed_(fd_ < 0)
+	{
+		buffer_.reserve(blockSize);
+	}
+
+	explicit FileSink(const int fd, const std::size_t blockSize = defaultBlockSize) :
+		fd_(fd),
+		ownsFd_(false),
+		failed_(fd_ < 0)
 	{
+		buffer_.reserve(blockSize);
+	}
 
+	FileSink(const FileSink&) = delete;
+	FileSink& operator = (const FileSink&) = delete;
+
+	~FileSink()
+	{
+		flush();
+		if(ownsFd_ && fd_ >= 0)
+		{
+			::close(fd_);
+		}
 	}
 
-	TreePtr read()
+	FileSink& write(const char *data, const std::streamsize size)
 	{
-		Segment s;
-		processSegment(s);
-		if(!s.dynamicData_)
+		if(failed_ || size <= 0)
 		{
-			return Tree::makePtr<Empty>();
+			return *this;
+		}
+		const auto length = static_cast<std::size_t>(size);
+		if(buffer_.size() + length <= buffer_.capacity())
+		{
+			buffer_.insert(buffer_.end(), data, data + length);
+			return *this;
+		}
+		if(length < buffer_.capacity())
+		{
+			flush();
+			buffer_.insert(buffer_.end(), data, data + length);
+			return *this;
 		}
 
-		TreePtr tree;
-		switch(s.type_)
+		// Крупные данные уходят одним writev вместе с накопленным буфером.
+		iovec parts[2] = {{buffer_.data(), buffer_.size()},
+						  {const_cast<char*>(data), length}};
+		writeAll(parts, 2);
+		buffer_.clear();
+		return *this;
+	}
+
+	bool flush()
+	{
+		if(!failed_ && !buffer_.empty())
 		{
-		 	case Type::INVALID:
-		 	{
-		 		return Tree::makePtr<Empty>();
-		 	}
-		 	case Type::INT:
-		 	{
-		 		tree = Tree::makePtr<Int>(convertTo<int>(s.dynamicData_));
-		 		break;
-		 	}
-		 	case Type::REAL:
-		 	{
-		 		tree = Tree::makePtr<Real>(convertTo<double>(s.dynamicData_));
-		 		break;
-		 	}
-		 	case Type::STRING:
-		 	{
-		 		tree = Tree::makePtr<String>(s.dynamicData_);
-		 		break;
-		 	}
+			iovec part = {buffer_.data(), buffer_.size()};
+			writeAll(&part, 1);
 		}
-		for(int i = 0; i < s.childrenCount_; ++i)
+		buffer_.clear();
+		return !failed_;
+	}
+
+	explicit operator bool() const
+	{
+		return !failed_;
+	}
+
+private:
+	void writeAll(iovec *parts, int count)
+	{
+		while(count > 0 && !failed_)
 		{
-			tree + read();
-		}	
-		return tree;
+			const auto written = ::writev(fd_, parts, count);
+			if(written < 0)
+			{
+				failed_ = errno != EINTR;
+				continue;
+			}
+			auto left = static_cast<std::size_t>(written);
+			while(count > 0 && left >= parts->iov_len)
+			{
+				left -= parts->iov_len;
+				++parts;
+				--count;
+			}
+			if(count > 0)
+			{
+				parts->iov_base = static_cast<char*>(parts->iov_base) + left;
+				parts->iov_len -= left;
+			}
+		}
+	}
+
+	int fd_;
+	bool ownsFd_;
+	bool failed_;
+	std::vector<char> buffer_;
+};
+
+using FileOStream = BasicOStream<FileSink>;
+
+/// Приёмник, накапливающий байты в std::string.
+class BufferSink
+{
+public:
+	BufferSink& write(const char *data, const std::streamsize size)
+	{
+		buffer_.append(data, size);
+		return *this;
+	}
+
+	explicit operator bool() const
+	{
+		return true;
+	}
+
+	std::string& buffer()
+	{
+		return buffer_;
+	}
+
+private:
+	std::string buffer_;
+};
+
+class IStream : public IO<std::istream>
+{
+public:
+	IStream(std::istream *stream) :
+		IO(stream),
+		input_(stream)
+	{
+
+	}
+
+	TreePtr read()
+	{
+		NaiveBuilder builder;
+		read(builder);
+		return builder.finish();
+	}
+
+	/// Читает дерево сегмент за сегментом прямо в builder,
+	/// не создавая промежуточных узлов Naive.
+	template <class Builder>
+	bool read(Builder &builder)
+	{
+		left_ = bytesLeft();
+		long long pending = 1;
+		while(pending > 0)
+		{
+			Segment s;
+			processSegment(s);
+			if(!isGood() || s.type_ == Type::INVALID || s.childrenCount_ < 0 || s.dataSize_ < 0)
+			{
+				return false;
+			}
+			if(!builder.add(s.type_, s.dynamicData_, s.dataSize_, s.childrenCount_))
+			{
+				return false;
+			}
+			pending += static_cast<long long>(s.childrenCount_) - 1;
+			left_ -= segmentHeaderSize + s.dataSize_;
+			// Каждому обещанному ребёнку нужен хотя бы заголовок.
+			if(static_cast<unsigned long long>(pending) > left_ / segmentHeaderSize)
+			{
+				return false;
+			}
+		}
+		return true;
 	}
 
 protected:
@@ -223,34 +408,44 @@ protected:
 		{
 			return;
 		}
+		// Данные не помещаются в остаток потока: не выделять под них память.
+		if(left_ < segmentHeaderSize || static_cast<std::uint64_t>(dataSize) > left_ - segmentHeaderSize)
+		{
+			input_->setstate(std::ios_base::failbit);
+			return;
+		}
+		Stats::add(Stats::Counter::ALLOCATIONS);
+		Stats::add(Stats::Counter::ALLOCATED_BYTES, dataSize + 1);
 		dynamicData = new char[dataSize + 1];
 		dynamicData[dataSize] = '\0';
 		readData<char>(dynamicData, dataSize);
 	}
-};
 
-class File
-{
-public:
-	static bool saveToFile(const std::string &fileName, TreeConstPtr tree)
+private:
+	/// Байт до конца потока; у потока без позиции (pipe, Async::ReadBuffer)
+	/// конец неизвестен, и граница не проверяется.
+	std::uint64_t bytesLeft()
 	{
-		std::ofstream stream(fileName.c_str());
-		if(!stream)
+		constexpr auto unknown = std::numeric_limits<std::uint64_t>::max();
+		const auto position = input_->tellg();
+		if(position < 0)
 		{
-			return false;
+			return unknown;
 		}
-		OStream(&stream).write(tree);
-		return true;
-	}
-	static TreePtr loadFromFile(const std::string &fileName)
-	{
-		std::ifstream stream(fileName.c_str());
-		if(!stream)
+		input_->seekg(0, std::ios_base::end);
+		const auto end = input_->tellg();
+		input_->seekg(position);
+		if(end < position || !isGood())
 		{
-			return Tree::makePtr<Empty>();
+			input_->clear();
+			input_->seekg(position);
+			return unknown;
 		}
-		return IStream(&stream).read();
+		return static_cast<std::uint64_t>(end - position);
 	}
+
+	std::istream *input_;
+	std::uint64_t left_ = 0;
 };
 
 }
@@ -0,0 +1,372 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "File.hpp"
+#include "IO.hpp"
+#include "Mapped.hpp"
+#include "Span.hpp"
+#include "Tree.hpp"
+
+namespace Tree
+{
+/// Индекс для ленивого чтения файла v1: заголовок (magic "TIDX",
+/// версия, число узлов, размер файла дерева) и для каждого узла
+/// в прямом порядке обхода смещение его сегмента и число узлов в его поддереве.
+namespace LazyIndex
+{
+constexpr char magic[4] = {'T', 'I', 'D', 'X'};
+constexpr std::uint32_t version = 1;
+constexpr std::size_t headerSize = sizeof magic + sizeof version + 2 * sizeof(std::uint64_t);
+constexpr std::size_t entrySize = 2 * sizeof(std::uint64_t);
+
+inline std::uint64_t readWord(const char *data)
+{
+	std::uint64_t word = 0;
+	std::memcpy(&word, data, sizeof word);
+	return word;
+}
+
+/// Собирает записи индекса по сегментам, которые отдаёт SpanReader.
+class Builder
+{
+public:
+	explicit Builder(const char *base) :
+		base_(base)
+	{
+	}
+
+	bool add(const Type type, const char *data, const int dataSize, const int childrenCount)
+	{
+		const auto index = offsets_.size();
+		offsets_.push_back(data - base_ - IO<std::istream>::segmentHeaderSize);
+		sizes_.push_back(1);
+		if(!open_.empty())
+		{
+			--open_.back().second;
+		}
+		if(childrenCount > 0)
+		{
+			open_.push_back({index, childrenCount});
+		}
+		while(!open_.empty() && open_.back().second == 0)
+		{
+			sizes_[open_.back().first] = offsets_.size() - open_.back().first;
+			open_.pop_back();
+		}
+		return true;
+	}
+
+	bool write(const std::string &indexFileName, const std::uint64_t treeSize) const
+	{
+		FileSink sink(indexFileName);
+		if(!sink)
+		{
+			return false;
+		}
+		const std::uint64_t count = offsets_.size();
+		sink.write(magic, sizeof magic);
+		sink.write(reinterpret_cast<const char*>(&version), sizeof version);
+		sink.write(reinterpret_cast<const char*>(&count), sizeof count);
+		sink.write(reinterpret_cast<const char*>(&treeSize), sizeof treeSize);
+		for(std::size_t i = 0; i < offsets_.size(); ++i)
+		{
+			sink.write(reinterpret_cast<const char*>(&offsets_[i]), sizeof offsets_[i]);
+			sink.write(reinterpret_cast<const char*>(&sizes_[i]), sizeof sizes_[i]);
+		}
+		return sink.flush();
+	}
+
+private:
+	const char *base_;
+	std::vector<std::uint64_t> offsets_;
+	std::vector<std::uint64_t> sizes_;
+	std::vector<std::pair<std::size_t, int>> open_;
+};
+}
+
+class LazyNode;
+
+/// Общие для всех ленивых узлов отображения файла дерева и индекса.
+struct LazyFile
+{
+	std::shared_ptr<MappedFile const> tree_;
+	std::shared_ptr<MappedFile const> index_;
+	std::uint64_t nodes_ = 0;
+	/// Сегменты, разобранные только ради пропуска поддеревьев.
+	mutable std::atomic<std::uint64_t> skipped_{0};
+
+	bool hasIndex() const
+	{
+		return index_ != nullptr;
+	}
+
+	std::uint64_t offset(const std::uint64_t node) const
+	{
+		return LazyIndex::readWord(index_->data() + LazyIndex::headerSize + node * LazyIndex::entrySize);
+	}
+
+	std::uint64_t subtreeSize(const std::uint64_t node) const
+	{
+		return LazyIndex::readWord(index_->data() + LazyIndex::headerSize
+			+ node * LazyIndex::entrySize + sizeof(std::uint64_t));
+	}
+};
+
+/// Узел, который разбирает свой сегмент сразу, а детей - только
+/// при первом обращении к ним. С индексом соседнее поддерево
+/// пропускается за O(1), без индекса - разбором его сегментов.
+/// Испорченные части файла читаются как пустые деревья.
+class LazyNode : public Abstract
+{
+public:
+	LazyNode(std::shared_ptr<LazyFile const> file, const std::uint64_t node, const std::uint64_t offset) :
+		file_(std::move(file)),
+		node_(node),
+		offset_(offset)
+	{
+		const auto size = file_->tree_->size();
+		const char *data = file_->tree_->data();
+		if(offset_ > size || size - offset_ < IO<std::istream>::segmentHeaderSize)
+		{
+			return;
+		}
+		int childrenCount = 0;
+		int dataSize = 0;
+		std::memcpy(&childrenCount, data + offset_ + 1, sizeof childrenCount);
+		std::memcpy(&dataSize, data + offset_ + 1 + sizeof childrenCount, sizeof dataSize);
+		const auto left = size - offset_ - IO<std::istream>::segmentHeaderSize;
+		const auto type = IO<std::istream>::typeForSignature(data[offset_]);
+		// Каждому ребёнку нужен хотя бы заголовок сегмента после данных узла.
+		if(childrenCount < 0 || dataSize < 0 || static_cast<std::size_t>(dataSize) > left
+			|| static_cast<std::size_t>(childrenCount) > (left - dataSize) / IO<std::istream>::segmentHeaderSize
+			|| (type == Type::INT && dataSize != sizeof(int))
+			|| (type == Type::REAL && dataSize != sizeof(double)))
+		{
+			return;
+		}
+		type_ = type;
+		childrenCount_ = type_ == Type::INVALID ? 0 : childrenCount;
+		dataSize_ = dataSize;
+		data_ = data + offset_ + IO<std::istream>::segmentHeaderSize;
+	}
+
+	/// Освобождает загруженных детей без рекурсии.
+	~LazyNode()
+	{
+		auto pending = std::move(children_);
+		while(!pending.empty())
+		{
+			auto child = std::move(pending.back());
+			pending.pop_back();
+			std::move(child->children_.begin(), child->children_.end(), std::back_inserter(pending));
+			child->children_.clear();
+		}
+	}
+
+	virtual bool isEmpty()
+	{
+		return type_ == Type::INVALID;
+	}
+
+	virtual int childrenCount() const
+	{
+		return childrenCount_;
+	}
+
+	virtual void traverse(std::function<void(Abstract const *)> initial,
+				  std::function<void(Abstract const *)> final) const
+	{
+		traverseIteratively(initial, final);
+	}
+
+	virtual Abstract const* child(const int index) const
+	{
+		std::call_once(loadOnce_, [this](){
+			load();
+			loaded_.store(true, std::memory_order_release);
+		});
+		return children_[index].get();
+	}
+
+	virtual Type type() const
+	{
+		return type_;
+	}
+
+	virtual std::pair<const char*, int> bytes() const
+	{
+		return {data_, dataSize_};
+	}
+
+	/// Сколько сегментов файла разобрано без индекса только затем,
+	/// чтобы найти соседние поддеревья.
+	std::uint64_t skippedSegments() const
+	{
+		return file_->skipped_.load(std::memory_order_relaxed);
+	}
+
+	/// Можно спрашивать из другого потока, пока дети загружаются.
+	bool isLoaded() const
+	{
+		return loaded_.load(std::memory_order_acquire);
+	}
+
+protected:
+	virtual void addChild(TreePtr child)
+	{
+	}
+
+	virtual std::string dataToText() const
+	{
+		return textForData(type_, bytes());
+	}
+
+	virtual bool isDataEqual(Abstract const *tree) const
+	{
+		return isSameData(this, tree);
+	}
+
+private:
+	void load() const
+	{
+		children_.reserve(childrenCount_);
+		auto node = node_ + 1;
+		auto offset = offset_ + IO<std::istream>::segmentHeaderSize + dataSize_;
+		for(int i = 0; i < childrenCount_; ++i)
+		{
+			if(file_->hasIndex())
+			{
+				offset = node < file_->nodes_ ? file_->offset(node) : file_->tree_->size();
+			}
+			children_.emplace_back(new LazyNode(file_, node, offset));
+			if(file_->hasIndex())
+			{
+				node += node < file_->nodes_ ? file_->subtreeSize(node) : 1;
+			}
+			else if(i + 1 < childrenCount_)
+			{
+				// За последним ребёнком соседей нет, и его поддерево не пропускается.
+				offset = skip(offset);
+			}
+		}
+	}
+
+	/// Смещение сразу за поддеревом, начинающимся с offset.
+	std::uint64_t skip(const std::uint64_t offset) const
+	{
+		const auto size = file_->tree_->size();
+		if(offset >= size)
+		{
+			return size;
+		}
+		SpanReader reader(file_->tree_->data() + offset, size - offset);
+		Skipper skipper;
+		const auto isRead = reader.read(skipper);
+		file_->skipped_ += skipper.segments_;
+		if(!isRead)
+		{
+			return size;
+		}
+		return offset + reader.offset();
+	}
+
+	struct Skipper
+	{
+		bool add(const Type, const char *, const int, const int)
+		{
+			++segments_;
+			return true;
+		}
+
+		std::uint64_t segments_ = 0;
+	};
+
+	std::shared_ptr<LazyFile const> file_;
+	std::uint64_t node_;
+	std::uint64_t offset_;
+	Type type_ = Type::INVALID;
+	int childrenCount_ = 0;
+	int dataSize_ = 0;
+	const char *data_ = nullptr;
+	mutable std::once_flag loadOnce_;
+	mutable std::atomic<bool> loaded_{false};
+	mutable std::vector<std::unique_ptr<LazyNode>> children_;
+};
+
+/// Открытие .tree файла v1 с ленивым разбором поддеревьев.
+class Lazy
+{
+public:
+	static std::string indexFileName(const std::string &fileName)
+	{
+		return fileName + ".idx";
+	}
+
+	/// Один раз проходит файл дерева и пишет рядом индекс для пропуска поддеревьев.
+	static bool writeIndex(const std::string &fileName)
+	{
+		auto file = MappedFile::open(fileName);
+		if(!file || file->size() == 0)
+		{
+			return false;
+		}
+		LazyIndex::Builder builder(file->data());
+		if(!SpanReader(file->data(), file->size()).read(builder))
+		{
+			return false;
+		}
+		return builder.write(indexFileName(fileName), file->size());
+	}
+
+	/// Сохраняет дерево вместе с индексом.
+	static bool saveToFile(const std::string &fileName, TreeConstPtr tree)
+	{
+		return File::saveToFile(fileName, tree) && writeIndex(fileName);
+	}
+
+	/// Открывает файл за O(1): индекс используется, если он есть
+	/// и соответствует файлу, иначе поддеревья пропускаются разбором.
+	static TreeConstPtr open(const std::string &fileName)
+	{
+		auto file = std::make_shared<LazyFile>();
+		file->tree_ = MappedFile::open(fileName);
+		if(!file->tree_ || file->tree_->size() == 0)
+		{
+			return makeConstPtr<Empty>();
+		}
+
+		auto index = MappedFile::open(indexFileName(fileName));
+		if(index && index->size() >= LazyIndex::headerSize
+			&& std::memcmp(index->data(), LazyIndex::magic, sizeof LazyIndex::magic) == 0)
+		{
+			std::uint32_t version = 0;
+			std::memcpy(&version, index->data() + sizeof LazyIndex::magic, sizeof version);
+			const auto nodes = LazyIndex::readWord(index->data() + sizeof LazyIndex::magic + sizeof version);
+			const auto treeSize = LazyIndex::readWord(index->data() + sizeof LazyIndex::magic
+				+ sizeof version + sizeof nodes);
+			if(version == LazyIndex::version
+				&& treeSize == file->tree_->size()
+				&& (index->size() - LazyIndex::headerSize) / LazyIndex::entrySize == nodes
+				&& (index->size() - LazyIndex::headerSize) % LazyIndex::entrySize == 0)
+			{
+				file->index_ = std::move(index);
+				file->nodes_ = nodes;
+			}
+		}
+
+		auto root = std::make_shared<LazyNode>(file, 0, 0);
+		if(root->type() == Type::INVALID)
+		{
+			return makeConstPtr<Empty>();
+		}
+		return root;
+	}
+};
+}
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Block.hpp"
+#include "Columnar.hpp"
+#include "Compact.hpp"
+#include "Span.hpp"
+
+namespace Tree
+{
+/// Файл, отображённый в память только для чтения.
+class MappedFile
+{
+public:
+	static std::shared_ptr<MappedFile const> open(const std::string &fileName)
+	{
+		const int fd = ::open(fileName.c_str(), O_RDONLY);
+		if(fd < 0)
+		{
+			return nullptr;
+		}
+
+		struct stat info;
+		if(::fstat(fd, &info) != 0)
+		{
+			::close(fd);
+			return nullptr;
+		}
+
+		std::shared_ptr<MappedFile> file(new MappedFile());
+		file->size_ = static_cast<std::size_t>(info.st_size);
+		if(file->size_ > 0)
+		{
+			void *address = ::mmap(nullptr, file->size_, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(address == MAP_FAILED)
+			{
+				::close(fd);
+				return nullptr;
+			}
+			file->data_ = static_cast<const char*>(address);
+		}
+		::close(fd);
+		return file;
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator = (const MappedFile&) = delete;
+
+	~MappedFile()
+	{
+		if(data_)
+		{
+			::munmap(const_cast<char*>(data_), size_);
+		}
+	}
+
+	const char* data() const
+	{
+		return data_;
+	}
+
+	std::size_t size() const
+	{
+		return size_;
+	}
+
+private:
+	MappedFile() = default;
+
+	const char *data_ = nullptr;
+	std::size_t size_ = 0;
+};
+
+/// Загрузка .tree файла (v1 или v2) через mmap без копирования данных
+/// (кроме сжатых файлов, которые сначала распаковываются):
+/// файл один раз проверяется при построении индекса, а значения узлов
+/// остаются ссылками внутрь отображения и декодируются только по запросу.
+/// Тот же индекс строится и над любым куском памяти через view.
+class Mapped : protected ColumnarBuilder
+{
+public:
+	/// Значения остаются смещениями внутри data, поэтому Int массивы
+	/// разностями так не читаются, и view собирает обычное дерево.
+	static constexpr bool referencesSource = true;
+
+	static TreeConstPtr load(const std::string &fileName)
+	{
+		auto file = MappedFile::open(fileName);
+		if(!file || file->size() == 0)
+		{
+			return makeConstPtr<Empty>();
+		}
+		if(Block::isBlock(file->data(), file->size()))
+		{
+			// Сжатый файл распаковывается в память, и вид строится над ней.
+			auto bytes = std::make_shared<std::string>();
+			if(!Block::Reader(file->data(), file->size()).read(*bytes))
+			{
+				return makeConstPtr<Empty>();
+			}
+			const auto data = bytes->data();
+			const auto size = bytes->size();
+			return view(data, size, std::move(bytes));
+		}
+		const auto data = file->data();
+		const auto size = file->size();
+		return view(data, size, std::move(file));
+	}
+
+	/// Колоночный вид на дерево, лежащее в куске памяти data.
+	/// storage держит этот кусок живым, пока жив вид.
+	static TreeConstPtr view(const char *data,
+							 const std::size_t size,
+							 std::shared_ptr<void const> storage = nullptr)
+	{
+		Mapped mapped;
+		mapped.values_ = data;
+		bool isRead = false;
+		if(Compact::isCompact(data, size))
+		{
+			Compact::SpanSource source(data, size);
+			isRead = CompactIStream<Compact::SpanSource>(&source).read(mapped);
+			if(!isRead)
+			{
+				Compact::SpanSource decodedSource(data, size);
+				return CompactIStream<Compact::SpanSource>(&decodedSource).read();
+			}
+		}
+		else
+		{
+			isRead = SpanReader(data, size).read(mapped);
+		}
+		if(!isRead)
+		{
+			return makeConstPtr<Empty>();
+		}
+		return release(std::move(mapped.columns_), data, std::move(storage));
+	}
+
+private:
+	friend class SpanReader;
+	template <class Source> friend class CompactIStream;
+
+	bool add(const Type type, const char *data, const int dataSize, const int childrenCount)
+	{
+		return append(type, data - values_, dataSize, childrenCount);
+	}
+
+	const char *values_ = nullptr;
+};
+}
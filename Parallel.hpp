@@ -0,0 +1,313 @@
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "Columnar.hpp"
+#include "IO.hpp"
+#include "Mapped.hpp"
+#include "Pool.hpp"
+#include "Tree.hpp"
+
+namespace Tree
+{
+/// Параллельная запись в формате v1. Прямой обход каждого поддерева
+/// самодостаточен, поэтому верх дерева пишется последовательно,
+/// а группы соседних поддеревьев кодируются в отдельные буферы на пуле.
+/// Буферы склеиваются по порядку, и результат побайтно совпадает с OStream.
+/// В sink всё пишется после окончания всех задач, поэтому в памяти
+/// на время записи лежит весь результат.
+template <class Sink>
+class ParallelOStream
+{
+public:
+	ParallelOStream(Sink *sink, ThreadPool *pool, const unsigned tasksPerThread = 4) :
+		sink_(sink),
+		pool_(pool),
+		tasksPerThread_(tasksPerThread)
+	{
+	}
+
+	ParallelOStream& write(TreeConstPtr tree)
+	{
+		auto plan = split(tree.get());
+		for(auto &piece : plan)
+		{
+			if(!piece.parent_)
+			{
+				continue;
+			}
+			auto task = &piece;
+			pool_->submit([task](){
+				BufferSink buffer;
+				BasicOStream<BufferSink> stream(&buffer);
+				Abstract const *child = nullptr;
+				for(int i = task->begin_; i < task->end_; ++i)
+				{
+					child = i == task->begin_ ? task->first_ : task->parent_->childAfter(i, child);
+					stream.write(child);
+				}
+				task->bytes_ = std::move(buffer.buffer());
+			});
+		}
+		pool_->wait();
+
+		for(const auto &piece : plan)
+		{
+			sink_->write(piece.bytes_.data(), piece.bytes_.size());
+		}
+		return *this;
+	}
+
+private:
+	/// Кусок результата: либо уже записанные сегменты верхних узлов,
+	/// либо дети parent_ с begin_ по end_, которые пишет задача пула.
+	/// Первый из них найден заранее: child(i) у Columnar и Mapped
+	/// идёт от начала, а дальше задача шагает через childAfter.
+	struct Piece
+	{
+		std::string bytes_;
+		Abstract const *parent_ = nullptr;
+		Abstract const *first_ = nullptr;
+		int begin_ = 0;
+		int end_ = 0;
+	};
+
+	std::vector<Piece> split(Abstract const *root) const
+	{
+		std::vector<Piece> plan(1);
+		if(!root)
+		{
+			return plan;
+		}
+		if(root->isLeaf())
+		{
+			BufferSink leaf;
+			BasicOStream<BufferSink>(&leaf).write(root);
+			plan.back().bytes_ = std::move(leaf.buffer());
+			return plan;
+		}
+
+		// Ищем уровень, на котором поддеревьев хватает на все потоки.
+		const std::size_t target = static_cast<std::size_t>(pool_->size()) * tasksPerThread_;
+		std::vector<Abstract const *> level{root};
+		std::size_t nextLevelSize = root->childrenCount();
+		int depth = 1;
+		while(nextLevelSize < target)
+		{
+			std::vector<Abstract const *> next;
+			next.reserve(nextLevelSize);
+			std::size_t size = 0;
+			for(auto node : level)
+			{
+				Abstract const *child = nullptr;
+				for(int i = 0; i < node->childrenCount(); ++i)
+				{
+					child = node->childAfter(i, child);
+					next.push_back(child);
+					size += child->childrenCount();
+				}
+			}
+			if(size == 0)
+			{
+				break;
+			}
+			level.swap(next);
+			nextLevelSize = size;
+			++depth;
+		}
+		const std::size_t grain = nextLevelSize / target > 0 ? nextLevelSize / target : 1;
+
+		struct Frame
+		{
+			Abstract const *node_;
+			Abstract const *last_;
+			int depth_;
+			int next_;
+		};
+		std::vector<Frame> stack{{root, nullptr, 0, 0}};
+		BufferSink header;
+		BasicOStream<BufferSink>(&header).writeNode(root);
+		while(!stack.empty())
+		{
+			auto &frame = stack.back();
+			const auto count = frame.node_->childrenCount();
+			if(frame.next_ >= count)
+			{
+				stack.pop_back();
+				continue;
+			}
+			if(frame.depth_ + 1 == depth)
+			{
+				const auto begin = frame.next_;
+				const auto first = frame.node_->childAfter(begin, frame.last_);
+				frame.last_ = first;
+				frame.next_ = begin + static_cast<int>(std::min<std::size_t>(grain, count - begin));
+				for(int i = begin + 1; i < frame.next_; ++i)
+				{
+					frame.last_ = frame.node_->childAfter(i, frame.last_);
+				}
+				plan.back().bytes_ += header.buffer();
+				header.buffer().clear();
+				plan.push_back({std::string(), frame.node_, first, begin, frame.next_});
+				plan.emplace_back();
+				continue;
+			}
+			auto child = frame.node_->childAfter(frame.next_++, frame.last_);
+			frame.last_ = child;
+			BasicOStream<BufferSink>(&header).writeNode(child);
+			stack.push_back({child, nullptr, frame.depth_ + 1, 0});
+		}
+		plan.back().bytes_ += header.buffer();
+		return plan;
+	}
+
+	Sink *sink_;
+	ThreadPool *pool_;
+	unsigned tasksPerThread_;
+};
+
+/// Параллельное чтение v1 или v2 из куска памяти в дерево Naive.
+/// Сначала один последовательный проход строит индекс сегментов
+/// с размерами поддеревьев (Mapped::view), затем группы соседних
+/// поддеревьев собираются на пуле, а верхние узлы сшиваются с ними
+/// в исходном порядке.
+class ParallelIStream
+{
+public:
+	ParallelIStream(const char *data,
+					const std::size_t size,
+					ThreadPool *pool,
+					const unsigned tasksPerThread = 4) :
+		data_(data),
+		size_(size),
+		pool_(pool),
+		tasksPerThread_(tasksPerThread)
+	{
+	}
+
+	TreePtr read()
+	{
+		const auto view = Mapped::view(data_, size_);
+		const auto root = std::dynamic_pointer_cast<ColumnarNode const>(view);
+		if(!root)
+		{
+			// Для v2 с массивами разностей колоночного индекса нет, и view
+			// уже собрал обычное дерево; других владельцев у него нет.
+			return view->type() == Type::INVALID
+				? makePtr<Empty>()
+				: std::const_pointer_cast<Abstract>(view);
+		}
+		const auto &columns = root->columns();
+		const std::size_t target = static_cast<std::size_t>(pool_->size()) * tasksPerThread_;
+		const std::size_t grain = columns.size() / target > 0 ? columns.size() / target : 1;
+
+		auto plan = split(columns, grain);
+		for(auto &piece : plan)
+		{
+			if(!piece.isTask_)
+			{
+				continue;
+			}
+			auto task = &piece;
+			pool_->submit([task, &columns](){
+				for(auto i = task->begin_; i < task->end_; i += columns.subtreeSize(i))
+				{
+					NaiveBuilder builder;
+					const auto end = i + columns.subtreeSize(i);
+					for(auto j = i; j < end; ++j)
+					{
+						add(builder, columns, j);
+					}
+					task->subtrees_.push_back(builder.finish());
+				}
+			});
+		}
+		pool_->wait();
+
+		NaiveBuilder builder;
+		for(auto &piece : plan)
+		{
+			if(!piece.isTask_)
+			{
+				add(builder, columns, piece.begin_);
+				continue;
+			}
+			for(auto &subtree : piece.subtrees_)
+			{
+				builder.attach(std::move(subtree));
+			}
+		}
+		return builder.finish();
+	}
+
+private:
+	/// Верхний узел begin_ или группа соседних поддеревьев,
+	/// начинающихся в [begin_, end_), которую собирает задача пула.
+	struct Piece
+	{
+		bool isTask_ = false;
+		std::size_t begin_ = 0;
+		std::size_t end_ = 0;
+		std::vector<TreePtr> subtrees_;
+	};
+
+	static void add(NaiveBuilder &builder, Columnar const &columns, const std::size_t index)
+	{
+		const auto [data, dataSize] = columns.bytes(index);
+		builder.add(columns.type(index), data, dataSize, columns.childrenCount(index));
+	}
+
+	static std::vector<Piece> split(Columnar const &columns, const std::size_t grain)
+	{
+		std::vector<Piece> plan;
+		if(columns.subtreeSize(0) <= grain)
+		{
+			plan.push_back({true, 0, columns.size(), {}});
+			return plan;
+		}
+
+		struct Frame
+		{
+			std::size_t next_;
+			std::size_t end_;
+		};
+		plan.push_back({false, 0, 1, {}});
+		std::vector<Frame> stack{{1, columns.subtreeSize(0)}};
+		while(!stack.empty())
+		{
+			auto &frame = stack.back();
+			if(frame.next_ >= frame.end_)
+			{
+				stack.pop_back();
+				continue;
+			}
+			const auto index = frame.next_;
+			const auto size = columns.subtreeSize(index);
+			if(size > grain)
+			{
+				frame.next_ += size;
+				plan.push_back({false, index, index + 1, {}});
+				stack.push_back({index + 1, index + size});
+				continue;
+			}
+			auto end = index;
+			while(end < frame.end_
+				&& columns.subtreeSize(end) <= grain
+				&& end - index < grain)
+			{
+				end += columns.subtreeSize(end);
+			}
+			frame.next_ = end;
+			plan.push_back({true, index, end, {}});
+		}
+		return plan;
+	}
+
+	const char *data_;
+	std::size_t size_;
+	ThreadPool *pool_;
+	unsigned tasksPerThread_;
+};
+}
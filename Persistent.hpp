@@ -0,0 +1,279 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Tree.hpp"
+
+namespace Tree
+{
+/// Изменения неизменяемого дерева копированием пути: новое дерево
+/// получает копии узлов от корня до изменённого, а все остальные
+/// поддеревья разделяет со старым. Старое дерево не меняется,
+/// поэтому его можно читать из других потоков во время изменения.
+///
+/// Путь - номера детей от корня. Неверный путь или пустое дерево
+/// дают Empty. Дети узлов не Naive (Arena, Columnar, Lazy, Mapped)
+/// разделяются через aliasing shared_ptr и держат живым своего владельца.
+/// Деревья, полученные здесь, нельзя менять через operator +.
+/// Копия узла с замороженными детьми сама замораживается.
+class Persistent
+{
+public:
+	/// Дерево, в котором у узла по пути path последним ребёнком добавлен child.
+	static TreeConstPtr withChild(TreeConstPtr tree, const std::vector<int> &path, TreeConstPtr child)
+	{
+		if(!child || child->type() == Type::INVALID)
+		{
+			return makeConstPtr<Empty>();
+		}
+		return change(std::move(tree), path, [&child](TreeConstPtr const &node){
+			return copyNode(node, -1, nullptr, child);
+		});
+	}
+
+	/// Дерево, в котором узел по пути path заменён на subtree.
+	static TreeConstPtr withSubtree(TreeConstPtr tree, const std::vector<int> &path, TreeConstPtr subtree)
+	{
+		if(!subtree || subtree->type() == Type::INVALID)
+		{
+			return makeConstPtr<Empty>();
+		}
+		return change(std::move(tree), path, [&subtree](TreeConstPtr const &){
+			return subtree;
+		});
+	}
+
+	/// Дерево без узла по пути path; без корня остаётся Empty.
+	static TreeConstPtr withoutSubtree(TreeConstPtr tree, const std::vector<int> &path)
+	{
+		return change(std::move(tree), path, [](TreeConstPtr const &){
+			return TreeConstPtr();
+		});
+	}
+
+private:
+	/// Заменяет узел по пути на replace(узел), копируя предков снизу вверх.
+	/// Пустой результат replace убирает узел у родителя.
+	template <class Replace>
+	static TreeConstPtr change(TreeConstPtr tree, const std::vector<int> &path, Replace replace)
+	{
+		if(!tree || tree->type() == Type::INVALID)
+		{
+			return makeConstPtr<Empty>();
+		}
+		std::vector<TreeConstPtr> nodes;
+		nodes.reserve(path.size() + 1);
+		nodes.push_back(std::move(tree));
+		for(const auto index : path)
+		{
+			const auto &parent = nodes.back();
+			if(index < 0 || index >= parent->childrenCount())
+			{
+				return makeConstPtr<Empty>();
+			}
+			nodes.push_back(childOf(parent, index));
+		}
+
+		auto replacement = replace(nodes.back());
+		for(auto level = path.size(); level > 0; --level)
+		{
+			replacement = copyNode(nodes[level - 1], path[level - 1], std::move(replacement), nullptr);
+		}
+		return replacement ? replacement : makeConstPtr<Empty>();
+	}
+
+	/// Копия данных node с его детьми, где index-й ребёнок заменён
+	/// на replacement или убран, если тот пуст, а appended, если есть,
+	/// добавлен последним.
+	static TreeConstPtr copyNode(TreeConstPtr const &node,
+								 const int index,
+								 TreeConstPtr replacement,
+								 TreeConstPtr appended)
+	{
+		const auto [data, dataSize] = node->bytes();
+		auto copy = NaiveBuilder::makeNode(node->type(), data, dataSize);
+		auto &children = static_cast<Naive*>(copy.get())->children_;
+		const auto count = node->childrenCount();
+		children.reserve(count + (appended ? 1 : 0));
+		for(int i = 0; i < count; ++i)
+		{
+			if(i != index)
+			{
+				children.push_back(childOf(node, i));
+			}
+			else if(replacement)
+			{
+				children.push_back(std::move(replacement));
+			}
+		}
+		if(appended)
+		{
+			children.push_back(std::move(appended));
+		}
+		if(std::all_of(children.begin(), children.end(), isFrozen))
+		{
+			static_cast<Naive*>(copy.get())->frozen_.store(true, std::memory_order_release);
+		}
+		return copy;
+	}
+
+	/// Узлы не Naive не меняются и считаются замороженными.
+	static bool isFrozen(TreeConstPtr const &tree)
+	{
+		auto naive = tree->asNaive();
+		return !naive || naive->isFrozen();
+	}
+
+	static TreeConstPtr childOf(TreeConstPtr const &parent, const int index)
+	{
+		if(auto naive = parent->asNaive())
+		{
+			return naive->children_[index];
+		}
+		return TreeConstPtr(parent, parent->child(index));
+	}
+};
+
+/// Корень неизменяемого дерева, который писатели заменяют,
+/// пока читатели из других потоков берут снимки.
+///
+/// load() не берёт блокировок: читатель занимает ячейку, объявляет
+/// в ней (hazard pointer), какой корень копирует, и сверяет его
+/// с текущим. Писатель не ждёт читателей: заменённые ссылки на корень
+/// он удаляет при следующих заменах, когда их не объявляет ни одна
+/// ячейка, а само дерево живёт, пока у кого-то есть снимок.
+/// Писатели выстраиваются на mutex.
+class AtomicTree
+{
+public:
+	/// Больше одновременных load() ждут свободной ячейки.
+	static constexpr std::size_t slotCount = 64;
+
+	explicit AtomicTree(TreeConstPtr tree = makeConstPtr<Empty>()) :
+		current_(new TreeConstPtr(std::move(tree)))
+	{
+	}
+
+	AtomicTree(const AtomicTree&) = delete;
+	AtomicTree& operator = (const AtomicTree&) = delete;
+
+	/// Ни один load() не должен ещё выполняться; взятые снимки остаются целыми.
+	~AtomicTree()
+	{
+		delete current_.load();
+		for(const auto root : retired_)
+		{
+			delete root;
+		}
+	}
+
+	/// Текущий корень; снимок не меняется после публикации нового.
+	TreeConstPtr load() const
+	{
+		auto &slot = acquireSlot();
+		auto root = current_.load();
+		while(true)
+		{
+			slot.root_.store(root);
+			const auto published = current_.load();
+			if(published == root)
+			{
+				break;
+			}
+			root = published;
+		}
+		TreeConstPtr snapshot = *root;
+		slot.root_.store(nullptr, std::memory_order_release);
+		return snapshot;
+	}
+
+	void publish(TreeConstPtr tree)
+	{
+		std::lock_guard<std::mutex> lock(writer_);
+		replace(new TreeConstPtr(std::move(tree)));
+	}
+
+	/// Публикует update(текущий корень) и возвращает его. Писатели
+	/// идут по очереди, поэтому изменения друг друга не теряют.
+	template <class Update>
+	TreeConstPtr update(Update update)
+	{
+		std::lock_guard<std::mutex> lock(writer_);
+		// Старые корни удаляет только писатель, поэтому текущий читается без ячейки.
+		auto tree = update(*current_.load());
+		replace(new TreeConstPtr(tree));
+		return tree;
+	}
+
+private:
+	struct alignas(64) Slot
+	{
+		std::atomic<TreeConstPtr const*> root_{nullptr};
+	};
+
+	Slot& acquireSlot() const
+	{
+		thread_local const std::size_t hint = std::hash<std::thread::id>()(std::this_thread::get_id());
+		for(std::size_t i = 0; ; ++i)
+		{
+			auto &slot = slots_[(hint + i) % slotCount];
+			TreeConstPtr const *expected = nullptr;
+			if(slot.root_.load(std::memory_order_relaxed) == nullptr
+				&& slot.root_.compare_exchange_weak(expected, &claimed_, std::memory_order_acquire))
+			{
+				return slot;
+			}
+			if(i % slotCount == slotCount - 1)
+			{
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	void replace(TreeConstPtr const *next)
+	{
+		retired_.push_back(current_.exchange(next));
+		auto kept = retired_.begin();
+		for(const auto root : retired_)
+		{
+			if(isAnnounced(root))
+			{
+				*kept++ = root;
+			}
+			else
+			{
+				delete root;
+			}
+		}
+		retired_.erase(kept, retired_.end());
+	}
+
+	bool isAnnounced(TreeConstPtr const *root) const
+	{
+		for(const auto &slot : slots_)
+		{
+			if(slot.root_.load() == root)
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/// Отметка занятой ячейки, пока в ней ещё нет корня.
+	static inline const TreeConstPtr claimed_;
+
+	std::atomic<TreeConstPtr const*> current_;
+	mutable Slot slots_[slotCount];
+	std::mutex writer_;
+	/// Заменённые ссылки, которые ещё объявлены в ячейках.
+	std::vector<TreeConstPtr const*> retired_;
+};
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace Tree
+{
+/// Пул потоков с очередью на каждый поток: поток берёт задачи
+/// с конца своей очереди, а когда она пуста - крадёт с начала чужих.
+class ThreadPool
+{
+public:
+	using Task = std::function<void()>;
+
+	explicit ThreadPool(unsigned threads = std::thread::hardware_concurrency())
+	{
+		if(threads == 0)
+		{
+			threads = 1;
+		}
+		for(unsigned i = 0; i < threads; ++i)
+		{
+			queues_.emplace_back(new Queue());
+		}
+		for(unsigned i = 0; i < threads; ++i)
+		{
+			threads_.emplace_back([this, i](){ work(i); });
+		}
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator = (const ThreadPool&) = delete;
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+		}
+		wake_.notify_all();
+		for(auto &thread : threads_)
+		{
+			thread.join();
+		}
+	}
+
+	unsigned size() const
+	{
+		return static_cast<unsigned>(threads_.size());
+	}
+
+	void submit(Task task)
+	{
+		++pending_;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			++queued_;
+		}
+		auto &queue = *queues_[next_++ % queues_.size()];
+		{
+			std::lock_guard<std::mutex> lock(queue.mutex_);
+			queue.tasks_.push_back(std::move(task));
+		}
+		wake_.notify_one();
+	}
+
+	/// Ждёт выполнения всех отправленных задач, помогая их выполнять.
+	void wait()
+	{
+		while(pending_ > 0)
+		{
+			if(tryRun(next_ % queues_.size()))
+			{
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(mutex_);
+			idle_.wait(lock, [this](){ return pending_ == 0 || queued_ > 0; });
+		}
+	}
+
+private:
+	struct Queue
+	{
+		std::mutex mutex_;
+		std::deque<Task> tasks_;
+	};
+
+	bool take(const unsigned self, Task &task)
+	{
+		{
+			auto &own = *queues_[self];
+			std::lock_guard<std::mutex> lock(own.mutex_);
+			if(!own.tasks_.empty())
+			{
+				task = std::move(own.tasks_.back());
+				own.tasks_.pop_back();
+				return true;
+			}
+		}
+		for(std::size_t i = 1; i < queues_.size(); ++i)
+		{
+			auto &victim = *queues_[(self + i) % queues_.size()];
+			std::lock_guard<std::mutex> lock(victim.mutex_);
+			if(!victim.tasks_.empty())
+			{
+				task = std::move(victim.tasks_.front());
+				victim.tasks_.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool tryRun(const unsigned self)
+	{
+		Task task;
+		if(!take(self, task))
+		{
+			return false;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			--queued_;
+		}
+		task();
+		if(--pending_ == 0)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			idle_.notify_all();
+		}
+		return true;
+	}
+
+	void work(const unsigned self)
+	{
+		while(true)
+		{
+			if(tryRun(self))
+			{
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(mutex_);
+			wake_.wait(lock, [this](){ return stop_ || queued_ > 0; });
+			if(stop_ && queued_ == 0)
+			{
+				return;
+			}
+		}
+	}
+
+	std::vector<std::unique_ptr<Queue>> queues_;
+	std::vector<std::thread> threads_;
+	std::mutex mutex_;
+	std::condition_variable wake_;
+	std::condition_variable idle_;
+	std::size_t queued_ = 0;
+	std::atomic<std::size_t> pending_{0};
+	std::atomic<unsigned> next_{0};
+	bool stop_ = false;
+};
+}
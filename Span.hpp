@@ -0,0 +1,105 @@
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+#include "IO.hpp"
+#include "Tree.hpp"
+
+namespace Tree
+{
+/// Разбор дерева из непрерывного куска памяти (буфер файла, mmap,
+/// сетевой кадр) прямой арифметикой указателей. Границы проверяются
+/// один раз на сегмент, поэтому обрезанный или испорченный ввод
+/// отвергается без чтения за пределами куска.
+class SpanReader
+{
+public:
+	SpanReader(const char *data, const std::size_t size) :
+		data_(data),
+		size_(size)
+	{
+	}
+
+	explicit SpanReader(const std::string &bytes) :
+		SpanReader(bytes.data(), bytes.size())
+	{
+	}
+
+	/// Передаёт builder данные прямо из куска, без промежуточных копий.
+	template <class Builder>
+	bool read(Builder &builder)
+	{
+		using Format = IO<std::istream>;
+
+		long long pending = 1;
+		while(pending > 0)
+		{
+			if(size_ - offset_ < Format::segmentHeaderSize)
+			{
+				return false;
+			}
+			const char *header = data_ + offset_;
+			const auto type = Format::typeForSignature(header[0]);
+			int childrenCount = 0;
+			int dataSize = 0;
+			std::memcpy(&childrenCount, header + 1, sizeof childrenCount);
+			std::memcpy(&dataSize, header + 1 + sizeof childrenCount, sizeof dataSize);
+			offset_ += Format::segmentHeaderSize;
+
+			const auto left = size_ - offset_;
+			if(type == Type::INVALID
+				|| childrenCount < 0
+				|| dataSize < 0
+				|| static_cast<std::size_t>(dataSize) > left
+				|| (type == Type::INT && dataSize != sizeof(int))
+				|| (type == Type::REAL && dataSize != sizeof(double)))
+			{
+				return false;
+			}
+
+			pending += childrenCount - 1;
+			// Каждому обещанному ребёнку нужен хотя бы заголовок.
+			if(static_cast<unsigned long long>(pending) > (left - dataSize) / Format::segmentHeaderSize)
+			{
+				return false;
+			}
+
+			if(!builder.add(type, data_ + offset_, dataSize, childrenCount))
+			{
+				return false;
+			}
+			offset_ += dataSize;
+		}
+		return true;
+	}
+
+	TreePtr read()
+	{
+		NaiveBuilder builder;
+		read(builder);
+		return builder.finish();
+	}
+
+	const char* data() const
+	{
+		return data_;
+	}
+
+	std::size_t offset() const
+	{
+		return offset_;
+	}
+
+	bool isFinished() const
+	{
+		return offset_ == size_;
+	}
+
+private:
+	const char *data_;
+	std::size_t size_;
+	std::size_t offset_ = 0;
+};
+}
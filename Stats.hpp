@@ -0,0 +1,162 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+
+namespace Tree
+{
+/// Счётчики горячих путей. Собираются только с -DTREE_STATS
+/// (cmake -DTREE_STATS=1); без него все вызовы пустые и
+/// после встраивания исчезают из кода.
+namespace Stats
+{
+#ifdef TREE_STATS
+constexpr bool enabled = true;
+#else
+constexpr bool enabled = false;
+#endif
+
+enum class Counter
+{
+	ALLOCATIONS,
+	ALLOCATED_BYTES,
+	WRITES,
+	BYTES_WRITTEN,
+	READS,
+	BYTES_READ,
+	SEGMENTS,
+	VIRTUAL_CALLS,
+	MAX_DEPTH,
+	COUNT
+};
+
+enum class Phase
+{
+	LOAD,
+	PRINT,
+	SAVE,
+	COUNT
+};
+
+inline const char* nameFor(const Counter counter)
+{
+	switch(counter)
+	{
+		case Counter::ALLOCATIONS: return "allocations";
+		case Counter::ALLOCATED_BYTES: return "allocated bytes";
+		case Counter::WRITES: return "writes";
+		case Counter::BYTES_WRITTEN: return "bytes written";
+		case Counter::READS: return "reads";
+		case Counter::BYTES_READ: return "bytes read";
+		case Counter::SEGMENTS: return "segments";
+		case Counter::VIRTUAL_CALLS: return "virtual calls";
+		case Counter::MAX_DEPTH: return "max depth";
+		case Counter::COUNT: break;
+	}
+	return "";
+}
+
+inline const char* nameFor(const Phase phase)
+{
+	switch(phase)
+	{
+		case Phase::LOAD: return "load";
+		case Phase::PRINT: return "print";
+		case Phase::SAVE: return "save";
+		case Phase::COUNT: break;
+	}
+	return "";
+}
+
+inline std::atomic<std::uint64_t> counters[static_cast<int>(Counter::COUNT)];
+inline std::atomic<std::uint64_t> phaseNs[static_cast<int>(Phase::COUNT)];
+
+inline void add(const Counter counter, const std::uint64_t value = 1)
+{
+	if constexpr(enabled)
+	{
+		counters[static_cast<int>(counter)].fetch_add(value, std::memory_order_relaxed);
+	}
+}
+
+inline void maximum(const Counter counter, const std::uint64_t value)
+{
+	if constexpr(enabled)
+	{
+		auto &current = counters[static_cast<int>(counter)];
+		auto seen = current.load(std::memory_order_relaxed);
+		while(seen < value && !current.compare_exchange_weak(seen, value, std::memory_order_relaxed))
+		{
+		}
+	}
+}
+
+inline std::uint64_t value(const Counter counter)
+{
+	return counters[static_cast<int>(counter)].load(std::memory_order_relaxed);
+}
+
+inline void reset()
+{
+	for(auto &counter : counters)
+	{
+		counter.store(0, std::memory_order_relaxed);
+	}
+	for(auto &ns : phaseNs)
+	{
+		ns.store(0, std::memory_order_relaxed);
+	}
+}
+
+/// Добавляет время жизни объекта ко времени фазы phase.
+class Timer
+{
+public:
+	explicit Timer(const Phase phase) :
+		phase_(phase)
+	{
+		if constexpr(enabled)
+		{
+			start_ = std::chrono::steady_clock::now();
+		}
+	}
+
+	~Timer()
+	{
+		if constexpr(enabled)
+		{
+			const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now() - start_).count();
+			phaseNs[static_cast<int>(phase_)].fetch_add(ns, std::memory_order_relaxed);
+		}
+	}
+
+	Timer(const Timer&) = delete;
+	Timer& operator = (const Timer&) = delete;
+
+private:
+	Phase phase_;
+	std::chrono::steady_clock::time_point start_;
+};
+
+inline void report(std::ostream &out)
+{
+	if constexpr(!enabled)
+	{
+		out << "stats: built without TREE_STATS" << std::endl;
+		return;
+	}
+	for(int i = 0; i < static_cast<int>(Counter::COUNT); ++i)
+	{
+		out << "stats: " << nameFor(static_cast<Counter>(i)) << " " << counters[i].load() << std::endl;
+	}
+	for(int i = 0; i < static_cast<int>(Phase::COUNT); ++i)
+	{
+		out << "stats: " << nameFor(static_cast<Phase>(i)) << " ms "
+			<< phaseNs[i].load() / 1e6 << std::endl;
+	}
+}
+}
+}
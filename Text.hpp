@@ -0,0 +1,285 @@
+#pragma once
+
+#include <charconv>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "Tree.hpp"
+
+namespace Tree
+{
+/// Разбор текстовой записи toQuotedText из непрерывного куска памяти:
+///
+///   tree := '(' [node] ')'
+///   node := data ['(' node {node} ')']
+///   data := "int" int | "real" real | "string" '"' {char | '\"' | '\\'} '"'
+///
+/// Между лексемами допускаются пробелы, табуляции и переводы строк;
+/// после дерева до конца куска - только они.
+/// Числа читаются std::from_chars, поэтому toText без строк тоже разбирается.
+///
+/// Разбор идёт без рекурсии: число детей узла становится известно только
+/// после его закрывающей скобки, а builder ждёт его вместе с данными,
+/// поэтому узлы сначала собираются в плоский список в порядке обхода
+/// и отдаются builder одним проходом в конце.
+class TextReader
+{
+public:
+	TextReader(const char *data, const std::size_t size) :
+		data_(data),
+		size_(size)
+	{
+	}
+
+	/// Читается сама строка, поэтому она должна пережить TextReader.
+	explicit TextReader(const std::string &text) :
+		TextReader(text.data(), text.size())
+	{
+	}
+
+	explicit TextReader(std::string &&text) = delete;
+
+	/// Передаёт builder узлы; строки без экранирования - прямо из куска.
+	template <class Builder>
+	bool read(Builder &builder)
+	{
+		if(!parse() || !isFinished())
+		{
+			return false;
+		}
+		for(const auto &node : nodes_)
+		{
+			const char *data = node.type_ == Type::STRING
+				? (node.data_ ? node.data_ : unescaped_.data() + node.offset_)
+				: node.value_;
+			if(!builder.add(node.type_, data, node.size_, node.childrenCount_))
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	TreePtr read()
+	{
+		NaiveBuilder builder;
+		read(builder);
+		return builder.finish();
+	}
+
+	std::size_t offset() const
+	{
+		return offset_;
+	}
+
+	bool isFinished() const
+	{
+		return offset_ == size_;
+	}
+
+private:
+	struct Node
+	{
+		Type type_;
+		int size_;
+		int childrenCount_;
+		/// Строка в исходном куске или nullptr, если она в unescaped_.
+		const char *data_;
+		std::size_t offset_;
+		char value_[sizeof(double)];
+	};
+
+	bool parse()
+	{
+		nodes_.clear();
+		unescaped_.clear();
+		skipSpaces();
+		if(!consume('('))
+		{
+			return false;
+		}
+		skipSpaces();
+		if(consume(')'))
+		{
+			skipSpaces();
+			return true;
+		}
+
+		// Открытые узлы, в которых сейчас читаются дети.
+		std::vector<std::size_t> open;
+		while(true)
+		{
+			if(!nodes_.empty() && open.empty())
+			{
+				// У дерева только один корень.
+				return false;
+			}
+			if(!open.empty())
+			{
+				++nodes_[open.back()].childrenCount_;
+			}
+			if(!parseData())
+			{
+				return false;
+			}
+			skipSpaces();
+			if(consume('('))
+			{
+				open.push_back(nodes_.size() - 1);
+				skipSpaces();
+				continue;
+			}
+			while(consume(')'))
+			{
+				skipSpaces();
+				if(open.empty())
+				{
+					return true;
+				}
+				open.pop_back();
+			}
+			if(offset_ == size_)
+			{
+				return false;
+			}
+		}
+	}
+
+	bool parseData()
+	{
+		Node node{Type::INVALID, 0, 0, nullptr, 0, {}};
+		if(consumeWord("int", 3))
+		{
+			int value = 0;
+			if(!parseNumber(value))
+			{
+				return false;
+			}
+			node.type_ = Type::INT;
+			node.size_ = sizeof value;
+			std::memcpy(node.value_, &value, sizeof value);
+		}
+		else if(consumeWord("real", 4))
+		{
+			double value = 0;
+			if(!parseNumber(value))
+			{
+				return false;
+			}
+			node.type_ = Type::REAL;
+			node.size_ = sizeof value;
+			std::memcpy(node.value_, &value, sizeof value);
+		}
+		else if(consumeWord("string", 6))
+		{
+			skipSpaces();
+			if(!consume('"') || !parseString(node))
+			{
+				return false;
+			}
+			node.type_ = Type::STRING;
+		}
+		else
+		{
+			return false;
+		}
+		nodes_.push_back(node);
+		return true;
+	}
+
+	template <typename T>
+	bool parseNumber(T &value)
+	{
+		skipSpaces();
+		const auto result = std::from_chars(data_ + offset_, data_ + size_, value);
+		if(result.ec != std::errc())
+		{
+			return false;
+		}
+		offset_ = result.ptr - data_;
+		return true;
+	}
+
+	/// Строка после открывающей кавычки до закрывающей включительно.
+	bool parseString(Node &node)
+	{
+		const auto begin = offset_;
+		auto escape = offset_;
+		while(escape < size_ && data_[escape] != '"' && data_[escape] != '\\')
+		{
+			++escape;
+		}
+		if(escape == size_)
+		{
+			return false;
+		}
+		if(data_[escape] == '"')
+		{
+			node.data_ = data_ + begin;
+			node.size_ = static_cast<int>(escape - begin);
+			offset_ = escape + 1;
+			return true;
+		}
+
+		node.offset_ = unescaped_.size();
+		unescaped_.append(data_ + begin, escape - begin);
+		offset_ = escape;
+		while(offset_ < size_ && data_[offset_] != '"')
+		{
+			if(data_[offset_] == '\\')
+			{
+				++offset_;
+				if(offset_ == size_ || (data_[offset_] != '"' && data_[offset_] != '\\'))
+				{
+					return false;
+				}
+			}
+			unescaped_.push_back(data_[offset_++]);
+		}
+		if(offset_ == size_)
+		{
+			return false;
+		}
+		++offset_;
+		node.size_ = static_cast<int>(unescaped_.size() - node.offset_);
+		return true;
+	}
+
+	bool consume(const char c)
+	{
+		if(offset_ < size_ && data_[offset_] == c)
+		{
+			++offset_;
+			return true;
+		}
+		return false;
+	}
+
+	bool consumeWord(const char *word, const std::size_t size)
+	{
+		if(size_ - offset_ < size || std::memcmp(data_ + offset_, word, size) != 0)
+		{
+			return false;
+		}
+		offset_ += size;
+		return true;
+	}
+
+	void skipSpaces()
+	{
+		while(offset_ < size_
+			&& (data_[offset_] == ' ' || data_[offset_] == '\t' || data_[offset_] == '\n' || data_[offset_] == '\r'))
+		{
+			++offset_;
+		}
+	}
+
+	const char *data_;
+	std::size_t size_;
+	std::size_t offset_ = 0;
+	std::vector<Node> nodes_;
+	std::string unescaped_;
+};
+}
@@ -1,10 +1,20 @@
 #pragma once
 
+#include <algorithm>
 #include <iostream>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 #include <functional>
 #include <memory>
+#include <iterator>
+#include <cstring>
+#include <cstdint>
+#include <atomic>
+#include <charconv>
+
+#include "Stats.hpp"
 
 namespace Tree
 {
@@ -17,30 +27,46 @@ enum class Type
 };
 
 class Abstract;
+class Naive;
 using TreePtr = std::shared_ptr<Abstract>;
 using TreeConstPtr = std::shared_ptr<Abstract const>;
 
 template< class T>
 inline TreePtr makePtr()
 {
+	Stats::add(Stats::Counter::ALLOCATIONS);
 	return std::make_shared<T>();
 }
 
 template< class T, class... Args >
 inline TreePtr makePtr( Args&&... args )
 {
-	return std::make_shared<T>(std::forward<T>(args...));
+	Stats::add(Stats::Counter::ALLOCATIONS);
+	return std::make_shared<T>(std::forward<Args>(args)...);
+}
+
+/// Узел с местом под childrenCount детей, чтобы operator +
+/// не перевыделял их массив.
+template< class T, class... Args >
+inline TreePtr makeParent( const int childrenCount, Args&&... args )
+{
+	Stats::add(Stats::Counter::ALLOCATIONS);
+	auto node = std::make_shared<T>(std::forward<Args>(args)...);
+	node->reserveChildren(childrenCount);
+	return node;
 }
 
 template <class T>
 inline TreeConstPtr makeConstPtr()
 {
+	Stats::add(Stats::Counter::ALLOCATIONS);
 	return std::make_shared<T const>();
 } 
 
 class Abstract
 {
 	friend TreePtr operator + (TreePtr parent, TreePtr child);
+	friend class Delta;
 
 public:
 	virtual bool isEmpty() = 0;
@@ -50,6 +76,71 @@ public:
 		std::function<void(Abstract const *)> initial,
 		std::function<void(Abstract const *)> final) const = 0;
 
+	virtual Abstract const* child(const int index) const = 0;
+
+	/// Сам узел, если это Naive; дешевле dynamic_cast при обходе.
+	virtual Naive const* asNaive() const
+	{
+		return nullptr;
+	}
+
+	/// Ребёнок index, если известен предыдущий ребёнок previous.
+	/// Представления, где поиск ребёнка по номеру не O(1), ускоряют
+	/// через него последовательный перебор детей.
+	virtual Abstract const* childAfter(const int index, Abstract const *previous) const
+	{
+		return child(index);
+	}
+
+	/// Обход в глубину с явным стеком, в котором enter и leave -
+	/// параметры шаблона, а не std::function, и поэтому встраиваются.
+	/// Пустое дерево не обходится вовсе, как и в traverse.
+	template <class Enter, class Leave>
+	void visit(Enter &&enter, Leave &&leave) const
+	{
+		if(type() == Type::INVALID)
+		{
+			return;
+		}
+
+		struct Frame
+		{
+			Abstract const *node_;
+			Abstract const *last_;
+			int next_;
+			int count_;
+		};
+
+		std::vector<Frame> stack;
+		enter(this);
+		stack.push_back({this, nullptr, 0, childrenCount()});
+		while(!stack.empty())
+		{
+			auto &frame = stack.back();
+			if(frame.next_ < frame.count_)
+			{
+				auto child = frame.node_->childAfter(frame.next_++, frame.last_);
+				frame.last_ = child;
+				enter(child);
+				stack.push_back({child, nullptr, 0, child->childrenCount()});
+				Stats::maximum(Stats::Counter::MAX_DEPTH, stack.size());
+			}
+			else
+			{
+				leave(frame.node_);
+				stack.pop_back();
+			}
+		}
+	}
+
+	/// То же для объекта-посетителя с методами enter и leave.
+	template <class Visitor>
+	void visit(Visitor &visitor) const
+	{
+		visit([&visitor](Abstract const * tree){ visitor.enter(tree); },
+			  [&visitor](Abstract const * tree){ visitor.leave(tree); });
+	}
+
 	bool isLeaf() const
 	{
 		return childrenCount() == 0;
@@ -57,50 +148,197 @@ public:
 
 	bool isEqual(TreeConstPtr other) const
 	{
-		return other && (other->toText() == toText());
+		return isEqual(other.get());
+	}
+
+	/// Структурное сравнение: оба дерева обходятся одновременно
+	/// и сравнение прекращается на первом расхождении. Если оба корня
+	/// заморожены (freeze) и у них уже посчитан structuralHash,
+	/// разные хеши дают ответ сразу.
+	bool isEqual(Abstract const *other) const
+	{
+		if(!other)
+		{
+			return false;
+		}
+		std::uint64_t hash = 0;
+		std::uint64_t otherHash = 0;
+		if(loadHash(hash) && other->loadHash(otherHash) && hash != otherHash)
+		{
+			return false;
+		}
+
+		struct Frame
+		{
+			Abstract const *left_;
+			Abstract const *right_;
+			Abstract const *lastLeft_;
+			Abstract const *lastRight_;
+			int next_;
+			int count_;
+		};
+
+		if(!isDataEqual(other) || childrenCount() != other->childrenCount())
+		{
+			return false;
+		}
+		std::vector<Frame> stack{{this, other, nullptr, nullptr, 0, childrenCount()}};
+		while(!stack.empty())
+		{
+			auto &frame = stack.back();
+			if(frame.next_ >= frame.count_)
+			{
+				stack.pop_back();
+				continue;
+			}
+			const auto left = frame.left_->childAfter(frame.next_, frame.lastLeft_);
+			const auto right = frame.right_->childAfter(frame.next_, frame.lastRight_);
+			frame.lastLeft_ = left;
+			frame.lastRight_ = right;
+			++frame.next_;
+			if(left == right)
+			{
+				continue;
+			}
+			const auto count = left->childrenCount();
+			if(count != right->childrenCount() || !left->isDataEqual(right))
+			{
+				return false;
+			}
+			if(count > 0)
+			{
+				stack.push_back({left, right, nullptr, nullptr, 0, count});
+			}
+		}
+		return true;
+	}
+
+	/// 64-битный хеш структуры и данных поддерева. Узлы Naive хранят
+	/// его, только если заморожены: деревья из NaiveBuilder, файлов
+	/// и operator + изменяемы и считают хеш заново при каждом вызове.
+	std::uint64_t structuralHash() const
+	{
+		std::uint64_t hash = 0;
+		if(loadHash(hash))
+		{
+			return hash;
+		}
+
+		struct Frame
+		{
+			Abstract const *node_;
+			Abstract const *last_;
+			int next_;
+			int count_;
+			std::uint64_t hash_;
+		};
+
+		std::vector<Frame> stack{{this, nullptr, 0, childrenCount(), hashData(this)}};
+		while(true)
+		{
+			auto &frame = stack.back();
+			if(frame.next_ < frame.count_)
+			{
+				auto child = frame.node_->childAfter(frame.next_++, frame.last_);
+				frame.last_ = child;
+				std::uint64_t childHash = 0;
+				if(child->loadHash(childHash))
+				{
+					frame.hash_ = combineHash(frame.hash_, childHash);
+					continue;
+				}
+				stack.push_back({child, nullptr, 0, child->childrenCount(), hashData(child)});
+				continue;
+			}
+
+			const auto done = frame;
+			done.node_->storeHash(done.hash_);
+			stack.pop_back();
+			if(stack.empty())
+			{
+				return done.hash_;
+			}
+			stack.back().hash_ = combineHash(stack.back().hash_, done.hash_);
+		}
+	}
+
+	/// Запрещает менять поддерево, чтобы его узлы Naive хранили
+	/// structuralHash. Без этого хеш не кешируется, и isEqual
+	/// не может ответить по нему сразу.
+	void freeze() const;
+
+	/// Узел Naive, замороженный freeze(); operator + для него даёт Empty.
+	bool isFrozen() const;
+
+	/// nodeCount - ожидаемое число узлов, чтобы выделить строку один раз.
+	std::string toText(const std::size_t nodeCount = 0) const
+	{
+		std::string text;
+		text.reserve(nodeCount * averageTextSize + 2);
+		StringSink sink{text};
+		writeText(sink);
+		return text;
 	}
 
-	std::string toText() const
+	/// Однозначная запись toText, которую разбирает TextReader:
+	/// строки в кавычках с \" и \\, вещественные без потери точности.
+	std::string toQuotedText(const std::size_t nodeCount = 0) const
 	{
 		std::string text;
-		auto initial = [&text](Abstract const * tree){
-			text += tree->dataToText();
+		text.reserve(nodeCount * averageTextSize + 2);
+		StringSink sink{text};
+		writeText(sink, true);
+		return text;
+	}
+
+	/// Пишет toText() (или toQuotedText(), если isQuoted) в sink
+	/// с методом write(data, size) кусками: числа через std::to_chars
+	/// прямо в буфер, без строк на каждый узел.
+	template <class Sink>
+	void writeText(Sink &sink, const bool isQuoted = false) const
+	{
+		TextBuffer<Sink> out(sink, isQuoted);
+		out.put('(');
+		visit([&out](Abstract const * tree){
+			out.putData(tree->type(), tree->bytes());
 			if(!tree->isLeaf())
 			{
-				text += "(";
+				out.put('(');
 			}
-		};
-		auto final = [&text](Abstract const * tree){
+		}, [&out](Abstract const * tree){
 			if(!tree->isLeaf())
 			{
-				text += ")";
+				out.put(')');
 			}
-		};
-		text += "(";
-		traverse(initial, final);
-		text += ")";
-		return text;
+		});
+		out.put(')');
 	}
 
-	void print()
+	void print() const
 	{
+		printText(std::cout);
+		std::cout.flush();
+	}
+
+	/// Пишет print() в sink: строка на узел с отступом табуляциями,
+	/// без сброса потока на каждой строке.
+	template <class Sink>
+	void printText(Sink &sink) const
+	{
+		TextBuffer<Sink> out(sink);
 		int indent = 0;
-		auto initial = [&indent](Abstract const * tree){
+		visit([&out, &indent](Abstract const * tree){
 			if(indent > 0)
 			{
-				for(int i = 0; i < indent - 1; ++i)
-				{
-					std::cout << "	";
-				}
-				std::cout << "+";
+				out.fill('\t', indent - 1);
+				out.put('+');
 			}
-			std::cout << tree->dataToText() << std::endl;
+			out.putData(tree->type(), tree->bytes());
+			out.put('\n');
 			++indent;
-		};
-		auto final = [&indent](Abstract const * tree){
+		}, [&indent](Abstract const * tree){
 			--indent;
-		};
-		traverse(initial, final);
+		});
 	}
 
 	virtual Type type() const = 0;
@@ -109,22 +347,241 @@ protected:
 	virtual void addChild(TreePtr child) = 0;
 
 	virtual std::string dataToText() const = 0;
-	virtual bool isDataEqual(TreeConstPtr tree) const = 0;
-};
+	virtual bool isDataEqual(Abstract const *tree) const = 0;
 
-TreePtr operator + (TreePtr parent, TreePtr child)
-{
-	if(!child || child->isEmpty())
+	virtual bool loadHash(std::uint64_t &hash) const
 	{
-		return parent;
+		return false;
 	}
-	if(!parent || parent->isEmpty())
+
+	virtual void storeHash(const std::uint64_t hash) const
 	{
-		return child;
 	}
-	parent->addChild(child);
-	return parent;
-}
+
+	static std::uint64_t mixHash(std::uint64_t x)
+	{
+		x ^= x >> 30;
+		x *= 0xbf58476d1ce4e5b9ULL;
+		x ^= x >> 27;
+		x *= 0x94d049bb133111ebULL;
+		x ^= x >> 31;
+		return x;
+	}
+
+	static std::uint64_t combineHash(const std::uint64_t seed, const std::uint64_t value)
+	{
+		return mixHash(seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2)));
+	}
+
+	/// Хеш данных узла (FNV-1a по сырым байтам) вместе с типом и числом детей.
+	static std::uint64_t hashData(Abstract const *tree)
+	{
+		const auto [data, dataSize] = tree->bytes();
+		std::uint64_t hash = 0xcbf29ce484222325ULL;
+		for(int i = 0; i < dataSize; ++i)
+		{
+			hash = (hash ^ static_cast<unsigned char>(data[i])) * 0x100000001b3ULL;
+		}
+		hash = combineHash(hash, static_cast<std::uint64_t>(tree->type()));
+		return combineHash(hash, static_cast<std::uint64_t>(tree->childrenCount()));
+	}
+
+	/// Примерная длина текста одного узла для toText(nodeCount).
+	static constexpr std::size_t averageTextSize = 16;
+
+	struct StringSink
+	{
+		std::string &text_;
+
+		void write(const char *data, const std::streamsize size)
+		{
+			text_.append(data, size);
+		}
+	};
+
+	/// Буфер текста перед sink; sink получает его целиком, когда тот заполнен.
+	template <class Sink>
+	class TextBuffer
+	{
+	public:
+		explicit TextBuffer(Sink &sink, const bool isQuoted = false) :
+			sink_(sink),
+			isQuoted_(isQuoted)
+		{
+		}
+
+		TextBuffer(const TextBuffer&) = delete;
+		TextBuffer& operator = (const TextBuffer&) = delete;
+
+		~TextBuffer()
+		{
+			flush();
+		}
+
+		void put(const char c)
+		{
+			reserve(1);
+			buffer_[size_++] = c;
+		}
+
+		void put(const char *data, const std::size_t size)
+		{
+			if(size > sizeof buffer_ - size_)
+			{
+				flush();
+				if(size > sizeof buffer_)
+				{
+					sink_.write(data, size);
+					return;
+				}
+			}
+			std::memcpy(buffer_ + size_, data, size);
+			size_ += size;
+		}
+
+		void fill(const char c, const int count)
+		{
+			for(int i = 0; i < count; ++i)
+			{
+				put(c);
+			}
+		}
+
+		/// То же, что textForData, но прямо в буфер.
+		void putData(const Type type, const std::pair<const char*, int> bytes)
+		{
+			switch(type)
+			{
+				case Type::INVALID: return;
+				case Type::INT:
+				{
+					int value = 0;
+					std::memcpy(&value, bytes.first, sizeof value);
+					put("int ", 4);
+					reserve(maxNumberSize);
+					size_ = std::to_chars(buffer_ + size_, buffer_ + sizeof buffer_, value).ptr - buffer_;
+					return;
+				}
+				case Type::REAL:
+				{
+					double value = 0;
+					std::memcpy(&value, bytes.first, sizeof value);
+					put("real ", 5);
+					reserve(maxNumberSize);
+					auto end = buffer_ + sizeof buffer_;
+					// Как std::to_string: %f, шесть знаков после точки; в кавычках - кратчайшая точная запись.
+					size_ = (isQuoted_
+						? std::to_chars(buffer_ + size_, end, value)
+						: std::to_chars(buffer_ + size_, end, value, std::chars_format::fixed, 6)).ptr - buffer_;
+					return;
+				}
+				case Type::STRING:
+				{
+					put("string ", 7);
+					if(isQuoted_)
+					{
+						putQuoted(bytes.first, bytes.second);
+					}
+					else
+					{
+						put(bytes.first, bytes.second);
+					}
+					return;
+				}
+			}
+		}
+
+	private:
+		void putQuoted(const char *data, const std::size_t size)
+		{
+			put('"');
+			std::size_t begin = 0;
+			for(std::size_t i = 0; i < size; ++i)
+			{
+				if(data[i] == '"' || data[i] == '\\')
+				{
+					put(data + begin, i - begin);
+					put('\\');
+					begin = i;
+				}
+			}
+			put(data + begin, size - begin);
+			put('"');
+		}
+
+		/// Самое длинное число - DBL_MAX в %f: 309 цифр, точка и 6 знаков.
+		static constexpr std::size_t maxNumberSize = 320;
+
+		void reserve(const std::size_t size)
+		{
+			if(sizeof buffer_ - size_ < size)
+			{
+				flush();
+			}
+		}
+
+		void flush()
+		{
+			if(size_ > 0)
+			{
+				sink_.write(buffer_, size_);
+				size_ = 0;
+			}
+		}
+
+		Sink &sink_;
+		bool isQuoted_;
+		char buffer_[1 << 13];
+		std::size_t size_ = 0;
+	};
+
+	/// Текстовое представление данных узла по его типу и сырым байтам.
+	/// Нужно представлениям, которые не хранят Int/Real/String объектами.
+	static std::string textForData(const Type type, const std::pair<const char*, int> bytes)
+	{
+		switch(type)
+		{
+			case Type::INVALID: return "";
+			case Type::INT:
+			{
+				int value = 0;
+				std::memcpy(&value, bytes.first, sizeof value);
+				return std::string("int ") + std::to_string(value);
+			}
+			case Type::REAL:
+			{
+				double value = 0;
+				std::memcpy(&value, bytes.first, sizeof value);
+				return std::string("real ") + std::to_string(value);
+			}
+			case Type::STRING: return std::string("string ") + std::string(bytes.first, bytes.second);
+		}
+		return "";
+	}
+
+	/// Обход для реализаций traverse: глубина дерева
+	/// ограничена памятью, а не размером стека потока.
+	void traverseIteratively(
+		const std::function<void(Abstract const *)> &initial,
+		const std::function<void(Abstract const *)> &final) const
+	{
+		visit(initial, final);
+	}
+
+	/// Сравнение данных узлов по типу и сырым байтам, независимо от представления.
+	static bool isSameData(Abstract const *left, Abstract const *right)
+	{
+		if(!left || !right || left->type() != right->type())
+		{
+			return false;
+		}
+		const auto [leftData, leftSize] = left->bytes();
+		const auto [rightData, rightSize] = right->bytes();
+		// Общее хранилище (интернированные строки) сравнивается по указателю.
+		return leftSize == rightSize
+			&& (leftSize == 0 || leftData == rightData || std::memcmp(leftData, rightData, leftSize) == 0);
+	}
+};
 
 class Empty : public Abstract
 {
@@ -146,6 +603,11 @@ public:
 		return;
 	}
 
+	virtual Abstract const* child(const int index) const
+	{
+		return nullptr;
+	}
+
 	virtual Type type() const 
 	{
 		return Type::INVALID;
@@ -165,12 +627,30 @@ protected:
 		return "";
 	}
 
-	virtual bool isDataEqual(TreeConstPtr tree) const 
+	virtual bool isDataEqual(Abstract const *tree) const 
 	{
-		return std::dynamic_pointer_cast<Empty const>(tree) != nullptr;
+		return tree && tree->type() == Type::INVALID;
 	}
 };
 
+TreePtr operator + (TreePtr parent, TreePtr child)
+{
+	if(!child || child->isEmpty())
+	{
+		return parent;
+	}
+	if(!parent || parent->isEmpty())
+	{
+		return child;
+	}
+	if(parent->isFrozen())
+	{
+		return makePtr<Empty>();
+	}
+	parent->addChild(std::move(child));
+	return parent;
+}
+
 class Naive : public Abstract
 {
 public:
@@ -187,24 +667,146 @@ public:
 	virtual void traverse(std::function<void(Abstract const *)> initial,
 				  std::function<void(Abstract const *)> final) const
 	{
-		initial(this);
-		for(auto child = children_.cbegin(); child != children_.cend(); ++child)
+		traverseIteratively(initial, final);
+	}
+
+	virtual Abstract const* child(const int index) const
+	{
+		return children_[index].get();
+	}
+
+	virtual Naive const* asNaive() const
+	{
+		return this;
+	}
+
+	Naive() = default;
+
+	void reserveChildren(const int count)
+	{
+		children_.reserve(count);
+	}
+
+	/// У узла есть дети, которых ещё нет в сохранённом файле.
+	/// Узел, который не сохранялся вовсе, тоже считается изменённым.
+	bool isDirty() const
+	{
+		return savedCount_ != static_cast<int>(children_.size());
+	}
+
+	/// Копия разделяет детей с оригиналом, но не его кешированный хеш
+	/// и не заморозку.
+	Naive(const Naive &other) :
+		children_(other.children_)
+	{
+	}
+
+	/// Разбирает поддеревья без рекурсии, чтобы глубокие цепочки
+	/// не переполняли стек каскадом деструкторов shared_ptr.
+	~Naive()
+	{
+		std::vector<TreeConstPtr> pending(std::move(children_));
+		while(!pending.empty())
 		{
-			(*child)->traverse(initial, final);
+			auto child = std::move(pending.back());
+			pending.pop_back();
+			if(child.use_count() != 1)
+			{
+				continue;
+			}
+			auto naive = dynamic_cast<Naive const*>(child.get());
+			if(naive)
+			{
+				auto &grandchildren = const_cast<Naive*>(naive)->children_;
+				std::move(grandchildren.begin(), grandchildren.end(), std::back_inserter(pending));
+				grandchildren.clear();
+			}
 		}
-		final(this);	
 	}
 
 protected:	
+	/// Замороженный узел не меняется; operator + сообщает об этом Empty.
 	virtual void addChild(TreePtr child)
 	{
-		children_.push_back(child);
+		if(isFrozen())
+		{
+			return;
+		}
+		children_.push_back(std::move(child));
+	}
+
+	/// Хеш хранят только замороженные узлы: у узла нет ссылки
+	/// на родителей, и изменение потомка не сбросило бы их кеш.
+	virtual bool loadHash(std::uint64_t &hash) const
+	{
+		if(!hasHash_.load(std::memory_order_acquire))
+		{
+			return false;
+		}
+		hash = hash_.load(std::memory_order_relaxed);
+		return true;
+	}
+
+	virtual void storeHash(const std::uint64_t hash) const
+	{
+		if(!isFrozen())
+		{
+			return;
+		}
+		hash_.store(hash, std::memory_order_relaxed);
+		hasHash_.store(true, std::memory_order_release);
 	}
 
 private:
+	friend class Abstract;
+	friend class NaiveBuilder;
+	friend class DagBuilder;
+	friend class Delta;
+	friend class Persistent;
+
 	std::vector<TreeConstPtr> children_;
+	/// Потомки замороженного узла тоже заморожены.
+	mutable std::atomic<bool> frozen_{false};
+	mutable std::atomic<std::uint64_t> hash_{0};
+	mutable std::atomic<bool> hasHash_{false};
+	/// Число детей, уже записанных в файл; -1, если узел не сохранялся.
+	mutable int savedCount_ = -1;
 };
 
+inline bool Abstract::isFrozen() const
+{
+	auto naive = asNaive();
+	return naive && naive->frozen_.load(std::memory_order_acquire);
+}
+
+/// Узлы замораживаются от листьев к корню, чтобы замороженный
+/// узел ни в какой момент не имел изменяемых потомков. Уже
+/// замороженные поддеревья, в том числе общие в DAG, не обходятся.
+inline void Abstract::freeze() const
+{
+	auto root = asNaive();
+	if(!root || root->isFrozen())
+	{
+		return;
+	}
+	std::vector<std::pair<Naive const*, std::size_t>> stack{{root, 0}};
+	while(!stack.empty())
+	{
+		auto &[node, next] = stack.back();
+		if(next == node->children_.size())
+		{
+			node->frozen_.store(true, std::memory_order_release);
+			stack.pop_back();
+			continue;
+		}
+		auto child = node->children_[next++]->asNaive();
+		if(child && !child->isFrozen())
+		{
+			stack.push_back({child, 0});
+		}
+	}
+}
+
 class Int : public Naive
 {
 public:
@@ -235,10 +837,9 @@ protected:
 		return std::string("int ") + std::to_string(data());
 	}
 
-	virtual bool isDataEqual(TreeConstPtr tree) const 
+	virtual bool isDataEqual(Abstract const *tree) const 
 	{
-		auto intNode = std::dynamic_pointer_cast<Int const>(tree);
-		return intNode && intNode->data() == data(); 
+		return isSameData(this, tree);
 	}
 
 private:
@@ -275,10 +876,9 @@ protected:
 		return std::string("real ") + std::to_string(data());
 	}
 
-	virtual bool isDataEqual(TreeConstPtr tree) const 
+	virtual bool isDataEqual(Abstract const *tree) const 
 	{
-		auto realNode = std::dynamic_pointer_cast<Real const>(tree);
-		return realNode && realNode->data() == data(); 
+		return isSameData(this, tree);
 	}
 
 private:
@@ -286,27 +886,67 @@ private:
 };
 
 
+/// Пул неизменяемых строк для String: одинаковые значения,
+/// полученные через intern, делят одно хранилище.
+/// Пул не потокобезопасен; значения живут, пока на них есть ссылки.
+class StringPool
+{
+public:
+	using Value = std::shared_ptr<const std::string>;
+
+	Value intern(const char *data, const std::size_t size)
+	{
+		const auto found = values_.find(std::string_view(data, size));
+		if(found != values_.end())
+		{
+			return found->second;
+		}
+		auto value = std::make_shared<const std::string>(data, size);
+		values_.emplace(std::string_view(*value), value);
+		return value;
+	}
+
+	Value intern(const std::string &value)
+	{
+		return intern(value.data(), value.size());
+	}
+
+	std::size_t size() const
+	{
+		return values_.size();
+	}
+
+private:
+	std::unordered_map<std::string_view, Value> values_;
+};
+
 class String : public Naive
 {
 public:
 	String(const std::string &value) :
-	 data_(value)
+	 data_(std::make_shared<const std::string>(value))
 	{
 	}
 
 	String(std::string &&value) :
-	 data_(value)
+	 data_(std::make_shared<const std::string>(std::move(value)))
 	{
 	}
 
 	String(const char *value) :
-		data_(value)
+		data_(std::make_shared<const std::string>(value))
+	{
+	}
+
+	/// Значение из StringPool::intern, без копирования.
+	String(StringPool::Value value) :
+		data_(std::move(value))
 	{
 	}
 
 	const std::string& data() const
 	{
-		return data_;
+		return *data_;
 	}
 
 	virtual Type type() const 
@@ -316,7 +956,7 @@ public:
 
 	virtual std::pair<const char*, int> bytes() const
 	{
-		return {data_.c_str(), data_.size()};
+		return {data_->c_str(), data_->size()};
 	}
 
 protected:
@@ -325,13 +965,167 @@ protected:
 		return std::string("string ") + data();
 	}
 
-	virtual bool isDataEqual(TreeConstPtr tree) const 
+	virtual bool isDataEqual(Abstract const *tree) const 
 	{
-		auto stringNode = std::dynamic_pointer_cast<String const>(tree);
-		return stringNode && stringNode->data() == data(); 
+		return isSameData(this, tree);
 	}
 
 private:
-	std::string data_;
+	StringPool::Value data_;
+};
+
+/// Собирает дерево из узлов Int/Real/String по сегментам в прямом порядке
+/// обхода. Стек незаполненных родителей хранится в куче, поэтому
+/// глубина дерева не ограничена стеком потока.
+class NaiveBuilder
+{
+public:
+	NaiveBuilder() = default;
+
+	/// Строки интернируются в pool.
+	explicit NaiveBuilder(StringPool *pool) :
+		pool_(pool)
+	{
+	}
+
+	bool add(const Type type, const char *data, const int dataSize, const int childrenCount)
+	{
+		if(childrenCount < 0 || (root_ && stack_.empty()))
+		{
+			return false;
+		}
+		auto node = makeNode(type, data, dataSize, pool_);
+		if(!node)
+		{
+			return false;
+		}
+		push(std::move(node), childrenCount);
+		return true;
+	}
+
+	/// Создаёт следующий узел T прямо из аргументов его конструктора.
+	template <class T, class... Args>
+	bool emplace(const int childrenCount, Args&&... args)
+	{
+		if(childrenCount < 0 || (root_ && stack_.empty()))
+		{
+			return false;
+		}
+		Stats::add(Stats::Counter::ALLOCATIONS);
+		push(std::make_shared<T>(std::forward<Args>(args)...), childrenCount);
+		return true;
+	}
+
+	/// Добавляет следующим узлом уже собранное целиком поддерево.
+	bool attach(TreePtr subtree)
+	{
+		if(!subtree || subtree->isEmpty() || (root_ && stack_.empty()))
+		{
+			return false;
+		}
+		link(std::move(subtree));
+		return true;
+	}
+
+	bool isComplete() const
+	{
+		return root_ && stack_.empty();
+	}
+
+	TreePtr finish()
+	{
+		if(!isComplete())
+		{
+			root_.reset();
+			stack_.clear();
+			return std::make_shared<Empty>();
+		}
+		return std::move(root_);
+	}
+
+	/// Больше детей заранее не резервируется: их число приходит из файла
+	/// и может оказаться ложным, а дальше вектор растёт сам.
+	static constexpr int maxReservedChildren = 1 << 12;
+
+	/// Узел Int/Real/String без детей по данным сегмента
+	/// или nullptr, если данные не подходят к типу.
+	static TreePtr makeNode(const Type type, const char *data, const int dataSize, StringPool *pool = nullptr)
+	{
+		if(dataSize < 0)
+		{
+			return nullptr;
+		}
+		switch(type)
+		{
+			case Type::INVALID:
+			{
+				return nullptr;
+			}
+			case Type::INT:
+			{
+				if(dataSize != sizeof(int))
+				{
+					return nullptr;
+				}
+				int value = 0;
+				std::memcpy(&value, data, sizeof value);
+				Stats::add(Stats::Counter::ALLOCATIONS);
+				return std::make_shared<Int>(value);
+			}
+			case Type::REAL:
+			{
+				if(dataSize != sizeof(double))
+				{
+					return nullptr;
+				}
+				double value = 0;
+				std::memcpy(&value, data, sizeof value);
+				Stats::add(Stats::Counter::ALLOCATIONS);
+				return std::make_shared<Real>(value);
+			}
+			case Type::STRING:
+			{
+				Stats::add(Stats::Counter::ALLOCATIONS);
+				if(pool)
+				{
+					return std::make_shared<String>(pool->intern(dataSize > 0 ? data : "", dataSize));
+				}
+				return std::make_shared<String>(dataSize > 0 ? std::string(data, dataSize) : std::string());
+			}
+		}
+		return nullptr;
+	}
+
+private:
+	void push(TreePtr node, const int childrenCount)
+	{
+		auto naive = static_cast<Naive*>(node.get());
+		naive->children_.reserve(std::min(childrenCount, maxReservedChildren));
+		link(std::move(node));
+		if(childrenCount > 0)
+		{
+			stack_.push_back({naive, childrenCount});
+			Stats::maximum(Stats::Counter::MAX_DEPTH, stack_.size());
+		}
+	}
+
+	void link(TreePtr node)
+	{
+		if(!root_)
+		{
+			root_ = std::move(node);
+			return;
+		}
+		auto &parent = stack_.back();
+		parent.first->children_.push_back(std::move(node));
+		if(--parent.second == 0)
+		{
+			stack_.pop_back();
+		}
+	}
+
+	TreePtr root_;
+	std::vector<std::pair<Naive*, int>> stack_;
+	StringPool *pool_ = nullptr;
 };
 }
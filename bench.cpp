@@ -0,0 +1,572 @@
+#include "Compact.hpp"
+#include "File.hpp"
+#include "IO.hpp"
+#include "Span.hpp"
+#include "Text.hpp"
+#include "Tree.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+/// Счётчики всех выделений памяти процесса для allocations/node.
+/// Замены new и delete не встраиваются: иначе GCC видит free
+/// для указателя из operator new и предупреждает о несовпадении.
+namespace Allocations
+{
+std::atomic<std::uint64_t> count{0};
+std::atomic<std::uint64_t> bytes{0};
+}
+
+__attribute__((noinline)) void* operator new(std::size_t size)
+{
+	++Allocations::count;
+	Allocations::bytes += size;
+	if(void *memory = std::malloc(size ? size : 1))
+	{
+		return memory;
+	}
+	throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void *memory) noexcept
+{
+	std::free(memory);
+}
+
+__attribute__((noinline)) void operator delete[](void *memory) noexcept
+{
+	std::free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void *memory, std::size_t) noexcept
+{
+	std::free(memory);
+}
+
+__attribute__((noinline)) void operator delete[](void *memory, std::size_t) noexcept
+{
+	std::free(memory);
+}
+
+/// Воспроизводимые деревья: один и тот же shape, размер и seed
+/// дают одну и ту же последовательность узлов в прямом порядке обхода.
+class Generator
+{
+public:
+	Generator(const std::string &shape, const int nodes, const std::uint64_t seed) :
+		shape_(shape),
+		nodes_(std::max(nodes, 1)),
+		random_(seed)
+	{
+	}
+
+	static bool isShape(const std::string &shape)
+	{
+		return shape == "wide" || shape == "deep" || shape == "balanced" || shape == "strings";
+	}
+
+	template <class Builder>
+	bool generate(Builder &builder)
+	{
+		if(shape_ == "wide")
+		{
+			add(builder, nodes_ - 1);
+			for(int i = 1; i < nodes_; ++i)
+			{
+				add(builder, 0);
+			}
+			return builder.isComplete();
+		}
+		if(shape_ == "deep")
+		{
+			for(int i = 1; i < nodes_; ++i)
+			{
+				add(builder, 1);
+			}
+			add(builder, 0);
+			return builder.isComplete();
+		}
+		if(shape_ == "balanced" || shape_ == "strings")
+		{
+			// Полное дерево с четырьмя детьми у узла, последний уровень неполный.
+			constexpr int fanout = 4;
+			for(int i = 0; i < nodes_; ++i)
+			{
+				const long long first = static_cast<long long>(i) * fanout + 1;
+				const auto count = std::clamp<long long>(nodes_ - first, 0, fanout);
+				add(builder, static_cast<int>(count), shape_ == "strings");
+			}
+			return builder.isComplete();
+		}
+		return false;
+	}
+
+	/// Узлы balanced идут в порядке обхода в ширину, поэтому
+	/// builder получает их через перестановку в прямой порядок.
+	template <class Builder>
+	void add(Builder &builder, const int childrenCount, const bool isStringHeavy = false)
+	{
+		if(shape_ == "balanced" || shape_ == "strings")
+		{
+			pending_.push_back({childrenCount, isStringHeavy ? 2 : kind()});
+			if(static_cast<int>(pending_.size()) == nodes_)
+			{
+				emitPreorder(builder);
+			}
+			return;
+		}
+		emit(builder, kind(), childrenCount);
+	}
+
+private:
+	struct Pending
+	{
+		int childrenCount_;
+		int kind_;
+	};
+
+	int kind()
+	{
+		return static_cast<int>(random_() % 3);
+	}
+
+	template <class Builder>
+	void emitPreorder(Builder &builder)
+	{
+		constexpr int fanout = 4;
+		std::vector<int> stack{0};
+		while(!stack.empty())
+		{
+			const auto index = stack.back();
+			stack.pop_back();
+			emit(builder, pending_[index].kind_, pending_[index].childrenCount_);
+			for(int i = pending_[index].childrenCount_; i > 0; --i)
+			{
+				stack.push_back(index * fanout + i);
+			}
+		}
+		pending_.clear();
+	}
+
+	template <class Builder>
+	void emit(Builder &builder, const int kind, const int childrenCount)
+	{
+		using namespace Tree;
+		switch(kind)
+		{
+			case 0:
+			{
+				const int value = static_cast<int>(random_());
+				builder.add(Type::INT, reinterpret_cast<const char*>(&value), sizeof value, childrenCount);
+				break;
+			}
+			case 1:
+			{
+				const double value = static_cast<double>(random_() % 1000000) / 1000;
+				builder.add(Type::REAL, reinterpret_cast<const char*>(&value), sizeof value, childrenCount);
+				break;
+			}
+			default:
+			{
+				const auto value = string();
+				builder.add(Type::STRING, value.data(), static_cast<int>(value.size()), childrenCount);
+				break;
+			}
+		}
+	}
+
+	/// Строки от 4 до 64 байт, часть из них - повторяющиеся метки.
+	std::string string()
+	{
+		static const char *labels[] = {"name", "value", "children", "attributes", "identifier"};
+		if(random_() % 2 == 0)
+		{
+			return labels[random_() % 5];
+		}
+		std::string value(4 + random_() % 61, ' ');
+		for(auto &c : value)
+		{
+			c = static_cast<char>('a' + random_() % 26);
+		}
+		return value;
+	}
+
+	std::string shape_;
+	int nodes_;
+	std::mt19937_64 random_;
+	std::vector<Pending> pending_;
+};
+
+/// Собирает то же дерево через makePtr и operator +,
+/// как деревья строятся вручную.
+class OperatorBuilder
+{
+public:
+	bool add(const Tree::Type type, const char *data, const int dataSize, const int childrenCount)
+	{
+		using namespace Tree;
+		TreePtr node;
+		switch(type)
+		{
+			case Type::INT:
+			{
+				int value = 0;
+				std::memcpy(&value, data, sizeof value);
+				node = childrenCount > 0 ? makeParent<Int>(childrenCount, value) : makePtr<Int>(value);
+				break;
+			}
+			case Type::REAL:
+			{
+				double value = 0;
+				std::memcpy(&value, data, sizeof value);
+				node = childrenCount > 0 ? makeParent<Real>(childrenCount, value) : makePtr<Real>(value);
+				break;
+			}
+			default:
+			{
+				std::string value(data, dataSize);
+				node = childrenCount > 0
+					? makeParent<String>(childrenCount, std::move(value))
+					: makePtr<String>(std::move(value));
+				break;
+			}
+		}
+		if(childrenCount > 0)
+		{
+			stack_.push_back({std::move(node), childrenCount});
+			return true;
+		}
+		while(!stack_.empty())
+		{
+			stack_.back().first + std::move(node);
+			if(--stack_.back().second > 0)
+			{
+				return true;
+			}
+			node = std::move(stack_.back().first);
+			stack_.pop_back();
+		}
+		root_ = std::move(node);
+		return true;
+	}
+
+	bool isComplete() const
+	{
+		return root_ && stack_.empty();
+	}
+
+	Tree::TreePtr finish()
+	{
+		return std::move(root_);
+	}
+
+private:
+	Tree::TreePtr root_;
+	std::vector<std::pair<Tree::TreePtr, int>> stack_;
+};
+
+struct Result
+{
+	std::string shape_;
+	std::string case_;
+	int nodes_ = 0;
+	double nsPerNode_ = 0;
+	double megabytesPerSecond_ = 0;
+	double allocationsPerNode_ = 0;
+	long peakRssKb_ = 0;
+};
+
+class Bench
+{
+public:
+	Bench(const int nodes, const int repeat, const std::uint64_t seed) :
+		nodes_(nodes),
+		repeat_(std::max(repeat, 1)),
+		seed_(seed)
+	{
+	}
+
+	std::vector<Result> run(const std::vector<std::string> &shapes)
+	{
+		using namespace Tree;
+
+		std::vector<Result> results;
+		for(const auto &shape : shapes)
+		{
+			TreePtr tree;
+			const auto build = [&](){
+				Generator generator(shape, nodes_, seed_);
+				NaiveBuilder builder;
+				generator.generate(builder);
+				return builder.finish();
+			};
+
+			results.push_back(measure(shape, "build", 0, [&](){ tree = build(); }, [&](){ tree.reset(); }));
+			results.push_back(measure(shape, "destroy", 0, [&](){ tree.reset(); }, [&](){ tree = build(); }));
+			results.push_back(measure(shape, "build operator+", 0, [&](){
+				Generator generator(shape, nodes_, seed_);
+				OperatorBuilder builder;
+				generator.generate(builder);
+				tree = builder.finish();
+			}, [&](){ tree.reset(); }));
+			tree = build();
+			const auto copy = build();
+
+			std::string text;
+			results.push_back(measure(shape, "toText", 0, [&](){ text = tree->toText(); }));
+			text = std::string();
+			bool isEqual = false;
+			results.push_back(measure(shape, "isEqual", 0, [&](){ isEqual = tree->isEqual(copy); }));
+			if(!isEqual)
+			{
+				std::cerr << shape << ": copy is not equal to the tree" << std::endl;
+			}
+
+			std::string bytes;
+			{
+				BufferSink sink;
+				BasicOStream<BufferSink>(&sink).write(tree);
+				bytes = std::move(sink.buffer());
+			}
+			std::string compact;
+			{
+				BufferSink sink;
+				CompactOStream<BufferSink>(&sink).write(tree);
+				compact = std::move(sink.buffer());
+			}
+			results.push_back(measure(shape, "write memory", bytes.size(), [&](){
+				BufferSink sink;
+				BasicOStream<BufferSink>(&sink).write(tree);
+			}));
+			// Прочитанное дерево живёт до следующего prepare, чтобы
+			// время чтения не включало его разрушение.
+			TreeConstPtr read;
+			const auto resetRead = [&](){ read.reset(); };
+			results.push_back(measure(shape, "read memory", bytes.size(), [&](){
+				read = SpanReader(bytes).read();
+			}, resetRead));
+			results.push_back(measure(shape, "write memory v2", compact.size(), [&](){
+				BufferSink sink;
+				CompactOStream<BufferSink>(&sink).write(tree);
+			}));
+			results.push_back(measure(shape, "read memory v2", compact.size(), [&](){
+				Compact::SpanSource source(compact.data(), compact.size());
+				read = CompactIStream<Compact::SpanSource>(&source).read();
+			}, resetRead));
+
+			std::string quoted = tree->toQuotedText();
+			results.push_back(measure(shape, "write text", quoted.size(), [&](){
+				tree->toQuotedText();
+			}));
+			results.push_back(measure(shape, "read text", quoted.size(), [&](){
+				read = TextReader(quoted).read();
+			}, resetRead));
+			quoted = std::string();
+
+			const std::string fileName("tree_bench.tree");
+			results.push_back(measure(shape, "write file", bytes.size(), [&](){
+				File::saveToFile(fileName, tree);
+			}));
+			results.push_back(measure(shape, "read file", bytes.size(), [&](){
+				read = File::loadFromFile(fileName);
+			}, resetRead));
+			results.push_back(measure(shape, "write file async", bytes.size(), [&](){
+				File::saveToFileAsync(fileName, tree);
+			}));
+			results.push_back(measure(shape, "read file async", bytes.size(), [&](){
+				read = File::loadFromFileAsync(fileName);
+			}, resetRead));
+			read.reset();
+			std::remove(fileName.c_str());
+		}
+		return results;
+	}
+
+private:
+	template <class Case>
+	Result measure(const std::string &shape, const char *name, const std::size_t bytes, Case run)
+	{
+		return measure(shape, name, bytes, run, [](){});
+	}
+
+	/// Лучшее время из repeat запусков; prepare выполняется
+	/// перед каждым запуском и не измеряется.
+	template <class Case, class Prepare>
+	Result measure(const std::string &shape,
+				   const char *name,
+				   const std::size_t bytes,
+				   Case run,
+				   Prepare prepare)
+	{
+		double best = 0;
+		std::uint64_t allocations = 0;
+		for(int i = 0; i < repeat_; ++i)
+		{
+			prepare();
+			const auto allocationsBefore = Allocations::count.load();
+			const auto start = std::chrono::steady_clock::now();
+			run();
+			const auto finish = std::chrono::steady_clock::now();
+			const auto ns = std::chrono::duration<double, std::nano>(finish - start).count();
+			if(i == 0 || ns < best)
+			{
+				best = ns;
+			}
+			allocations = Allocations::count.load() - allocationsBefore;
+		}
+
+		Result result;
+		result.shape_ = shape;
+		result.case_ = name;
+		result.nodes_ = nodes_;
+		result.nsPerNode_ = best / nodes_;
+		result.megabytesPerSecond_ = bytes > 0 ? bytes / (best / 1e9) / (1 << 20) : 0;
+		result.allocationsPerNode_ = static_cast<double>(allocations) / nodes_;
+		result.peakRssKb_ = peakRssKb();
+		return result;
+	}
+
+	static long peakRssKb()
+	{
+		rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		return usage.ru_maxrss;
+	}
+
+	int nodes_;
+	int repeat_;
+	std::uint64_t seed_;
+};
+
+void printCsv(std::ostream &out, const std::vector<Result> &results)
+{
+	out << "shape,case,nodes,ns_per_node,mb_per_s,allocations_per_node,peak_rss_kb" << std::endl;
+	for(const auto &result : results)
+	{
+		out << result.shape_ << ',' << result.case_ << ',' << result.nodes_ << ','
+			<< result.nsPerNode_ << ',' << result.megabytesPerSecond_ << ','
+			<< result.allocationsPerNode_ << ',' << result.peakRssKb_ << std::endl;
+	}
+}
+
+void printJson(std::ostream &out, const std::vector<Result> &results, const std::uint64_t seed)
+{
+	out << "{\"seed\": " << seed << ", \"results\": [" << std::endl;
+	for(std::size_t i = 0; i < results.size(); ++i)
+	{
+		const auto &result = results[i];
+		out << "  {\"shape\": \"" << result.shape_ << "\", \"case\": \"" << result.case_
+			<< "\", \"nodes\": " << result.nodes_
+			<< ", \"ns_per_node\": " << result.nsPerNode_
+			<< ", \"mb_per_s\": " << result.megabytesPerSecond_
+			<< ", \"allocations_per_node\": " << result.allocationsPerNode_
+			<< ", \"peak_rss_kb\": " << result.peakRssKb_ << "}"
+			<< (i + 1 < results.size() ? "," : "") << std::endl;
+	}
+	out << "]}" << std::endl;
+}
+
+void printHelp()
+{
+	std::cout << "Usage: tree_bench [--nodes N] [--repeat R] [--seed S]" << std::endl;
+	std::cout << "                  [--shapes wide,deep,balanced,strings] [--format json|csv] [-o FILE]" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+	int nodes = 1000000;
+	int repeat = 3;
+	std::uint64_t seed = 2021;
+	std::string format("json");
+	std::string outputFileName;
+	std::vector<std::string> shapes{"wide", "deep", "balanced", "strings"};
+
+	for(int i = 1; i < argc; ++i)
+	{
+		const std::string arg(argv[i]);
+		if(i + 1 >= argc)
+		{
+			printHelp();
+			return arg == "--help" ? 0 : 1;
+		}
+		const std::string value(argv[++i]);
+		if(arg == "--nodes")
+		{
+			nodes = std::stoi(value);
+		}
+		else if(arg == "--repeat")
+		{
+			repeat = std::stoi(value);
+		}
+		else if(arg == "--seed")
+		{
+			seed = std::stoull(value);
+		}
+		else if(arg == "--format")
+		{
+			format = value;
+		}
+		else if(arg == "-o")
+		{
+			outputFileName = value;
+		}
+		else if(arg == "--shapes")
+		{
+			shapes.clear();
+			std::istringstream list(value);
+			std::string shape;
+			while(std::getline(list, shape, ','))
+			{
+				if(!Generator::isShape(shape))
+				{
+					std::cerr << "Unknown shape: " << shape << std::endl;
+					printHelp();
+					return 1;
+				}
+				shapes.push_back(shape);
+			}
+		}
+		else
+		{
+			printHelp();
+			return 1;
+		}
+	}
+
+	const auto results = Bench(nodes, repeat, seed).run(shapes);
+
+	std::ofstream file;
+	if(!outputFileName.empty())
+	{
+		file.open(outputFileName.c_str());
+	}
+	std::ostream &out = outputFileName.empty() ? std::cout : file;
+	if(format == "csv")
+	{
+		printCsv(out, results);
+	}
+	else
+	{
+		printJson(out, results, seed);
+	}
+	return 0;
+}
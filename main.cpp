@@ -1,7 +1,29 @@
+#include "Arena.hpp"
+#include "Block.hpp"
+#include "Columnar.hpp"
+#include "Dag.hpp"
+#include "Delta.hpp"
+#include "Events.hpp"
+#include "File.hpp"
 #include "IO.hpp"
+#include "Lazy.hpp"
+#include "Mapped.hpp"
+#include "Parallel.hpp"
+#include "Persistent.hpp"
+#include "Span.hpp"
+#include "Text.hpp"
 #include "Tree.hpp"
 #include "test.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <random>
+#include <thread>
+
+#include <malloc.h>
+
 class Tester
 {
 public:
@@ -123,6 +145,108 @@ public:
 			false, "");
 	}
 
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::structuralHash" << std::endl;
+
+		const auto makeTree = [](){
+			return Tree::makePtr<Int>(8)
+				+ (Tree::makePtr<String>("bar")
+					+ Tree::makePtr<Real>(2.015))
+				+ Tree::makePtr<String>("baz");
+		};
+		const auto left = makeTree();
+		const auto right = makeTree();
+
+		ASSERT_EQUALS("equal trees have equal hashes",
+			(left->structuralHash() == right->structuralHash()), true, "");
+		ASSERT_EQUALS("hash does not depend on representation",
+			(ArenaBuilder::copy(left)->structuralHash() == left->structuralHash()), true, "");
+		ASSERT_EQUALS("(int 1 (int 2)) and (int 2 (int 1)) hashes differ",
+			((Tree::makePtr<Int>(1) + Tree::makePtr<Int>(2))->structuralHash()
+				== (Tree::makePtr<Int>(2) + Tree::makePtr<Int>(1))->structuralHash()), false, "");
+		ASSERT_EQUALS("(int 1 (int 2, int 3)) and (int 1 (int 2 (int 3))) hashes differ",
+			((Tree::makePtr<Int>(1) + Tree::makePtr<Int>(2) + Tree::makePtr<Int>(3))->structuralHash()
+				== (Tree::makePtr<Int>(1) + (Tree::makePtr<Int>(2) + Tree::makePtr<Int>(3)))->structuralHash()),
+			false, "");
+
+		auto branch = Tree::makePtr<String>("branch");
+		left + branch;
+		right + (Tree::makePtr<String>("branch"));
+		const auto hashBefore = left->structuralHash();
+		ASSERT_EQUALS("grown trees are equal", left->isEqual(right), true, "");
+		branch + Tree::makePtr<Int>(1);
+		ASSERT_EQUALS("hash follows mutation of a subtree",
+			(left->structuralHash() == hashBefore), false, "");
+		ASSERT_EQUALS("mutated tree is NOT equal to original", left->isEqual(right), false, "");
+		ASSERT_EQUALS("tree is equal to its arena copy", ArenaBuilder::copy(left)->isEqual(left), true, "");
+		ASSERT_EQUALS("(real 0) is NOT equal to (int 0)",
+			Tree::Real(0).isEqual(Tree::makePtr<Int>(0)), false, "");
+
+		const auto frozen = makeTree();
+		const auto frozenChild = frozen->child(0);
+		frozen->freeze();
+		const auto frozenHash = frozen->structuralHash();
+		ASSERT_EQUALS("freeze reaches descendants", frozenChild->asNaive()->isFrozen(), true, "");
+		ASSERT_EQUALS("mutable trees stay unfrozen", left->asNaive()->isFrozen(), false, "");
+		ASSERT_EQUALS("adding to a frozen tree gives ()", (frozen + Tree::makePtr<Int>(1))->toText(), "()", "");
+		ASSERT_EQUALS("frozen tree does not grow", frozen->childrenCount(), 2, "");
+		left + Tree::makePtr<Int>(2);
+		ASSERT_EQUALS("frozen hash is kept", (frozen->structuralHash() == frozenHash), true, "");
+		ASSERT_EQUALS("frozen tree is equal to its copy", frozen->isEqual(makeTree()), true, "");
+		const auto shared = DagBuilder::copy(left);
+		ASSERT_EQUALS("dag is frozen", (shared->asNaive()->isFrozen() && shared->isEqual(left)), true, "");
+		ASSERT_EQUALS("path copy of a frozen tree is frozen",
+			Persistent::withoutSubtree(frozen, {1})->asNaive()->isFrozen(), true, "");
+		ASSERT_EQUALS("path copy of a mutable tree is not frozen",
+			Persistent::withoutSubtree(left, {1})->asNaive()->isFrozen(), false, "");
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::visit" << std::endl;
+
+		struct Counter
+		{
+			void enter(Abstract const *tree)
+			{
+				order_ += tree->type() == Type::INT ? "i" : "s";
+				++depth_;
+				maxDepth_ = std::max(maxDepth_, depth_);
+			}
+
+			void leave(Abstract const *tree)
+			{
+				--depth_;
+			}
+
+			std::string order_;
+			int depth_ = 0;
+			int maxDepth_ = 0;
+		};
+
+		const auto tree = Tree::makePtr<Int>(1)
+			+ (Tree::makePtr<String>("a")
+				+ Tree::makePtr<Int>(2))
+			+ Tree::makePtr<String>("b");
+
+		Counter counter;
+		tree->visit(counter);
+		ASSERT_EQUALS("visit goes in preorder", counter.order_, "isis", "");
+		ASSERT_EQUALS("visit enters and leaves", counter.depth_, 0, "");
+		ASSERT_EQUALS("visit depth", counter.maxDepth_, 3, "");
+
+		Counter columnarCounter;
+		ColumnarBuilder::copy(tree)->visit(columnarCounter);
+		ASSERT_EQUALS("columnar visit goes in preorder", columnarCounter.order_, "isis", "");
+
+		Counter emptyCounter;
+		Tree::makePtr<Empty>()->visit(emptyCounter);
+		ASSERT_EQUALS("() is not visited", emptyCounter.order_, "", "");
+	}
+
 	{
 		using namespace Tree;
 
@@ -327,6 +451,1770 @@ public:
 		ASSERT_EQUALS("exampleTree serialization", error, std::string(), error);
 	}
 
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::Arena" << std::endl;
+
+		ASSERT_EQUALS("arena copy of () is ()",
+			ArenaBuilder::copy(Tree::makePtr<Empty>())->toText(), "()", "");
+
+		const auto naiveTree = Tree::makePtr<Int>(42)
+			+ (Tree::makePtr<String>("bar")
+				+ Tree::makePtr<Real>(2.015))
+			+ Tree::makePtr<Int>(-100);
+		const auto arenaTree = ArenaBuilder::copy(naiveTree, 64);
+
+		ASSERT_EQUALS("arena copy toText", arenaTree->toText(), naiveTree->toText(), "");
+		ASSERT_EQUALS("arena copy is equal to naive tree", arenaTree->isEqual(naiveTree), true, "");
+		ASSERT_EQUALS("naive tree is equal to arena copy", naiveTree->isEqual(arenaTree), true, "");
+
+		std::ostringstream expected(std::ios_base::binary);
+		Tree::OStream(&expected).write(naiveTree);
+		std::ostringstream actual(std::ios_base::binary);
+		Tree::OStream(&actual).write(arenaTree);
+		ASSERT_EQUALS("arena tree is written as naive tree", actual.str(), expected.str(), "");
+
+		{
+			ArenaBuilder builder;
+			const int value = 7;
+			builder.add(Type::INT, reinterpret_cast<const char*>(&value), sizeof value, 2);
+			builder.add(Type::INT, reinterpret_cast<const char*>(&value), sizeof value, 0);
+			ASSERT_EQUALS("incomplete arena tree is ()", builder.finish()->toText(), "()", "");
+		}
+		{
+			ArenaBuilder builder(64);
+			const int value = 7;
+			builder.add(Type::INT, reinterpret_cast<const char*>(&value), sizeof value, 0);
+			ASSERT_EQUALS("first arena tree", builder.finish()->toText(), "(int 7)", "");
+			builder.add(Type::INT, reinterpret_cast<const char*>(&value), sizeof value, 0);
+			ASSERT_EQUALS("next arena keeps the block size",
+				(builder.bytesReserved() < Arena::defaultBlockSize), true, "");
+			ASSERT_EQUALS("second arena tree", builder.finish()->toText(), "(int 7)", "");
+		}
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::Columnar" << std::endl;
+
+		const auto naiveTree = Tree::makePtr<Int>(8)
+			+ (Tree::makePtr<String>("bar")
+				+ (Tree::makePtr<Real>(2.015)
+					+ Tree::makePtr<Int>(9))
+				+ Tree::makePtr<Int>(2015))
+			+ Tree::makePtr<String>("baz");
+
+		std::ostringstream output(std::ios_base::binary);
+		Tree::OStream(&output).write(naiveTree);
+
+		std::istringstream input(output.str());
+		ColumnarBuilder builder;
+		ASSERT_EQUALS("IStream reads into columnar builder", Tree::IStream(&input).read(builder), true, "");
+		const auto columnarTree = builder.finish();
+
+		ASSERT_EQUALS("columnar toText", columnarTree->toText(), naiveTree->toText(), "");
+		ASSERT_EQUALS("columnar tree is equal to naive tree", columnarTree->isEqual(naiveTree), true, "");
+
+		const auto root = std::dynamic_pointer_cast<ColumnarNode const>(columnarTree);
+		ASSERT_EQUALS("columnar root subtree size", root->subtreeSize(), 6u, "");
+		ASSERT_EQUALS("columnar second child", root->child(1)->toText(), "(string baz)", "");
+		ASSERT_EQUALS("columnar subtree toText", root->child(0)->toText(),
+			"(string bar(real 2.015000(int 9)int 2015))", "");
+
+		std::ostringstream actual(std::ios_base::binary);
+		Tree::OStream(&actual).write(columnarTree);
+		ASSERT_EQUALS("columnar tree is written as naive tree", actual.str(), output.str(), "");
+
+		std::istringstream truncated(output.str().substr(0, output.str().size() - 2));
+		ColumnarBuilder truncatedBuilder;
+		ASSERT_EQUALS("truncated input is rejected", Tree::IStream(&truncated).read(truncatedBuilder), false, "");
+		ASSERT_EQUALS("truncated input gives ()", truncatedBuilder.finish()->toText(), "()", "");
+
+		std::istringstream arenaInput(output.str());
+		ArenaBuilder arenaBuilder;
+		Tree::IStream(&arenaInput).read(arenaBuilder);
+		ASSERT_EQUALS("IStream reads into arena builder", arenaBuilder.finish()->isEqual(naiveTree), true, "");
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::Mapped" << std::endl;
+
+		const auto naiveTree = Tree::makePtr<Int>(8)
+			+ (Tree::makePtr<String>("bar")
+				+ Tree::makePtr<Real>(2.015))
+			+ Tree::makePtr<String>("");
+		const std::string fileName("mapped.tree");
+		File::saveToFile(fileName, naiveTree);
+
+		const auto mappedTree = Mapped::load(fileName);
+		ASSERT_EQUALS("mapped tree is equal to saved", mappedTree->isEqual(naiveTree), true, "");
+
+		std::ostringstream expected(std::ios_base::binary);
+		Tree::OStream(&expected).write(naiveTree);
+		std::ostringstream actual(std::ios_base::binary);
+		Tree::OStream(&actual).write(mappedTree);
+		ASSERT_EQUALS("mapped tree is written as saved", actual.str(), expected.str(), "");
+
+		const auto content = expected.str();
+		std::ofstream(fileName.c_str()).write(content.data(), content.size() - 3);
+		ASSERT_EQUALS("truncated mapped file gives ()", Mapped::load(fileName)->toText(), "()", "");
+
+		ASSERT_EQUALS("missing mapped file gives ()", Mapped::load("missing.tree")->toText(), "()", "");
+		std::remove(fileName.c_str());
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree deep chain" << std::endl;
+
+		const int depth = 100000;
+		const auto chain = makeChain(depth);
+
+		std::ostringstream output(std::ios_base::binary);
+		Tree::OStream(&output).write(chain);
+		ASSERT_EQUALS("deep chain is written",
+			output.str().size(), depth * (IO<std::ostream>::segmentHeaderSize + sizeof(int)), "");
+
+		std::istringstream input(output.str());
+		const auto loaded = Tree::IStream(&input).read();
+		ASSERT_EQUALS("deep chain is read back", loaded->isEqual(chain), true, "");
+		ASSERT_EQUALS("deep chain is copied to arena", ArenaBuilder::copy(chain)->isEqual(chain), true, "");
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree huge counts from file" << std::endl;
+
+		const auto segment = [](const char signature, const int childrenCount, const int dataSize){
+			std::string bytes(1, signature);
+			bytes.append(reinterpret_cast<const char*>(&childrenCount), sizeof childrenCount);
+			bytes.append(reinterpret_cast<const char*>(&dataSize), sizeof dataSize);
+			return bytes;
+		};
+		const int maxInt = std::numeric_limits<int>::max();
+
+		std::istringstream manyChildren(segment('i', maxInt, sizeof(int)) + std::string(sizeof(int), '\0'));
+		ASSERT_EQUALS("v1 stream with INT_MAX children", IStream(&manyChildren).read()->toText(), "()", "");
+		std::istringstream hugeString(segment('s', 0, maxInt) + "abc");
+		ASSERT_EQUALS("v1 string longer than the stream", IStream(&hugeString).read()->toText(), "()", "");
+		std::istringstream hugeEvent(segment('s', 0, maxInt) + "abc");
+		Event event;
+		ASSERT_EQUALS("event data longer than the stream", EventReader(&hugeEvent).next(event), false, "");
+		const std::string large(3 * (1 << 20) + 5, 'x');
+		std::ostringstream largeOutput(std::ios_base::binary);
+		Tree::OStream(&largeOutput).write(makePtr<String>(large));
+		std::istringstream largeEvent(largeOutput.str());
+		ASSERT_EQUALS("event data read in chunks",
+			(EventReader(&largeEvent).next(event) && event.toString() == large), true, "");
+
+		// Поток без позиции: сумма чисел детей переросла бы int.
+		const std::string fileName("huge.tree");
+		{
+			std::ofstream output(fileName, std::ios_base::binary);
+			for(int i = 0; i < 4; ++i)
+			{
+				output << segment('i', maxInt, sizeof(int)) << std::string(sizeof(int), '\0');
+			}
+		}
+		ASSERT_EQUALS("v1 child counts beyond int", File::loadFromFileAsync(fileName)->toText(), "()", "");
+		ASSERT_EQUALS("v1 child counts beyond int, seekable", File::loadFromFile(fileName)->toText(), "()", "");
+		std::remove(fileName.c_str());
+		DagBuilder dag;
+		ASSERT_EQUALS("dag reserves no INT_MAX children", dag.add(Type::INT, "\0\0\0\0", sizeof(int), maxInt), true, "");
+
+		std::ostringstream compactOutput(std::ios_base::binary);
+		CompactOStream<std::ostream>(&compactOutput).write(makePtr<Int>(1));
+		// Тот же Int, но число детей INT_MAX varint после метки узла.
+		const std::string manyChildrenRoot = compactOutput.str().substr(0, Compact::headerSize)
+			+ static_cast<char>(Compact::INT | (Compact::inlineChildrenLimit << Compact::kindBits))
+			+ "\xff\xff\xff\xff\x07" + std::string(sizeof(int), '\0');
+		std::istringstream compactInput(manyChildrenRoot);
+		Compact::StreamSource compactSource(&compactInput);
+		ASSERT_EQUALS("v2 stream with INT_MAX children",
+			CompactIStream<Compact::StreamSource>(&compactSource).read()->toText(), "()", "");
+		std::istringstream hugeStringInput(compactOutput.str().substr(0, Compact::headerSize)
+			+ static_cast<char>(Compact::STRING) + "\xff\xff\xff\xff\x07" + "abc");
+		Compact::StreamSource hugeStringSource(&hugeStringInput);
+		ASSERT_EQUALS("v2 string longer than the stream",
+			CompactIStream<Compact::StreamSource>(&hugeStringSource).read()->toText(), "()", "");
+		// Те же дети одним массивом в INT_MAX значений, от которых есть только начало.
+		for(const auto array : {Compact::INT_ARRAY, Compact::INT_DELTA_ARRAY, Compact::REAL_ARRAY})
+		{
+			std::istringstream arrayInput(manyChildrenRoot
+				+ static_cast<char>(Compact::ARRAY | (array << Compact::kindBits))
+				+ "\xff\xff\xff\xff\x07" + std::string(16, '\0'));
+			Compact::StreamSource arraySource(&arrayInput);
+			ASSERT_EQUALS("v2 array longer than the stream",
+				CompactIStream<Compact::StreamSource>(&arraySource).read()->toText(), "()", "");
+		}
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::FileSink" << std::endl;
+
+		const auto tree = Tree::makePtr<Int>(42)
+			+ Tree::makePtr<String>(std::string(100, 'x'))
+			+ Tree::makePtr<Real>(7.5)
+			+ Tree::makePtr<String>("asd");
+
+		std::ostringstream expected(std::ios_base::binary);
+		Tree::OStream(&expected).write(tree);
+
+		const std::string fileName("sink.tree");
+		{
+			FileSink sink(fileName, 16);
+			FileOStream(&sink).write(tree);
+			ASSERT_EQUALS("file sink flushes", sink.flush(), true, "");
+		}
+		std::ifstream input(fileName.c_str());
+		std::ostringstream actual(std::ios_base::binary);
+		actual << input.rdbuf();
+		ASSERT_EQUALS("file sink writes same bytes as ostream", actual.str(), expected.str(), "");
+		std::remove(fileName.c_str());
+
+		FileSink missing(std::string("no/such/dir/sink.tree"));
+		ASSERT_EQUALS("file sink reports open failure", static_cast<bool>(missing), false, "");
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::SpanReader" << std::endl;
+
+		const auto tree = Tree::makePtr<Int>(8)
+			+ (Tree::makePtr<String>("bar")
+				+ Tree::makePtr<Real>(2.015))
+			+ Tree::makePtr<String>("");
+		std::ostringstream output(std::ios_base::binary);
+		Tree::OStream(&output).write(tree);
+		const auto bytes = output.str();
+
+		SpanReader reader(bytes);
+		ASSERT_EQUALS("span is read", reader.read()->isEqual(tree), true, "");
+		ASSERT_EQUALS("span is consumed", reader.isFinished(), true, "");
+
+		ColumnarBuilder columnar;
+		ASSERT_EQUALS("span is read into columnar", SpanReader(bytes).read(columnar), true, "");
+		ASSERT_EQUALS("columnar from span", columnar.finish()->isEqual(tree), true, "");
+
+		ASSERT_EQUALS("empty span gives ()", SpanReader(nullptr, 0).read()->toText(), "()", "");
+
+		bool truncatedRejected = true;
+		for(std::size_t size = 0; size < bytes.size(); ++size)
+		{
+			NaiveBuilder builder;
+			truncatedRejected = truncatedRejected && !SpanReader(bytes.data(), size).read(builder);
+		}
+		ASSERT_EQUALS("every truncation is rejected", truncatedRejected, true, "");
+
+		auto corrupt = bytes;
+		const int hugeCount = 1 << 30;
+		std::memcpy(&corrupt[1], &hugeCount, sizeof hugeCount);
+		ASSERT_EQUALS("corrupt children count gives ()", SpanReader(corrupt).read()->toText(), "()", "");
+
+		corrupt = bytes;
+		const int wrongSize = 3;
+		std::memcpy(&corrupt[1 + sizeof(int)], &wrongSize, sizeof wrongSize);
+		ASSERT_EQUALS("corrupt int size gives ()", SpanReader(corrupt).read()->toText(), "()", "");
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::Compact format v2" << std::endl;
+
+		{
+			const int integer = 42;
+			std::ostringstream expected(std::ios_base::binary);
+			expected.write(Compact::magic, sizeof Compact::magic);
+			expected << '\x02' << '\x01';
+			expected.write(reinterpret_cast<const char*>(&integer), sizeof integer);
+
+			std::ostringstream actual(std::ios_base::binary);
+			CompactOStream<std::ostream>(&actual).write(Tree::makePtr<Int>(integer));
+			ASSERT_EQUALS("write v2 (int 42)", actual.str(), expected.str(), "");
+		}
+
+		auto wide = Tree::makePtr<String>("wide");
+		for(int i = 0; i < 100; ++i)
+		{
+			wide + (Tree::makePtr<Int>(i) + Tree::makePtr<Real>(i / 2.0));
+		}
+		const auto tree = Tree::makePtr<Int>(8)
+			+ wide
+			+ Tree::makePtr<String>(std::string(200, 'x'))
+			+ Tree::makePtr<String>("");
+
+		std::ostringstream v1(std::ios_base::binary);
+		Tree::OStream(&v1).write(tree);
+		std::ostringstream v2(std::ios_base::binary);
+		CompactOStream<std::ostream>(&v2).write(tree);
+		ASSERT_EQUALS("v2 is smaller than v1", (v2.str().size() < v1.str().size()), true, "");
+
+		std::istringstream input(v2.str());
+		Compact::StreamSource streamSource(&input);
+		ASSERT_EQUALS("read v2 from stream",
+			CompactIStream<Compact::StreamSource>(&streamSource).read()->isEqual(tree), true, "");
+
+		const auto bytes = v2.str();
+		Compact::SpanSource spanSource(bytes.data(), bytes.size());
+		ASSERT_EQUALS("read v2 from span",
+			CompactIStream<Compact::SpanSource>(&spanSource).read()->isEqual(tree), true, "");
+
+		bool truncatedRejected = true;
+		for(std::size_t size = 0; size < bytes.size(); size += 7)
+		{
+			Compact::SpanSource truncated(bytes.data(), size);
+			NaiveBuilder builder;
+			truncatedRejected = truncatedRejected
+				&& !CompactIStream<Compact::SpanSource>(&truncated).read(builder);
+		}
+		ASSERT_EQUALS("truncated v2 is rejected", truncatedRejected, true, "");
+
+		const std::string fileName("compact.tree");
+		File::saveToFile(fileName, tree, Format::V2);
+		ASSERT_EQUALS("load v2 file", File::loadFromFile(fileName)->isEqual(tree), true, "");
+		ASSERT_EQUALS("map v2 file", Mapped::load(fileName)->isEqual(tree), true, "");
+		File::saveToFile(fileName, tree);
+		ASSERT_EQUALS("load v1 file", File::loadFromFile(fileName)->isEqual(tree), true, "");
+		std::remove(fileName.c_str());
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::ParallelOStream" << std::endl;
+
+		ThreadPool pool(4);
+		const auto checkParallelWrite = [&pool](const char *caseName, TreeConstPtr tree){
+			std::ostringstream expected(std::ios_base::binary);
+			Tree::OStream(&expected).write(tree);
+			std::ostringstream actual(std::ios_base::binary);
+			ParallelOStream<std::ostream>(&actual, &pool).write(tree);
+			ASSERT_EQUALS(caseName, actual.str(), expected.str(), "");
+		};
+
+		checkParallelWrite("parallel write ()", Tree::makePtr<Empty>());
+		checkParallelWrite("parallel write (int 42)", Tree::makePtr<Int>(42));
+		checkParallelWrite("parallel write wide tree", makeWide(1000));
+		checkParallelWrite("parallel write deep chain", makeChain(1000));
+
+		auto bushy = Tree::makePtr<String>("root");
+		for(int i = 0; i < 3; ++i)
+		{
+			auto branch = Tree::makePtr<Real>(i);
+			for(int j = 0; j < 5; ++j)
+			{
+				branch + (Tree::makePtr<Int>(j) + makeWide(j * 10 + 1) + Tree::makePtr<String>("leaf"));
+			}
+			bushy + branch + Tree::makePtr<Int>(i);
+		}
+		checkParallelWrite("parallel write bushy tree", bushy);
+		checkParallelWrite("parallel write columnar bushy tree", ColumnarBuilder::copy(bushy));
+		checkParallelWrite("parallel write columnar wide tree", ColumnarBuilder::copy(makeWide(1000)));
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::ParallelIStream" << std::endl;
+
+		ThreadPool pool(4);
+		const auto checkParallelRead = [&pool](const char *caseName, TreeConstPtr tree){
+			std::ostringstream output(std::ios_base::binary);
+			Tree::OStream(&output).write(tree);
+			const auto bytes = output.str();
+			const auto loaded = ParallelIStream(bytes.data(), bytes.size(), &pool).read();
+			ASSERT_EQUALS(caseName, loaded->isEqual(tree), true, "");
+		};
+
+		checkParallelRead("parallel read ()", Tree::makePtr<Empty>());
+		checkParallelRead("parallel read (int 42)", Tree::makePtr<Int>(42));
+		checkParallelRead("parallel read wide tree", makeWide(1000));
+		checkParallelRead("parallel read deep chain", makeChain(1000));
+
+		auto bushy = Tree::makePtr<String>("root");
+		for(int i = 0; i < 3; ++i)
+		{
+			auto branch = Tree::makePtr<Real>(i);
+			for(int j = 0; j < 5; ++j)
+			{
+				branch + (Tree::makePtr<Int>(j) + makeWide(j * 10 + 1) + Tree::makePtr<String>("leaf"));
+			}
+			bushy + branch + Tree::makePtr<Int>(i);
+		}
+		checkParallelRead("parallel read bushy tree", bushy);
+
+		std::ostringstream compact(std::ios_base::binary);
+		CompactOStream<std::ostream>(&compact).write(bushy);
+		const auto bytes = compact.str();
+		ASSERT_EQUALS("parallel read v2",
+			ParallelIStream(bytes.data(), bytes.size(), &pool).read()->isEqual(bushy), true, "");
+		ASSERT_EQUALS("parallel read of truncated input gives ()",
+			ParallelIStream(bytes.data(), bytes.size() - 1, &pool).read()->toText(), "()", "");
+
+		std::ostringstream deltas(std::ios_base::binary);
+		CompactOStream<std::ostream>(&deltas, Compact::NUMERIC_ARRAYS | Compact::DELTA_ARRAYS).write(bushy);
+		const auto deltaBytes = deltas.str();
+		ASSERT_EQUALS("parallel read v2 with delta arrays",
+			ParallelIStream(deltaBytes.data(), deltaBytes.size(), &pool).read()->isEqual(bushy), true, "");
+		ASSERT_EQUALS("parallel read of truncated delta arrays gives ()",
+			ParallelIStream(deltaBytes.data(), deltaBytes.size() - 1, &pool).read()->toText(), "()", "");
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::EventReader and EventWriter" << std::endl;
+
+		const auto tree = Tree::makePtr<Int>(8)
+			+ (Tree::makePtr<String>("bar")
+				+ (Tree::makePtr<Real>(2.5)
+					+ Tree::makePtr<Int>(9))
+				+ Tree::makePtr<Int>(2015))
+			+ Tree::makePtr<String>("");
+		std::ostringstream output(std::ios_base::binary);
+		Tree::OStream(&output).write(tree);
+
+		struct Summator
+		{
+			void enterNode(const Event &event)
+			{
+				if(event.type_ == Type::INT)
+				{
+					sum_ += event.toInt();
+				}
+				if(event.type_ == Type::STRING)
+				{
+					text_ += event.toString();
+				}
+				maxDepth_ = std::max(maxDepth_, event.depth_);
+			}
+
+			void exitNode(const Event &event)
+			{
+				++exits_;
+			}
+
+			long long sum_ = 0;
+			std::string text_;
+			std::size_t maxDepth_ = 0;
+			int exits_ = 0;
+		};
+
+		{
+			std::istringstream input(output.str());
+			Summator summator;
+			ASSERT_EQUALS("push events are read", EventReader(&input).read(summator), true, "");
+			ASSERT_EQUALS("sum of ints from events", summator.sum_, 8 + 9 + 2015, "");
+			ASSERT_EQUALS("strings from events", summator.text_, "bar", "");
+			ASSERT_EQUALS("max depth from events", summator.maxDepth_, 3u, "");
+			ASSERT_EQUALS("every node is exited", summator.exits_, 6, "");
+		}
+
+		{
+			std::istringstream input(output.str());
+			EventReader reader(&input);
+			std::ostringstream copy(std::ios_base::binary);
+			EventWriter<std::ostream> writer(&copy);
+			Event event;
+			bool isWritten = true;
+			while(reader.next(event))
+			{
+				isWritten = isWritten && (event.kind_ == Event::ENTER
+					? writer.enterNode(event) : writer.exitNode(event));
+			}
+			ASSERT_EQUALS("pull events are read", reader.isComplete(), true, "");
+			ASSERT_EQUALS("events are written", (isWritten && writer.isComplete()), true, "");
+			ASSERT_EQUALS("event copy is byte identical", copy.str(), output.str(), "");
+		}
+
+		{
+			std::istringstream truncated(output.str().substr(0, output.str().size() - 4));
+			Summator summator;
+			ASSERT_EQUALS("truncated events are rejected", EventReader(&truncated).read(summator), false, "");
+		}
+
+		{
+			std::ostringstream sink(std::ios_base::binary);
+			EventWriter<std::ostream> writer(&sink);
+			const int value = 1;
+			writer.enterNode(Type::INT, reinterpret_cast<const char*>(&value), sizeof value, 1);
+			ASSERT_EQUALS("node with missing children can't be exited", writer.exitNode(), false, "");
+			ASSERT_EQUALS("incomplete event tree", writer.isComplete(), false, "");
+		}
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::Lazy" << std::endl;
+
+		const auto tree = Tree::makePtr<Int>(8)
+			+ (Tree::makePtr<String>("bar")
+				+ (Tree::makePtr<Real>(2.5)
+					+ Tree::makePtr<Int>(9))
+				+ Tree::makePtr<Int>(2015))
+			+ Tree::makePtr<String>("")
+			+ Tree::makePtr<Int>(7);
+		const std::string fileName("lazy.tree");
+		ASSERT_EQUALS("tree is saved with index", Lazy::saveToFile(fileName, tree), true, "");
+
+		{
+			const auto lazy = Lazy::open(fileName);
+			const auto root = std::dynamic_pointer_cast<LazyNode const>(lazy);
+			ASSERT_EQUALS("lazy root is opened", (root != nullptr), true, "");
+			ASSERT_EQUALS("children are not decoded on open", root->isLoaded(), false, "");
+			ASSERT_EQUALS("last child is found by index", root->child(2)->toText(), "(int 7)", "");
+			ASSERT_EQUALS("children are decoded on access", root->isLoaded(), true, "");
+			ASSERT_EQUALS("lazy tree is equal to saved", lazy->isEqual(tree), true, "");
+			ASSERT_EQUALS("lazy toText", lazy->toText(), tree->toText(), "");
+		}
+
+		std::remove(Lazy::indexFileName(fileName).c_str());
+		{
+			const auto lazy = Lazy::open(fileName);
+			ASSERT_EQUALS("last child is found without index", lazy->child(2)->toText(), "(int 7)", "");
+			ASSERT_EQUALS("lazy tree without index is equal to saved", lazy->isEqual(tree), true, "");
+		}
+
+		{
+			// Без индекса у цепочки нет соседних поддеревьев, и пропускать нечего.
+			const auto chain = makeChain(1000);
+			Lazy::saveToFile(fileName, chain);
+			std::remove(Lazy::indexFileName(fileName).c_str());
+			const auto lazy = std::dynamic_pointer_cast<LazyNode const>(Lazy::open(fileName));
+			std::size_t count = 0;
+			lazy->visit([&count](Abstract const * ){ ++count; }, [](Abstract const * ){});
+			ASSERT_EQUALS("lazy chain without index is visited", count, 1000u, "");
+			ASSERT_EQUALS("lazy chain without index is not rescanned", lazy->skippedSegments(), 0u, "");
+		}
+		File::saveToFile(fileName, tree);
+		{
+			const auto lazy = std::dynamic_pointer_cast<LazyNode const>(Lazy::open(fileName));
+			lazy->visit([](Abstract const * ){}, [](Abstract const * ){});
+			ASSERT_EQUALS("wide tree without index skips each segment once",
+				(lazy->isEqual(tree) && lazy->skippedSegments() <= 7u), true, "");
+		}
+
+		File::saveToFile(fileName, makePtr<Int>(1) + makePtr<Int>(2));
+		Lazy::writeIndex(fileName);
+		File::saveToFile(fileName, tree);
+		ASSERT_EQUALS("stale index is ignored", Lazy::open(fileName)->isEqual(tree), true, "");
+
+		std::ostringstream output(std::ios_base::binary);
+		Tree::OStream(&output).write(tree);
+		const auto content = output.str();
+		std::ofstream(fileName.c_str()).write(content.data(), content.size() - 3);
+		ASSERT_EQUALS("truncated subtree is read as ()",
+			Lazy::open(fileName)->child(2)->toText(), "()", "");
+		ASSERT_EQUALS("missing lazy file gives ()", Lazy::open("missing.tree")->toText(), "()", "");
+
+		// Число детей больше, чем заголовков сегментов помещается в остаток файла.
+		const int manyChildren = std::numeric_limits<int>::max();
+		const int intSize = sizeof(int);
+		std::string huge("i");
+		huge.append(reinterpret_cast<const char*>(&manyChildren), sizeof manyChildren);
+		huge.append(reinterpret_cast<const char*>(&intSize), sizeof intSize);
+		huge.append(sizeof(int) + 2 * IO<std::istream>::segmentHeaderSize, '\0');
+		std::ofstream(fileName.c_str(), std::ios_base::binary).write(huge.data(), huge.size());
+		ASSERT_EQUALS("lazy node with INT_MAX children gives ()", Lazy::open(fileName)->toText(), "()", "");
+		std::remove(fileName.c_str());
+		std::remove(Lazy::indexFileName(fileName).c_str());
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::Block" << std::endl;
+
+		const auto checkCodec = [](Block::Codec const &codec, const std::string &raw){
+			std::string packed;
+			codec.compress(raw.data(), raw.size(), packed);
+			std::string unpacked(raw.size(), '\0');
+			return codec.decompress(packed.data(), packed.size(), &unpacked[0], raw.size()) && unpacked == raw;
+		};
+		std::string repetitive;
+		for(int i = 0; i < 1000; ++i)
+		{
+			repetitive += "flopa flopa!";
+		}
+		std::string noisy;
+		for(int i = 0; i < 5000; ++i)
+		{
+			noisy.push_back(static_cast<char>((i * 7919) ^ (i >> 3)));
+		}
+		ASSERT_EQUALS("lz round trip of empty data", checkCodec(Block::lz(), ""), true, "");
+		ASSERT_EQUALS("lz round trip of short data", checkCodec(Block::lz(), "abc"), true, "");
+		ASSERT_EQUALS("lz round trip of repetitive data", checkCodec(Block::lz(), repetitive), true, "");
+		ASSERT_EQUALS("lz round trip of noisy data", checkCodec(Block::lz(), noisy), true, "");
+		std::string packed;
+		Block::lz().compress(repetitive.data(), repetitive.size(), packed);
+		ASSERT_EQUALS("lz compresses repetitive data", (packed.size() * 20 < repetitive.size()), true, "");
+		std::string unpacked(repetitive.size(), '\0');
+		packed.resize(packed.size() - 1);
+		ASSERT_EQUALS("truncated lz data is rejected",
+			Block::lz().decompress(packed.data(), packed.size(), &unpacked[0], unpacked.size()), false, "");
+
+		auto tree = makePtr<String>("string string string!");
+		for(int i = 0; i < 3000; ++i)
+		{
+			tree + makePtr<String>("flopa flopa!");
+		}
+		std::ostringstream expected(std::ios_base::binary);
+		Tree::OStream(&expected).write(tree);
+
+		BufferSink buffer;
+		{
+			Block::BlockSink<BufferSink> blocks(&buffer, Block::lz(), 4096);
+			BasicOStream<Block::BlockSink<BufferSink>>(&blocks).write(tree);
+		}
+		const auto &bytes = buffer.buffer();
+		ASSERT_EQUALS("block container is smaller", (bytes.size() * 5 < expected.str().size()), true, "");
+		Block::Reader reader(bytes.data(), bytes.size());
+		ASSERT_EQUALS("block index is read", reader.isValid(), true, "");
+		ASSERT_EQUALS("stream is cut into blocks", reader.blockCount(), (expected.str().size() + 4095) / 4096, "");
+		std::string block(reader.rawSize(2), '\0');
+		ASSERT_EQUALS("single block is read", reader.readBlock(2, &block[0]), true, "");
+		ASSERT_EQUALS("single block is the right part of the stream",
+			block, expected.str().substr(reader.rawOffset(2), block.size()), "");
+		ASSERT_EQUALS("block is found by offset", reader.blockAt(3 * 4096 + 5), 3u, "");
+
+		ThreadPool pool(4);
+		std::string all;
+		ASSERT_EQUALS("blocks are read in parallel", reader.read(all, &pool), true, "");
+		ASSERT_EQUALS("blocks give the stream back", all, expected.str(), "");
+
+		const std::string fileName("block.tree");
+		for(const auto format : {Format::V1, Format::V2})
+		{
+			File::saveToFile(fileName, tree, format, Block::lz());
+			ASSERT_EQUALS("compressed file is loaded", File::loadFromFile(fileName)->isEqual(tree), true, "");
+			ASSERT_EQUALS("compressed file is loaded in parallel",
+				File::loadFromFile(fileName, &pool)->isEqual(tree), true, "");
+			ASSERT_EQUALS("compressed file is mapped", Mapped::load(fileName)->isEqual(tree), true, "");
+		}
+
+		std::ofstream(fileName.c_str()).write(bytes.data(), bytes.size() - 1);
+		ASSERT_EQUALS("truncated container gives ()", File::loadFromFile(fileName)->toText(), "()", "");
+		std::string corrupted = bytes;
+		corrupted[Block::headerSize + 3] ^= 0x55;
+		std::ofstream(fileName.c_str()).write(corrupted.data(), corrupted.size());
+		ASSERT_EQUALS("corrupted block is not loaded as the tree",
+			File::loadFromFile(fileName)->isEqual(tree), false, "");
+		std::remove(fileName.c_str());
+
+		// Контейнер из одного блока в packedSize байт, индекс которого обещает rawSize.
+		const auto container = [](const unsigned char codec, const std::uint32_t rawSize, const std::uint32_t packedSize){
+			std::string bytes(Block::magic, sizeof Block::magic);
+			bytes.push_back(static_cast<char>(Block::version));
+			bytes.append(packedSize, '\0');
+			const std::uint64_t count = 1;
+			const std::uint64_t indexOffset = bytes.size();
+			bytes.push_back(static_cast<char>(codec));
+			bytes.append(reinterpret_cast<const char*>(&rawSize), sizeof rawSize);
+			bytes.append(reinterpret_cast<const char*>(&packedSize), sizeof packedSize);
+			bytes.append(reinterpret_cast<const char*>(&count), sizeof count);
+			bytes.append(reinterpret_cast<const char*>(&indexOffset), sizeof indexOffset);
+			return bytes;
+		};
+		const auto isIndexValid = [](const std::string &bytes){
+			return Block::Reader(bytes.data(), bytes.size()).isValid();
+		};
+		ASSERT_EQUALS("lz block within expansion bound", isIndexValid(container(Block::LzCodec::codecId, 255, 1)), true, "");
+		ASSERT_EQUALS("lz block beyond expansion bound",
+			isIndexValid(container(Block::LzCodec::codecId, Block::maxBlockSize, 1)), false, "");
+		ASSERT_EQUALS("stored block larger than its bytes",
+			isIndexValid(container(Block::StoreCodec::codecId, 2, 1)), false, "");
+		ASSERT_EQUALS("raw bytes from nothing", isIndexValid(container(Block::LzCodec::codecId, 1, 0)), false, "");
+		const auto bogus = container(Block::LzCodec::codecId, 255, 1);
+		std::string bogusRaw("untouched");
+		ASSERT_EQUALS("bogus block is not read", Block::Reader(bogus.data(), bogus.size()).read(bogusRaw), false, "");
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::StringPool and v2 dictionary" << std::endl;
+
+		StringPool pool;
+		const auto first = pool.intern("label");
+		ASSERT_EQUALS("equal strings share storage", (pool.intern(std::string("label")) == first), true, "");
+		ASSERT_EQUALS("different strings don't", (pool.intern("other") == first), false, "");
+		ASSERT_EQUALS("pool size", pool.size(), 2u, "");
+		ASSERT_EQUALS("interned strings are equal",
+			String(first).isEqual(std::make_shared<String>(pool.intern("label"))), true, "");
+		ASSERT_EQUALS("interned string is equal to a plain one",
+			String(first).isEqual(Tree::makePtr<String>("label")), true, "");
+
+		auto tree = Tree::makePtr<String>("root");
+		for(int i = 0; i < 100; ++i)
+		{
+			tree + (Tree::makePtr<String>(i % 2 ? "label" : "another label")
+				+ Tree::makePtr<Int>(i)
+				+ Tree::makePtr<String>("x"));
+		}
+		tree + Tree::makePtr<String>("");
+
+		std::ostringstream plain(std::ios_base::binary);
+		CompactOStream<std::ostream>(&plain).write(tree);
+		std::ostringstream dictionary(std::ios_base::binary);
+		CompactOStream<std::ostream>(&dictionary, Compact::STRING_DICTIONARY).write(tree);
+		ASSERT_EQUALS("dictionary makes repeated strings smaller",
+			(dictionary.str().size() * 3 < plain.str().size() * 2), true, "");
+
+		const auto bytes = dictionary.str();
+		Compact::SpanSource spanSource(bytes.data(), bytes.size());
+		ASSERT_EQUALS("dictionary is read from span",
+			CompactIStream<Compact::SpanSource>(&spanSource).read()->isEqual(tree), true, "");
+		std::istringstream input(bytes);
+		Compact::StreamSource streamSource(&input);
+		ASSERT_EQUALS("dictionary is read from stream",
+			CompactIStream<Compact::StreamSource>(&streamSource).read()->isEqual(tree), true, "");
+		ASSERT_EQUALS("dictionary is mapped", Mapped::view(bytes.data(), bytes.size())->isEqual(tree), true, "");
+
+		StringPool readPool;
+		NaiveBuilder builder(&readPool);
+		Compact::SpanSource pooledSource(bytes.data(), bytes.size());
+		CompactIStream<Compact::SpanSource>(&pooledSource).read(builder);
+		const auto pooled = builder.finish();
+		ASSERT_EQUALS("interning builder builds the same tree", pooled->isEqual(tree), true, "");
+		ASSERT_EQUALS("interning builder shares labels",
+			(pooled->child(0)->bytes().first == pooled->child(2)->bytes().first), true, "");
+		ASSERT_EQUALS("read pool holds distinct strings", readPool.size(), 5u, "");
+
+		const std::string fileName("dictionary.tree");
+		File::saveToFile(fileName, tree, Format::V2_DICTIONARY);
+		ASSERT_EQUALS("dictionary file is loaded", File::loadFromFile(fileName)->isEqual(tree), true, "");
+		std::remove(fileName.c_str());
+
+		std::string badReference(Compact::magic, sizeof Compact::magic);
+		badReference += static_cast<char>(Compact::version);
+		badReference += std::string("\0\1\2ab", 5);
+		badReference += static_cast<char>(Compact::STRING_REF);
+		badReference += '\1';
+		Compact::SpanSource badSource(badReference.data(), badReference.size());
+		ASSERT_EQUALS("reference out of dictionary is rejected",
+			CompactIStream<Compact::SpanSource>(&badSource).read()->toText(), "()", "");
+		badReference.back() = '\0';
+		Compact::SpanSource goodSource(badReference.data(), badReference.size());
+		ASSERT_EQUALS("reference into dictionary is read",
+			CompactIStream<Compact::SpanSource>(&goodSource).read()->toText(), "(string ab)", "");
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::DagBuilder and v2 subtree references" << std::endl;
+
+		const auto tree = makeConfig(50);
+		const auto dag = DagBuilder::copy(tree);
+		ASSERT_EQUALS("dag is equal to the tree", dag->isEqual(tree), true, "");
+		ASSERT_EQUALS("identical subtrees are shared", (dag->child(0) == dag->child(48)), true, "");
+		ASSERT_EQUALS("identical leaves are shared",
+			(dag->child(0)->child(1)->child(0) == dag->child(3)->child(1)->child(0)), true, "");
+		ASSERT_EQUALS("different subtrees are not shared", (dag->child(0) == dag->child(1)), false, "");
+
+		DagBuilder counter;
+		tree->visit([&counter](Abstract const * node){
+			const auto [data, dataSize] = node->bytes();
+			counter.add(node->type(), data, dataSize, node->childrenCount());
+		}, [](Abstract const * ){});
+		ASSERT_EQUALS("unique subtrees are counted", counter.uniqueCount(), 14u, "");
+
+		std::ostringstream plain(std::ios_base::binary);
+		CompactOStream<std::ostream>(&plain).write(dag);
+		std::ostringstream shared(std::ios_base::binary);
+		CompactOStream<std::ostream>(&shared, Compact::optionsFor(Format::V2_DAG)).write(dag);
+		ASSERT_EQUALS("shared subtrees are written once",
+			(shared.str().size() * 10 < plain.str().size()), true, "");
+
+		const auto bytes = shared.str();
+		Compact::SpanSource expandSource(bytes.data(), bytes.size());
+		const auto expanded = CompactIStream<Compact::SpanSource>(&expandSource).read();
+		ASSERT_EQUALS("references are expanded", expanded->isEqual(tree), true, "");
+		ASSERT_EQUALS("expanded subtrees are not shared", (expanded->child(0) == expanded->child(48)), false, "");
+
+		Compact::SpanSource shareSource(bytes.data(), bytes.size());
+		const auto read = CompactIStream<Compact::SpanSource>(&shareSource).readShared();
+		ASSERT_EQUALS("references are read shared", read->isEqual(tree), true, "");
+		ASSERT_EQUALS("read subtrees are shared", (read->child(0) == read->child(48)), true, "");
+
+		std::istringstream input(bytes);
+		Compact::StreamSource streamSource(&input);
+		ASSERT_EQUALS("references are expanded from stream",
+			CompactIStream<Compact::StreamSource>(&streamSource).read()->isEqual(tree), true, "");
+		ASSERT_EQUALS("references are mapped", Mapped::view(bytes.data(), bytes.size())->isEqual(tree), true, "");
+
+		const std::string fileName("dag.tree");
+		File::saveToFile(fileName, dag, Format::V2_DAG);
+		ASSERT_EQUALS("dag file is loaded", File::loadFromFile(fileName)->isEqual(tree), true, "");
+		std::remove(fileName.c_str());
+
+		// Каждый уровень дважды ссылается на предыдущий: 2^41 узлов после разворачивания.
+		auto bomb = makePtr<Int>(0);
+		for(int i = 1; i <= 40; ++i)
+		{
+			bomb = makePtr<Int>(i) + bomb + bomb;
+		}
+		std::ostringstream bombOutput(std::ios_base::binary);
+		CompactOStream<std::ostream>(&bombOutput, Compact::SUBTREE_REFERENCES).write(bomb);
+		const auto bombBytes = bombOutput.str();
+		Compact::SpanSource bombSource(bombBytes.data(), bombBytes.size());
+		ASSERT_EQUALS("expansion is limited",
+			CompactIStream<Compact::SpanSource>(&bombSource, 100000).read()->toText(), "()", "");
+		Compact::SpanSource sharedBombSource(bombBytes.data(), bombBytes.size());
+		const auto sharedBomb = CompactIStream<Compact::SpanSource>(&sharedBombSource).readShared();
+		// Хеш хранят только замороженные деревья, иначе он обходит все 2^41 узла.
+		bomb->freeze();
+		ASSERT_EQUALS("shared read is not expanded", (sharedBomb->structuralHash() == bomb->structuralHash()), true, "");
+
+		std::string header(Compact::magic, sizeof Compact::magic);
+		header += static_cast<char>(Compact::version);
+		header += static_cast<char>(Compact::SECTION | (Compact::SUBTREES << Compact::kindBits));
+		const std::string openReference = header
+			+ static_cast<char>(Compact::INT | (1 << Compact::kindBits)) + std::string(sizeof(int), '\0')
+			+ static_cast<char>(Compact::SUBTREE_REF) + '\0';
+		Compact::SpanSource openSource(openReference.data(), openReference.size());
+		ASSERT_EQUALS("reference to an open subtree is rejected",
+			CompactIStream<Compact::SpanSource>(&openSource).read()->toText(), "()", "");
+		const std::string missingReference = header
+			+ static_cast<char>(Compact::INT | (2 << Compact::kindBits)) + std::string(sizeof(int), '\0')
+			+ static_cast<char>(Compact::INT) + std::string(sizeof(int), '\0')
+			+ static_cast<char>(Compact::SUBTREE_REF) + '\5';
+		Compact::SpanSource missingSource(missingReference.data(), missingReference.size());
+		ASSERT_EQUALS("reference out of range is rejected",
+			CompactIStream<Compact::SpanSource>(&missingSource).readShared()->toText(), "()", "");
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::Stats" << std::endl;
+
+		const auto tree = makePtr<String>("a") + (makePtr<Int>(1) + makePtr<Real>(2.0));
+		Stats::reset();
+		std::ostringstream output(std::ios_base::binary);
+		OStream(&output).write(tree);
+		const auto bytes = output.str();
+		const std::uint64_t written = Stats::enabled ? bytes.size() : 0;
+		ASSERT_EQUALS("segments are counted", Stats::value(Stats::Counter::SEGMENTS), (Stats::enabled ? 3u : 0u), "");
+		ASSERT_EQUALS("writes are counted", Stats::value(Stats::Counter::WRITES), (Stats::enabled ? 12u : 0u), "");
+		ASSERT_EQUALS("bytes written are counted", Stats::value(Stats::Counter::BYTES_WRITTEN), written, "");
+		ASSERT_EQUALS("depth is counted", Stats::value(Stats::Counter::MAX_DEPTH), (Stats::enabled ? 3u : 0u), "");
+
+		Stats::reset();
+		std::istringstream input(bytes);
+		ASSERT_EQUALS("tree is read with stats", IStream(&input).read()->isEqual(tree), true, "");
+		ASSERT_EQUALS("bytes read are counted", Stats::value(Stats::Counter::BYTES_READ), written, "");
+		ASSERT_EQUALS("allocations are counted",
+			Stats::value(Stats::Counter::ALLOCATIONS), (Stats::enabled ? 6u : 0u), "");
+
+		Stats::reset();
+		const char data[sizeof(double)] = {};
+		ASSERT_EQUALS("node of wrong size is rejected", (NaiveBuilder::makeNode(Type::INT, data, 3) == nullptr), true, "");
+		ASSERT_EQUALS("invalid node is rejected", (NaiveBuilder::makeNode(Type::INVALID, data, 0) == nullptr), true, "");
+		ASSERT_EQUALS("rejected nodes are not counted", Stats::value(Stats::Counter::ALLOCATIONS), 0u, "");
+		Stats::reset();
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::Async" << std::endl;
+
+		const auto tree = makeConfig(20);
+		const std::string fileName("async.tree");
+		{
+			// Маленькие буферы, чтобы кольцо много раз прошло по кругу.
+			Async::FileSink sink(fileName, 7, 2);
+			BasicOStream<Async::FileSink>(&sink).write(tree);
+			ASSERT_EQUALS("async sink is flushed", sink.flush(), true, "");
+		}
+		ASSERT_EQUALS("async sink writes the tree", File::loadFromFile(fileName)->isEqual(tree), true, "");
+		{
+			Async::ReadBuffer buffer(fileName, 5, 2);
+			std::istream input(&buffer);
+			ASSERT_EQUALS("async buffer reads the tree", IStream(&input).read()->isEqual(tree), true, "");
+		}
+		{
+			Async::ReadBuffer buffer(fileName, 5, 2);
+			std::istream input(&buffer);
+			input.get();
+			ASSERT_EQUALS("async buffer is released unread", input.good(), true, "");
+		}
+
+		for(const auto format : {Format::V1, Format::V2, Format::V2_DICTIONARY})
+		{
+			ASSERT_EQUALS("async save", File::saveToFileAsync(fileName, tree, format), true, "");
+			ASSERT_EQUALS("async load", File::loadFromFileAsync(fileName)->isEqual(tree), true, "");
+		}
+		File::saveToFile(fileName, tree, Format::V2, Block::lz());
+		ASSERT_EQUALS("async load of blocks", File::loadFromFileAsync(fileName)->isEqual(tree), true, "");
+		std::remove(fileName.c_str());
+
+		ASSERT_EQUALS("async load of missing file", File::loadFromFileAsync(fileName)->toText(), "()", "");
+		ASSERT_EQUALS("async save to missing directory",
+			File::saveToFileAsync("missing/async.tree", tree), false, "");
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree construction by move" << std::endl;
+
+		std::string label(40, 'x');
+		const auto labelData = label.data();
+		const auto string = makePtr<String>(std::move(label));
+		ASSERT_EQUALS("makePtr moves the string",
+			(static_cast<String const*>(string.get())->data().data() == labelData), true, "");
+
+		auto child = makePtr<Int>(1);
+		const auto parent = makeParent<Int>(2, 0) + std::move(child) + makePtr<Real>(2.5);
+		ASSERT_EQUALS("operator + takes the moved child", (child == nullptr), true, "");
+		ASSERT_EQUALS("parent is built", parent->toText(), "(int 0(int 1real 2.500000))", "");
+
+		NaiveBuilder builder;
+		ASSERT_EQUALS("emplace parent", builder.emplace<String>(2, "root"), true, "");
+		ASSERT_EQUALS("emplace leaf", builder.emplace<Int>(0, 1), true, "");
+		ASSERT_EQUALS("emplace moved string", builder.emplace<String>(0, std::string(40, 'y')), true, "");
+		ASSERT_EQUALS("emplace after root is rejected", builder.emplace<Int>(0, 2), false, "");
+		ASSERT_EQUALS("emplaced tree is complete", builder.isComplete(), true, "");
+		ASSERT_EQUALS("emplaced tree",
+			builder.finish()->isEqual(makePtr<String>("root") + makePtr<Int>(1) + makePtr<String>(std::string(40, 'y'))), true, "");
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "v2 numeric arrays" << std::endl;
+
+		const std::vector<std::int32_t> extremes{INT_MIN, INT_MAX, -1, 0, 1, INT_MAX, INT_MIN};
+		std::vector<std::uint32_t> encoded(2);
+		Compact::encodeDeltas(extremes.data(), encoded.data(), 2);
+		ASSERT_EQUALS("zigzag of INT_MIN", encoded[0], 0xffffffffu, "");
+		ASSERT_EQUALS("zigzag of delta wraps", encoded[1], 1u, "");
+		bool isRoundTrip = true;
+		std::vector<std::int32_t> values;
+		for(std::size_t count = 0; count < 40; ++count)
+		{
+			values.assign(extremes.begin(), extremes.end());
+			for(std::size_t i = extremes.size(); i < count; ++i)
+			{
+				values.push_back(static_cast<std::int32_t>(std::rand()) - RAND_MAX / 2);
+			}
+			values.resize(count);
+			encoded.assign(count, 0);
+			std::vector<std::int32_t> decoded(count);
+			Compact::encodeDeltas(values.data(), encoded.data(), count);
+			Compact::decodeDeltas(encoded.data(), decoded.data(), count);
+			isRoundTrip = isRoundTrip && decoded == values;
+		}
+		ASSERT_EQUALS("deltas round trip", isRoundTrip, true, "");
+
+		auto tree = makeWide(100) + makePtr<String>("tail")
+			+ makePtr<Int>(1) + makePtr<Int>(2)
+			+ (makePtr<Int>(3) + makePtr<Real>(0.5) + makePtr<Real>(1.5) + makePtr<Real>(2.5) + makePtr<Real>(3.5));
+		for(int i = 0; i < 10; ++i)
+		{
+			tree + makePtr<Int>(1000000 * i);
+		}
+		std::ostringstream plainOutput(std::ios_base::binary);
+		CompactOStream<std::ostream>(&plainOutput).write(tree);
+		std::ostringstream arrayOutput(std::ios_base::binary);
+		CompactOStream<std::ostream>(&arrayOutput, Compact::NUMERIC_ARRAYS).write(tree);
+		std::ostringstream deltaOutput(std::ios_base::binary);
+		CompactOStream<std::ostream>(&deltaOutput, Compact::NUMERIC_ARRAYS | Compact::DELTA_ARRAYS).write(tree);
+		const auto plain = plainOutput.str();
+		const auto array = arrayOutput.str();
+		const auto delta = deltaOutput.str();
+		ASSERT_EQUALS("arrays are smaller", (array.size() < plain.size()), true, "");
+		ASSERT_EQUALS("delta arrays are smaller", (delta.size() * 2 < array.size()), true, "");
+
+		for(const auto &bytes : {array, delta})
+		{
+			Compact::SpanSource spanSource(bytes.data(), bytes.size());
+			ASSERT_EQUALS("arrays are read", CompactIStream<Compact::SpanSource>(&spanSource).read()->isEqual(tree), true, "");
+			std::istringstream input(bytes);
+			Compact::StreamSource streamSource(&input);
+			ASSERT_EQUALS("arrays are read from stream",
+				CompactIStream<Compact::StreamSource>(&streamSource).read()->isEqual(tree), true, "");
+			ASSERT_EQUALS("arrays are mapped", Mapped::view(bytes.data(), bytes.size())->isEqual(tree), true, "");
+			Compact::SpanSource sharedSource(bytes.data(), bytes.size());
+			ASSERT_EQUALS("arrays are read shared",
+				CompactIStream<Compact::SpanSource>(&sharedSource).readShared()->isEqual(tree), true, "");
+		}
+
+		const std::string fileName("arrays.tree");
+		File::saveToFile(fileName, tree, Format::V2);
+		ASSERT_EQUALS("v2 file with arrays is loaded", File::loadFromFile(fileName)->isEqual(tree), true, "");
+		ASSERT_EQUALS("v2 file with arrays is mapped", Mapped::load(fileName)->isEqual(tree), true, "");
+		std::remove(fileName.c_str());
+
+		std::string header(Compact::magic, sizeof Compact::magic);
+		header += static_cast<char>(Compact::version);
+		const std::string parent = header + static_cast<char>(Compact::INT | (2 << Compact::kindBits)) + std::string(sizeof(int), '\0');
+		const auto ints = static_cast<char>(Compact::ARRAY | (Compact::INT_ARRAY << Compact::kindBits));
+		const std::string good = parent + ints + '\2' + std::string(2 * sizeof(int), '\0');
+		Compact::SpanSource goodSource(good.data(), good.size());
+		ASSERT_EQUALS("handmade array is read",
+			CompactIStream<Compact::SpanSource>(&goodSource).read()->toText(), "(int 0(int 0int 0))", "");
+		const std::string tooLong = parent + ints + '\3' + std::string(3 * sizeof(int), '\0');
+		Compact::SpanSource tooLongSource(tooLong.data(), tooLong.size());
+		ASSERT_EQUALS("array longer than its parent is rejected",
+			CompactIStream<Compact::SpanSource>(&tooLongSource).read()->toText(), "()", "");
+		const std::string truncated = parent + ints + '\2' + std::string(sizeof(int), '\0');
+		Compact::SpanSource truncatedSource(truncated.data(), truncated.size());
+		ASSERT_EQUALS("truncated array is rejected",
+			CompactIStream<Compact::SpanSource>(&truncatedSource).read()->toText(), "()", "");
+		const std::string shared = header + static_cast<char>(Compact::SECTION | (Compact::SUBTREES << Compact::kindBits))
+			+ static_cast<char>(Compact::INT | (2 << Compact::kindBits)) + std::string(sizeof(int), '\0')
+			+ ints + '\2' + std::string(2 * sizeof(int), '\0');
+		Compact::SpanSource sharedSource(shared.data(), shared.size());
+		ASSERT_EQUALS("array with subtree references is rejected",
+			CompactIStream<Compact::SpanSource>(&sharedSource).read()->toText(), "()", "");
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::Delta" << std::endl;
+
+		auto service = makePtr<String>("service") + makePtr<String>("host");
+		auto tree = makeConfig(10) + service;
+		const std::string baseFileName("delta.tree");
+		const std::string firstFileName("delta.tree.1");
+		const std::string secondFileName("delta.tree.2");
+		const std::string thirdFileName("delta.tree.3");
+		ASSERT_EQUALS("delta needs a saved base", Delta::save(firstFileName, tree), false, "");
+		ASSERT_EQUALS("base is saved", Delta::saveBase(baseFileName, tree), true, "");
+		ASSERT_EQUALS("saved tree is clean", static_cast<Naive const*>(tree.get())->isDirty(), false, "");
+
+		tree + (makePtr<String>("added") + makePtr<Int>(1));
+		service + makePtr<Int>(8080);
+		ASSERT_EQUALS("edited tree is dirty", static_cast<Naive const*>(tree.get())->isDirty(), true, "");
+		ASSERT_EQUALS("first delta is saved", Delta::save(firstFileName, tree), true, "");
+		const auto firstText = tree->toText();
+
+		service + makePtr<Real>(2.5);
+		ASSERT_EQUALS("second delta is saved", Delta::save(secondFileName, tree), true, "");
+		ASSERT_EQUALS("delta without edits is saved", Delta::save(thirdFileName, tree), true, "");
+
+		std::ifstream first(firstFileName, std::ios_base::binary | std::ios_base::ate);
+		std::ifstream empty(thirdFileName, std::ios_base::binary | std::ios_base::ate);
+		ASSERT_EQUALS("delta holds only the edit", (first.tellg() < 100), true, "");
+		ASSERT_EQUALS("delta without edits is a header", static_cast<std::size_t>(empty.tellg()), Delta::headerSize, "");
+
+		ASSERT_EQUALS("first delta is applied",
+			Delta::load(baseFileName, {firstFileName})->toText(), firstText, "");
+		auto loaded = Delta::load(baseFileName, {firstFileName, secondFileName, thirdFileName});
+		ASSERT_EQUALS("delta chain is applied", loaded->isEqual(tree), true, "");
+		ASSERT_EQUALS("delta out of order is rejected",
+			Delta::load(baseFileName, {secondFileName})->toText(), "()", "");
+
+		loaded + makePtr<String>("after load");
+		ASSERT_EQUALS("delta after load is saved", Delta::save(thirdFileName, loaded), true, "");
+		ASSERT_EQUALS("delta after load is applied",
+			Delta::load(baseFileName, {firstFileName, secondFileName, thirdFileName})->isEqual(loaded), true, "");
+
+		std::string truncated;
+		{
+			std::ifstream input(secondFileName, std::ios_base::binary);
+			truncated.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+		}
+		truncated.pop_back();
+		{
+			std::ofstream output(secondFileName, std::ios_base::binary);
+			output << truncated;
+		}
+		ASSERT_EQUALS("truncated delta is rejected",
+			Delta::load(baseFileName, {firstFileName, secondFileName})->toText(), "()", "");
+
+		for(const auto &fileName : {baseFileName, firstFileName, secondFileName, thirdFileName})
+		{
+			std::remove(fileName.c_str());
+		}
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::writeText and printText" << std::endl;
+
+		for(const double value : {0.0, -0.0, 2.5, -1.0 / 3, 1e-7, 123456.789, 1e300, -1.7976931348623157e308})
+		{
+			ASSERT_EQUALS(("real " + std::to_string(value)).c_str(),
+				makePtr<Real>(value)->toText(), "(real " + std::to_string(value) + ")", "");
+		}
+		for(const int value : {0, -1, 2147483647, -2147483647 - 1})
+		{
+			ASSERT_EQUALS(("int " + std::to_string(value)).c_str(),
+				makePtr<Int>(value)->toText(), "(int " + std::to_string(value) + ")", "");
+		}
+		const std::string large(20000, 'x');
+		ASSERT_EQUALS("string longer than the buffer",
+			(makePtr<String>("a") + makePtr<String>(large))->toText(), "(string a(string " + large + "))", "");
+
+		const auto tree = makeWide(5000);
+		std::ostringstream text;
+		tree->writeText(text);
+		ASSERT_EQUALS("writeText to a stream", (text.str() == tree->toText()), true, "");
+		ASSERT_EQUALS("toText with node count", (tree->toText(5001) == tree->toText()), true, "");
+
+		std::ostringstream printed;
+		(makePtr<Int>(1) + (makePtr<Real>(2.5) + makePtr<String>("s")) + makePtr<Int>(-3))->printText(printed);
+		ASSERT_EQUALS("printText", printed.str(), "int 1\n+real 2.500000\n\t+string s\n+int -3\n", "");
+
+		std::ostringstream empty;
+		makePtr<Empty>()->printText(empty);
+		ASSERT_EQUALS("printText of empty tree", empty.str(), "", "");
+
+		const int depth = 3000;
+		std::ostringstream deep;
+		makeChain(depth)->printText(deep);
+		std::size_t lines = 0;
+		std::size_t tabs = 0;
+		for(const auto c : deep.str())
+		{
+			lines += c == '\n';
+			tabs += c == '\t';
+		}
+		ASSERT_EQUALS("printText of deep chain lines", lines, static_cast<std::size_t>(depth), "");
+		ASSERT_EQUALS("printText of deep chain tabs", tabs, static_cast<std::size_t>(depth - 1) * (depth - 2) / 2, "");
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::TextReader" << std::endl;
+
+		const auto labels = makePtr<String>("quote \" backslash \\ (parens) int 1")
+			+ (makePtr<String>("") + makePtr<String>("line\nbreak") + makePtr<Int>(-2147483647 - 1))
+			+ (makePtr<Real>(0.1) + makePtr<Real>(1e300) + makePtr<Real>(-2.5e-310))
+			+ makePtr<String>("\\\"");
+		const auto quoted = labels->toQuotedText();
+		ASSERT_EQUALS("quoted text", quoted.substr(0, 47), R"((string "quote \" backslash \\ (parens) int 1"()", "");
+		ASSERT_EQUALS("quoted text round trip", TextReader(quoted).read()->isEqual(labels), true, "");
+		const auto configText = makeConfig(10)->toQuotedText();
+		ASSERT_EQUALS("config round trip", TextReader(configText).read()->isEqual(makeConfig(10)), true, "");
+
+		const auto numbers = makePtr<Int>(42) + (makePtr<Int>(100) + makePtr<Real>(2.5)) + makePtr<Int>(333);
+		const auto numbersText = numbers->toText();
+		ASSERT_EQUALS("toText without strings", TextReader(numbersText).read()->isEqual(numbers), true, "");
+		const std::string spaced(" ( int 42 (\n\tint 100 ( real 2.5 )\n\tint 333\n) )\n");
+		ASSERT_EQUALS("spaces between tokens", TextReader(spaced).read()->isEqual(numbers), true, "");
+
+		const std::string emptyText("()");
+		TextReader empty(emptyText);
+		NaiveBuilder emptyBuilder;
+		ASSERT_EQUALS("empty tree is read", empty.read(emptyBuilder), true, "");
+		ASSERT_EQUALS("empty tree", emptyBuilder.finish()->isEmpty(), true, "");
+
+		for(const char *text : {"", "(", "(int 1", "(int 1(", "(int 1()", "(int 1())", "(int 1 int 2)",
+			"(int 1(int 2)(int 3))", "(int x)", "(int 99999999999)", "(real)", "(string a)",
+			"(string \"a)", "(string \"a\\n\")", "(string \"a\\", "(float 1)", "(int 1) x", "(int 1)(int 2)", "() ()"})
+		{
+			const std::string input(text);
+			TextReader reader(input);
+			NaiveBuilder builder;
+			ASSERT_EQUALS(("rejected: " + std::string(text)).c_str(), reader.read(builder), false, "");
+		}
+		const std::string trailing("(int 1)(int 2)");
+		ASSERT_EQUALS("trailing tree gives ()", TextReader(trailing).read()->toText(), "()", "");
+
+		const auto chain = makeChain(100000);
+		const auto chainText = chain->toQuotedText();
+		ASSERT_EQUALS("deep chain round trip", TextReader(chainText).read()->isEqual(chain), true, "");
+
+		TextReader arenaReader(quoted);
+		ArenaBuilder arena;
+		ASSERT_EQUALS("read into arena", (arenaReader.read(arena) && arena.finish()->isEqual(labels)), true, "");
+		const auto config = makeConfig(10)->toQuotedText();
+		TextReader dagReader(config);
+		DagBuilder dag;
+		ASSERT_EQUALS("read into dag", (dagReader.read(dag) && dag.finish()->isEqual(makeConfig(10))), true, "");
+
+		const std::string fileName("text.tree");
+		ASSERT_EQUALS("save text file", File::saveToTextFile(fileName, labels), true, "");
+		ASSERT_EQUALS("load text file", File::loadFromTextFile(fileName)->isEqual(labels), true, "");
+		{
+			std::ofstream output(fileName);
+			output << "(int 1) garbage";
+		}
+		ASSERT_EQUALS("text file with garbage", File::loadFromTextFile(fileName)->isEmpty(), true, "");
+		std::remove(fileName.c_str());
+	}
+
+	{
+		using namespace Tree;
+
+		std::cout << std::endl << "Tree::Persistent" << std::endl;
+
+		const TreeConstPtr tree = makePtr<Int>(1) + (makePtr<Int>(2) + makePtr<Int>(3)) + makePtr<Int>(4);
+		const auto added = Persistent::withChild(tree, {0}, makePtr<Int>(5));
+		ASSERT_EQUALS("withChild", added->toText(), "(int 1(int 2(int 3int 5)int 4))", "");
+		ASSERT_EQUALS("original is unchanged", tree->toText(), "(int 1(int 2(int 3)int 4))", "");
+		ASSERT_EQUALS("unchanged subtree is shared", (added->child(1) == tree->child(1)), true, "");
+		ASSERT_EQUALS("changed path is copied", (added->child(0) != tree->child(0)), true, "");
+		ASSERT_EQUALS("withSubtree",
+			Persistent::withSubtree(tree, {1}, makePtr<String>("x"))->toText(), "(int 1(int 2(int 3)string x))", "");
+		ASSERT_EQUALS("withSubtree at root", Persistent::withSubtree(tree, {}, makePtr<Int>(7))->toText(), "(int 7)", "");
+		ASSERT_EQUALS("withoutSubtree", Persistent::withoutSubtree(tree, {0, 0})->toText(), "(int 1(int 2int 4))", "");
+		ASSERT_EQUALS("withoutSubtree at root", (Persistent::withoutSubtree(tree, {})->type() == Type::INVALID), true, "");
+		ASSERT_EQUALS("path past children", (Persistent::withChild(tree, {2}, makePtr<Int>(5))->type() == Type::INVALID), true, "");
+		ASSERT_EQUALS("negative path", (Persistent::withoutSubtree(tree, {-1})->type() == Type::INVALID), true, "");
+		ASSERT_EQUALS("empty child", (Persistent::withChild(tree, {}, makePtr<Empty>())->type() == Type::INVALID), true, "");
+
+		auto arena = ArenaBuilder::copy(tree);
+		const auto fromArena = Persistent::withChild(arena, {0}, makePtr<Int>(5));
+		arena.reset();
+		ASSERT_EQUALS("arena siblings outlive the arena root", fromArena->toText(), added->toText(), "");
+
+		AtomicTree empty;
+		ASSERT_EQUALS("atomic tree starts empty", (empty.load()->type() == Type::INVALID), true, "");
+		empty.publish(tree);
+		ASSERT_EQUALS("atomic tree publish", (empty.load() == tree), true, "");
+
+		// Писатели по очереди добавляют корню ребёнка с его номером,
+		// читатели проверяют, что снимок целый и не старее прежнего.
+		AtomicTree root(makePtr<Int>(0));
+		const int updateCount = 1000;
+		std::atomic<bool> isDone{false};
+		std::atomic<int> violations{0};
+		std::vector<std::thread> readers;
+		for(int i = 0; i < 4; ++i)
+		{
+			readers.emplace_back([&](){
+				int seen = 0;
+				while(!isDone.load())
+				{
+					const auto snapshot = root.load();
+					const auto count = snapshot->childrenCount();
+					int last = count - 1;
+					if(count > 0)
+					{
+						std::memcpy(&last, snapshot->child(count - 1)->bytes().first, sizeof last);
+					}
+					violations += count < seen || last != count - 1;
+					seen = count;
+				}
+			});
+		}
+		std::vector<std::thread> writers;
+		for(int i = 0; i < 2; ++i)
+		{
+			writers.emplace_back([&](){
+				for(int j = 0; j < updateCount; ++j)
+				{
+					root.update([](TreeConstPtr current){
+						return Persistent::withChild(current, {}, makePtr<Int>(current->childrenCount()));
+					});
+				}
+			});
+		}
+		for(auto &writer : writers)
+		{
+			writer.join();
+		}
+		isDone = true;
+		for(auto &reader : readers)
+		{
+			reader.join();
+		}
+		ASSERT_EQUALS("concurrent updates are all published", root.load()->childrenCount(), 2 * updateCount, "");
+		ASSERT_EQUALS("readers see whole snapshots", violations.load(), 0, "");
+	}
+
+	}
+
+	/// Повторяющаяся конфигурация: count сервисов, у каждого
+	/// одна из трёх одинаковых настроек.
+	static Tree::TreePtr makeConfig(const int count)
+	{
+		using namespace Tree;
+
+		auto config = makePtr<String>("config");
+		for(int i = 0; i < count; ++i)
+		{
+			config + (makePtr<String>("service")
+				+ (makePtr<String>("host") + makePtr<String>("localhost"))
+				+ (makePtr<String>("port") + makePtr<Int>(8080 + i % 3))
+				+ (makePtr<String>("timeout") + makePtr<Real>(2.5)));
+		}
+		return config;
+	}
+
+	static Tree::TreePtr makeChain(const int depth)
+	{
+		using namespace Tree;
+
+		auto chain = makePtr<Int>(0);
+		for(int i = 1; i < depth; ++i)
+		{
+			auto parent = makePtr<Int>(i);
+			parent + chain;
+			chain = parent;
+		}
+		return chain;
+	}
+
+	static Tree::TreePtr makeWide(const int width)
+	{
+		using namespace Tree;
+
+		auto wide = makePtr<Int>(0);
+		for(int i = 1; i < width; ++i)
+		{
+			wide + makePtr<Int>(i);
+		}
+		return wide;
+	}
+
+	template <class F>
+	static void measure(const char *caseName, F f)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		f();
+		const auto finish = std::chrono::steady_clock::now();
+		std::cout << caseName << ": "
+			<< std::chrono::duration_cast<std::chrono::milliseconds>(finish - start).count()
+			<< " ms" << std::endl;
+	}
+
+	static void runIOBenchmark(const int size)
+	{
+		using namespace Tree;
+
+		for(const auto shape : {"deep", "wide"})
+		{
+			TreePtr tree;
+			std::string bytes;
+			measure((std::string(shape) + " build").c_str(), [&](){
+				tree = std::string(shape) == "deep" ? makeChain(size) : makeWide(size);
+			});
+			measure((std::string(shape) + " write").c_str(), [&](){
+				std::ostringstream output(std::ios_base::binary);
+				Tree::OStream(&output).write(tree);
+				bytes = output.str();
+			});
+			measure((std::string(shape) + " write ofstream").c_str(), [&](){
+				std::ofstream output("benchmark.tree");
+				Tree::OStream(&output).write(tree);
+			});
+			measure((std::string(shape) + " write file sink").c_str(), [&](){
+				FileSink sink(std::string("benchmark.tree"));
+				FileOStream(&sink).write(tree);
+			});
+			measure((std::string(shape) + " write file async").c_str(), [&](){
+				File::saveToFileAsync("benchmark.tree", tree);
+			});
+			measure((std::string(shape) + " read file").c_str(), [&](){
+				File::loadFromFile("benchmark.tree");
+			});
+			measure((std::string(shape) + " read file async").c_str(), [&](){
+				File::loadFromFileAsync("benchmark.tree");
+			});
+			std::remove("benchmark.tree");
+			for(const unsigned threads : {1u, 2u, 4u, 8u, 16u})
+			{
+				ThreadPool pool(threads);
+				const auto caseName = std::string(shape) + " write parallel, threads: " + std::to_string(threads);
+				measure(caseName.c_str(), [&](){
+					BufferSink output;
+					ParallelOStream<BufferSink>(&output, &pool).write(tree);
+				});
+			}
+			measure((std::string(shape) + " read").c_str(), [&](){
+				std::istringstream input(bytes);
+				Tree::IStream(&input).read();
+			});
+			std::string compactBytes;
+			measure((std::string(shape) + " write v2").c_str(), [&](){
+				std::ostringstream output(std::ios_base::binary);
+				CompactOStream<std::ostream>(&output).write(tree);
+				compactBytes = output.str();
+			});
+			measure((std::string(shape) + " read v2 span").c_str(), [&](){
+				Compact::SpanSource source(compactBytes.data(), compactBytes.size());
+				CompactIStream<Compact::SpanSource>(&source).read();
+			});
+			std::string arrayBytes;
+			measure((std::string(shape) + " write v2 arrays").c_str(), [&](){
+				BufferSink output;
+				CompactOStream<BufferSink>(&output, Compact::NUMERIC_ARRAYS).write(tree);
+				arrayBytes = std::move(output.buffer());
+			});
+			measure((std::string(shape) + " read v2 arrays").c_str(), [&](){
+				Compact::SpanSource source(arrayBytes.data(), arrayBytes.size());
+				CompactIStream<Compact::SpanSource>(&source).read();
+			});
+			std::string deltaBytes;
+			measure((std::string(shape) + " write v2 delta arrays").c_str(), [&](){
+				BufferSink output;
+				CompactOStream<BufferSink>(&output, Compact::NUMERIC_ARRAYS | Compact::DELTA_ARRAYS).write(tree);
+				deltaBytes = std::move(output.buffer());
+			});
+			measure((std::string(shape) + " read v2 delta arrays").c_str(), [&](){
+				Compact::SpanSource source(deltaBytes.data(), deltaBytes.size());
+				CompactIStream<Compact::SpanSource>(&source).read();
+			});
+			std::cout << shape << " size v2 arrays: " << arrayBytes.size()
+				<< " bytes, v2 delta arrays: " << deltaBytes.size() << " bytes" << std::endl;
+			std::string blockBytes;
+			measure((std::string(shape) + " write v1 lz blocks").c_str(), [&](){
+				BufferSink output;
+				{
+					Block::BlockSink<BufferSink> blocks(&output);
+					BasicOStream<Block::BlockSink<BufferSink>>(&blocks).write(tree);
+				}
+				blockBytes = std::move(output.buffer());
+			});
+			for(const unsigned threads : {1u, 4u})
+			{
+				ThreadPool pool(threads);
+				const auto caseName = std::string(shape) + " unpack lz blocks, threads: " + std::to_string(threads);
+				measure(caseName.c_str(), [&](){
+					std::string raw;
+					Block::Reader(blockBytes.data(), blockBytes.size()).read(raw, &pool);
+				});
+			}
+			std::cout << shape << " size v1: " << bytes.size()
+				<< " bytes, v2: " << compactBytes.size()
+				<< " bytes, v1 lz blocks: " << blockBytes.size() << " bytes" << std::endl;
+			for(const unsigned threads : {1u, 2u, 4u, 8u, 16u})
+			{
+				ThreadPool pool(threads);
+				const auto caseName = std::string(shape) + " read parallel, threads: " + std::to_string(threads);
+				measure(caseName.c_str(), [&](){
+					ParallelIStream(bytes.data(), bytes.size(), &pool).read();
+				});
+			}
+			measure((std::string(shape) + " read span").c_str(), [&](){
+				SpanReader(bytes).read();
+			});
+			measure((std::string(shape) + " read span columnar").c_str(), [&](){
+				ColumnarBuilder builder;
+				SpanReader(bytes).read(builder);
+				builder.finish();
+			});
+			Lazy::saveToFile("benchmark.tree", tree);
+			measure((std::string(shape) + " lazy open, last child").c_str(), [&](){
+				const auto lazy = Lazy::open("benchmark.tree");
+				lazy->child(lazy->childrenCount() - 1);
+			});
+			measure((std::string(shape) + " lazy visit").c_str(), [&](){
+				std::size_t count = 0;
+				Lazy::open("benchmark.tree")->visit([&count](Abstract const * ){ ++count; }, [](Abstract const * ){});
+			});
+			std::remove(Lazy::indexFileName("benchmark.tree").c_str());
+			measure((std::string(shape) + " lazy open without index, last child").c_str(), [&](){
+				const auto lazy = Lazy::open("benchmark.tree");
+				lazy->child(lazy->childrenCount() - 1);
+			});
+			std::remove("benchmark.tree");
+			measure((std::string(shape) + " traverse").c_str(), [&](){
+				std::size_t count = 0;
+				tree->traverse([&count](Abstract const * ){ ++count; }, [](Abstract const * ){});
+			});
+			measure((std::string(shape) + " visit").c_str(), [&](){
+				std::size_t count = 0;
+				tree->visit([&count](Abstract const * ){ ++count; }, [](Abstract const * ){});
+			});
+			const auto copy = SpanReader(bytes).read();
+			measure((std::string(shape) + " toText").c_str(), [&](){
+				tree->toText();
+			});
+			std::string quoted;
+			measure((std::string(shape) + " write text").c_str(), [&](){
+				quoted = tree->toQuotedText();
+			});
+			measure((std::string(shape) + " read text").c_str(), [&](){
+				TextReader(quoted).read();
+			});
+			// Отступ цепочки растёт с глубиной: текст квадратичен по size.
+			if(std::string(shape) == "wide")
+			{
+				measure((std::string(shape) + " printText").c_str(), [&](){
+					BufferSink output;
+					tree->printText(output);
+				});
+			}
+			bool isEqual = false;
+			measure((std::string(shape) + " isEqual by text").c_str(), [&](){
+				isEqual = tree->toText() == copy->toText();
+			});
+			measure((std::string(shape) + " isEqual").c_str(), [&](){
+				isEqual = tree->isEqual(copy) && isEqual;
+			});
+			if(!isEqual)
+			{
+				std::cout << shape << " copy is NOT equal to the tree" << std::endl;
+			}
+			measure((std::string(shape) + " structuralHash").c_str(), [&](){
+				tree->structuralHash();
+				copy->structuralHash();
+			});
+			measure((std::string(shape) + " destroy").c_str(), [&](){
+				tree.reset();
+			});
+		}
+
+		runLabelsBenchmark(size);
+		runConfigBenchmark(size);
+		runDeltaBenchmark(size);
+		runPersistentBenchmark(size);
+	}
+
+	/// Сбалансированное дерево: у каждого узла выше листьев fanout детей.
+	static Tree::TreePtr makeBalanced(const int fanout, const int depth)
+	{
+		using namespace Tree;
+
+		auto node = makeParent<Int>(depth > 1 ? fanout : 0, depth);
+		for(int i = 0; depth > 1 && i < fanout; ++i)
+		{
+			node + makeBalanced(fanout, depth - 1);
+		}
+		return node;
+	}
+
+	/// Писатель добавляет листья копированием пути и публикует корень
+	/// через AtomicTree, пока readers потоков без остановки берут снимки.
+	static void runPersistentBenchmark(const int size)
+	{
+		using namespace Tree;
+
+		const int fanout = 16;
+		int depth = 1;
+		for(long long count = 1, level = 1; count < size; ++depth)
+		{
+			level *= fanout;
+			count += level;
+		}
+		const TreeConstPtr tree = makeBalanced(fanout, depth);
+		const int updateCount = 10000;
+		std::mt19937 random(2021);
+		std::vector<std::vector<int>> paths(updateCount);
+		for(auto &path : paths)
+		{
+			for(int level = 1; level < depth; ++level)
+			{
+				path.push_back(random() % fanout);
+			}
+		}
+
+		TreeConstPtr updated = tree;
+		measure("persistent withChild x10000", [&](){
+			for(const auto &path : paths)
+			{
+				updated = Persistent::withChild(updated, path, makePtr<Int>(0));
+			}
+		});
+		for(const unsigned readerCount : {0u, 1u, 4u, 16u})
+		{
+			AtomicTree root(tree);
+			std::atomic<bool> isDone{false};
+			std::atomic<std::uint64_t> loads{0};
+			std::vector<std::thread> readers;
+			for(unsigned i = 0; i < readerCount; ++i)
+			{
+				readers.emplace_back([&](){
+					std::uint64_t count = 0;
+					while(!isDone.load(std::memory_order_relaxed))
+					{
+						count += root.load()->childrenCount() > 0;
+					}
+					loads += count;
+				});
+			}
+			const auto caseName = "persistent update x10000, readers: " + std::to_string(readerCount);
+			const auto start = std::chrono::steady_clock::now();
+			measure(caseName.c_str(), [&](){
+				for(const auto &path : paths)
+				{
+					root.update([&path](TreeConstPtr current){
+						return Persistent::withChild(current, path, makePtr<Int>(0));
+					});
+				}
+			});
+			isDone = true;
+			for(auto &reader : readers)
+			{
+				reader.join();
+			}
+			const auto ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			std::cout << "persistent loads, readers: " << readerCount << ": "
+				<< static_cast<std::uint64_t>(loads.load() / ms * 1000) << " per second" << std::endl;
+		}
+	}
+
+	/// Небольшая правка большого дерева: полная перезапись
+	/// против файла изменений поверх базового.
+	static void runDeltaBenchmark(const int size)
+	{
+		using namespace Tree;
+
+		auto tree = makeConfig(size / 8);
+		auto service = makePtr<String>("service");
+		tree + service;
+		Delta::saveBase("benchmark.tree", tree);
+		service + (makePtr<String>("host") + makePtr<String>("example.org"));
+		tree + makePtr<String>("added");
+		measure("delta full save after edit", [&](){
+			File::saveToFile("benchmark.full.tree", tree);
+		});
+		measure("delta save after edit", [&](){
+			Delta::save("benchmark.tree.1", tree);
+		});
+		measure("delta load", [&](){
+			Delta::load("benchmark.tree", {"benchmark.tree.1"});
+		});
+		std::ifstream full("benchmark.full.tree", std::ios_base::binary | std::ios_base::ate);
+		std::ifstream delta("benchmark.tree.1", std::ios_base::binary | std::ios_base::ate);
+		std::cout << "delta size full: " << full.tellg()
+			<< " bytes, delta: " << delta.tellg() << " bytes" << std::endl;
+		for(const auto fileName : {"benchmark.tree", "benchmark.full.tree", "benchmark.tree.1"})
+		{
+			std::remove(fileName);
+		}
+	}
+
+	/// Конфигурация из повторяющихся сервисов примерно на size узлов:
+	/// память обычного дерева и DAG и размер файла с общими поддеревьями.
+	static void runConfigBenchmark(const int size)
+	{
+		using namespace Tree;
+
+		std::string bytes;
+		{
+			std::ostringstream output(std::ios_base::binary);
+			Tree::OStream(&output).write(makeConfig(size / 8));
+			bytes = output.str();
+		}
+
+		TreePtr plain;
+		auto before = heapInUse();
+		measure("config read", [&](){
+			plain = SpanReader(bytes).read();
+		});
+		std::cout << "config heap: " << heapInUse() - before << " bytes" << std::endl;
+
+		TreeConstPtr dag;
+		before = heapInUse();
+		measure("config read dag", [&](){
+			DagBuilder builder;
+			SpanReader(bytes).read(builder);
+			dag = builder.finish();
+		});
+		std::cout << "config heap dag: " << heapInUse() - before << " bytes" << std::endl;
+
+		std::string compactBytes;
+		std::string sharedBytes;
+		measure("config write v2", [&](){
+			std::ostringstream output(std::ios_base::binary);
+			CompactOStream<std::ostream>(&output).write(dag);
+			compactBytes = output.str();
+		});
+		measure("config write v2 dag", [&](){
+			std::ostringstream output(std::ios_base::binary);
+			CompactOStream<std::ostream>(&output, Compact::optionsFor(Format::V2_DAG)).write(dag);
+			sharedBytes = output.str();
+		});
+		measure("config read v2 dag shared", [&](){
+			Compact::SpanSource source(sharedBytes.data(), sharedBytes.size());
+			CompactIStream<Compact::SpanSource>(&source).readShared();
+		});
+		plain.reset();
+		measure("config read v2 dag expanded", [&](){
+			Compact::SpanSource source(sharedBytes.data(), sharedBytes.size());
+			plain = CompactIStream<Compact::SpanSource>(&source).read();
+		});
+		std::cout << "config size v1: " << bytes.size()
+			<< " bytes, v2: " << compactBytes.size()
+			<< " bytes, v2 dag: " << sharedBytes.size() << " bytes" << std::endl;
+	}
+
+	/// Дерево из size строк, взятых из 16 меток: память Naive дерева
+	/// с обычными и интернированными строками и размер файла.
+	static void runLabelsBenchmark(const int size)
+	{
+		using namespace Tree;
+
+		std::string labels[16];
+		for(int i = 0; i < 16; ++i)
+		{
+			labels[i] = "production label number " + std::to_string(i);
+		}
+		std::string bytes;
+		{
+			auto tree = makePtr<String>("labels");
+			for(int i = 0; i < size; ++i)
+			{
+				tree + makePtr<String>(labels[(i * 7) % 16]);
+			}
+			std::ostringstream output(std::ios_base::binary);
+			Tree::OStream(&output).write(tree);
+			bytes = output.str();
+		}
+
+		TreePtr plain;
+		auto before = heapInUse();
+		measure("labels read", [&](){
+			plain = SpanReader(bytes).read();
+		});
+		std::cout << "labels heap: " << heapInUse() - before << " bytes" << std::endl;
+
+		StringPool pool;
+		TreePtr interned;
+		before = heapInUse();
+		measure("labels read interned", [&](){
+			NaiveBuilder builder(&pool);
+			SpanReader(bytes).read(builder);
+			interned = builder.finish();
+		});
+		std::cout << "labels heap interned: " << heapInUse() - before << " bytes" << std::endl;
+
+		measure("labels isEqual", [&](){
+			plain->isEqual(interned);
+		});
+		std::string compactBytes;
+		std::string dictionaryBytes;
+		measure("labels write v2", [&](){
+			std::ostringstream output(std::ios_base::binary);
+			CompactOStream<std::ostream>(&output).write(interned);
+			compactBytes = output.str();
+		});
+		measure("labels write v2 dictionary", [&](){
+			std::ostringstream output(std::ios_base::binary);
+			CompactOStream<std::ostream>(&output, Compact::STRING_DICTIONARY).write(interned);
+			dictionaryBytes = output.str();
+		});
+		plain.reset();
+		measure("labels read v2", [&](){
+			Compact::SpanSource source(compactBytes.data(), compactBytes.size());
+			plain = CompactIStream<Compact::SpanSource>(&source).read();
+		});
+		plain.reset();
+		measure("labels read v2 dictionary", [&](){
+			Compact::SpanSource source(dictionaryBytes.data(), dictionaryBytes.size());
+			plain = CompactIStream<Compact::SpanSource>(&source).read();
+		});
+		std::cout << "labels size v1: " << bytes.size()
+			<< " bytes, v2: " << compactBytes.size()
+			<< " bytes, v2 dictionary: " << dictionaryBytes.size() << " bytes" << std::endl;
+	}
+
+	static std::size_t heapInUse()
+	{
+		return mallinfo2().uordblks;
 	}
 
 	static void runBenchmark(const int depth)
@@ -357,6 +2245,9 @@ inline void printHelp()
 {
 	std::cout << "Usage: tree -i [INPUT_FILE] -o [OUTPUT_FILE]" << std::endl;
 	std::cout << "    or tree --run-tests" << std::endl;
+	std::cout << "    --to-text writes OUTPUT_FILE as quoted text instead of printing" << std::endl;
+	std::cout << "    --from-text reads INPUT_FILE as quoted text instead of printing" << std::endl;
+	std::cout << "    --stats prints counters to stderr (needs -DTREE_STATS=1)" << std::endl;
 }
 
 inline int notEnoughtArgsError()
@@ -377,6 +2268,9 @@ int main(int argc, char* argv[])
 {
 	std::string inputFileName;
 	std::string outputFileName;
+	bool isStatsRequested = false;
+	bool isToText = false;
+	bool isFromText = false;
 
 	for(int i = 0; i < argc; ++i)
 	{
@@ -391,6 +2285,23 @@ int main(int argc, char* argv[])
 			Tester::runBasicTreeBuildingBenchmark(std::stoi(argv[i + 1]));
 			return 0;
 		}
+		else if(arg == "--run-io-benchmarks" && i + 1 < argc)
+		{
+			Tester::runIOBenchmark(std::stoi(argv[i + 1]));
+			return 0;
+		}
+		else if(arg == "--stats")
+		{
+			isStatsRequested = true;
+		}
+		else if(arg == "--to-text")
+		{
+			isToText = true;
+		}
+		else if(arg == "--from-text")
+		{
+			isFromText = true;
+		}
 		else if(arg == "-i")
 		{
 			if(!inputFileName.empty())
@@ -432,15 +2343,33 @@ int main(int argc, char* argv[])
 		return notEnoughtArgsError();
 	}
 
-	auto tree = Tree::File::loadFromFile(inputFileName);
-	if(!tree)
+	const bool isConversion = isToText || isFromText;
+	auto tree = isFromText
+		? Tree::File::loadFromTextFile(inputFileName)
+		: Tree::File::loadFromFile(inputFileName);
+	if(!tree || (isConversion && tree->isEmpty()))
 	{
 		std::cout << "load file error" << std::endl;
 		printHelp();
 		return 3;
 	}
-	tree->print();
-	Tree::File::saveToFile(outputFileName, tree);
+	if(!isConversion)
+	{
+		Tree::Stats::Timer timer(Tree::Stats::Phase::PRINT);
+		tree->print();
+	}
+	const bool isSaved = isToText
+		? Tree::File::saveToTextFile(outputFileName, tree)
+		: Tree::File::saveToFile(outputFileName, tree);
+	if(isConversion && !isSaved)
+	{
+		std::cout << "save file error" << std::endl;
+		return 4;
+	}
+	if(isStatsRequested)
+	{
+		Tree::Stats::report(std::cerr);
+	}
 
 	return 0;
 }